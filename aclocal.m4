@@ -949,5 +949,6 @@ AC_SUBST([am__tar])
 AC_SUBST([am__untar])
 ]) # _AM_PROG_TAR
 
+m4_include([m4/io_uring.m4])
 m4_include([m4/pthread.m4])
 m4_include([m4/sendfile.m4])
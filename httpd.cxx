@@ -24,6 +24,7 @@
 #include "config.h"
 #endif
 #include "httpd.h"
+#include "uring.h"
 #include <time.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -39,6 +40,30 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <poll.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+#ifdef HAVE_LINUX_OPENAT2_H
+#include <linux/openat2.h>
+#endif
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
 #endif
 
 #if defined (__SVR4) && defined (__sun)
@@ -76,11 +101,28 @@ namespace tthttpd {
 
 #ifdef _WIN32
     typedef int socklen_t;
+#define strtoull(x, y, z) _strtoui64(x, y, z)
+#define SIZE_FORMAT "%I64u"
 #else
+#define SIZE_FORMAT "%llu"
 #define closesocket(x) close(x)
 #define strnicmp(x, y, z) strncasecmp(x, y, z)
 #endif
 
+#ifdef _WIN32
+    struct iovec {
+        void* iov_base;
+        size_t iov_len;
+    };
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+
 #if !defined(EWOULDBLOCK) && defined(WSAEWOULDBLOCK)
 #define EWOULDBLOCK WSAEWOULDBLOCK
 #endif
@@ -101,9 +143,34 @@ namespace tthttpd {
 #ifndef S_ISREG
 #define S_ISREG(x) (x & S_IFREG)
 #endif
+#ifndef S_ISDIR
+#define S_ISDIR(x) (x & S_IFDIR)
+#endif
 
 #define VERBOSE(x) (httpd->verbose_mode >= x)
 
+#define SEND_TIMEOUT 3000    /* msec to wait for a writable socket */
+#define RECV_TIMEOUT 30000   /* msec to wait for the rest of a request */
+#define ACCEPT_BATCH 64      /* accepts per listener wakeup */
+#define URING_ENTRIES 64     /* submission queue size of each ring */
+#define URING_RECV_BUFFERS 4 /* provided buffers for request heads per worker */
+#define MAX_HEADER_SIZE 16384 /* request line and headers, answered by 431 */
+#define PIPELINE_BATCH 16384  /* small responses held back for one write */
+#define SENDFILE_CHUNK (1024 * 1024) /* bytes sent before a worker yields */
+#define MAX_RANGES 16        /* more ranges than this get the whole file */
+#define WHEEL_TICK 250       /* msec per slot of the timer wheel */
+#define WHEEL_BITS 8         /* slots per level, as a power of two */
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 3       /* 64 sec, 4.6 hours, 48 days */
+#define FD_CACHE_SHARDS 16   /* locks of the open file cache */
+#define PATH_CACHE_SHARDS 16 /* locks of the path resolution cache */
+#define MEM_CACHE_SHARDS 16  /* locks of the small file cache */
+#define COMPRESS_MIN 256     /* smaller generated bodies go out as they are */
+#define ZIP_QUEUE 256        /* files waiting for the background compressor */
+#define LIST_BUFFER (64 * 1024) /* directory entries read per getdents64 */
+#define LIST_SPLIT 4096      /* fewest entries a listing thread stats */
+#define LIST_CHUNK 16384     /* listing rows sent per chunk */
+
 #if !defined(HAVE_GETADDRINFO) && defined(_WIN32_WINNT) && _WIN32_WINNT < 0x0501
     int inet_aton(const char *cp, struct in_addr *addr) {
         register unsigned int val;
@@ -310,6 +377,60 @@ namespace tthttpd {
     }
 #endif
 
+    // one part of a multipart/byteranges response: its boundary and
+    // headers, then length bytes of the file from offset.
+    typedef struct {
+        std::string head;
+        unsigned long long offset;
+        unsigned long long length;
+    } RES_PART;
+
+#ifndef _WIN32
+    struct FdCacheShard;
+
+    // an open static file, the stat it was opened with and its
+    // Last-Modified, formatted once.
+    typedef struct FD_ENTRY {
+        std::string path;
+        int fd;
+        struct stat st;
+        std::string file_time;
+        time_t checked;
+        int refs;
+        int wd;
+        bool cached;
+        FdCacheShard* shard;
+        struct FD_ENTRY *prev;
+        struct FD_ENTRY *next;
+    } FD_ENTRY;
+#endif
+
+    struct MemCacheShard;
+    struct MemArena;
+
+    // a static file held in memory with its entity headers, from
+    // Content-Type to ETag, ready to go out behind the status line. small
+    // files are copied into body, or into the cache's arena when it has
+    // one; mid-size ones are mapped, and data points into the mapping.
+    typedef struct MEM_ENTRY {
+        std::string path;
+        std::string head;
+        std::string body;
+        const char* data;
+        size_t length;
+        void* map;
+        MemArena* arena;
+        std::string file_time;
+        std::string etag;
+        struct stat st;
+        time_t made;  // of a listing, when it was rendered
+        int refs;
+        bool cached;
+        MemCacheShard* shard;
+        struct MEM_ENTRY *prev;
+        struct MEM_ENTRY *next;
+    } MEM_ENTRY;
+
     typedef struct {
 #ifdef _WIN32
         HANDLE read;
@@ -319,8 +440,20 @@ namespace tthttpd {
         int read;
         int write;
         pid_t process;
+        // files from the fd cache are shared, so they are read with
+        // pread at position and never seeked.
+        FD_ENTRY* cache;
+        unsigned long long position;
+        // of a static file, taken once when it is opened.
+        struct stat st;
 #endif
-        unsigned long size;
+        // a file from the memory cache is sent from its body.
+        MEM_ENTRY* mem;
+        // size bytes are sent from offset; for byteranges size is the
+        // whole body, made of the parts.
+        unsigned long long size;
+        unsigned long long offset;
+        std::vector<RES_PART> parts;
     } RES_INFO;
 
     bool operator<(const server::ListInfo& left, const server::ListInfo& right) {
@@ -354,39 +487,159 @@ namespace tthttpd {
         "Sat"};
 
 #ifdef _WIN32
-    static bool filetime2unixtime(const FILETIME* ft, struct tm* tm) {
-        FILETIME lt;
-        SYSTEMTIME st;
-
-        if (!FileTimeToLocalFileTime(ft, &lt)) return false;
-        if (!FileTimeToSystemTime(&lt, &st)) return false;
-        memset(tm, 0, sizeof(tm));
-        tm->tm_year = st.wYear - 1900;
-        tm->tm_mon = st.wMonth - 1;
-        tm->tm_mday = st.wDay;
-        tm->tm_hour = st.wHour;
-        tm->tm_min = st.wMinute;
-        tm->tm_sec = st.wSecond;
-        return true;
+    // FILETIME counts 100ns intervals since 1601.
+    static time_t filetime2unixtime(const FILETIME* ft) {
+        unsigned long long t = ((unsigned long long)ft->dwHighDateTime << 32) | ft->dwLowDateTime;
+        return (time_t)((t - 116444736000000000ULL) / 10000000ULL);
     }
 #endif
 
-    static std::string res_curtime(int diff = 0) {
-        time_t tt = time(NULL) + diff;
-        struct tm* p = gmtime(&tt);
+    // gmtime's static struct tm is shared by every thread, so the
+    // reentrant form is used.
+    static void res_gmtime(time_t tt, struct tm* t) {
+#ifdef _WIN32
+        gmtime_s(t, &tt);
+#else
+        gmtime_r(&tt, t);
+#endif
+    }
 
-        char buf[256];
+    // the IMF-fixdate of tt into buf, which holds at least 30 bytes.
+    static void http_date(time_t tt, char* buf) {
+        struct tm t;
+        res_gmtime(tt, &t);
         sprintf(buf, "%s, %02d %s %04d %02d:%02d:%02d GMT",
-                wdays[p->tm_wday],
-                p->tm_mday,
-                months[p->tm_mon],
-                p->tm_year+1900,
-                p->tm_hour,
-                p->tm_min,
-                p->tm_sec);
+                wdays[t.tm_wday],
+                t.tm_mday,
+                months[t.tm_mon],
+                t.tm_year+1900,
+                t.tm_hour,
+                t.tm_min,
+                t.tm_sec);
+    }
+
+#ifndef _WIN32
+#define CLOCK_SLOTS 8
+
+    // the Date header, formatted once a second. the acceptors advance the
+    // clock on their tick and publish the new slot by swapping a pointer,
+    // so a response only copies the current string. a slot is written
+    // again CLOCK_SLOTS seconds after it was published, long after any
+    // reader is done with it.
+    typedef struct {
+        time_t t;
+        char str[32];
+    } CLOCK_SLOT;
+
+    static CLOCK_SLOT clock_slots[CLOCK_SLOTS];
+    static CLOCK_SLOT* volatile clock_current = NULL;
+    static unsigned int clock_next = 0;
+
+    static const char* clock_tick() {
+        time_t now = time(NULL);
+        CLOCK_SLOT* slot = clock_current;
+        if (slot && slot->t == now)
+            return slot->str;
+        slot = &clock_slots[__sync_fetch_and_add(&clock_next, 1) % CLOCK_SLOTS];
+        slot->t = now;
+        http_date(now, slot->str);
+        __sync_synchronize();
+        clock_current = slot;
+        return slot->str;
+    }
+
+    static const char* res_curtime() {
+        CLOCK_SLOT* slot = clock_current;
+        return slot ? slot->str : clock_tick();
+    }
+#else
+    static std::string res_curtime() {
+        char buf[32];
+        http_date(time(NULL), buf);
+        return buf;
+    }
+#endif
+
+    static std::string res_ftime(time_t tt) {
+        char buf[32];
+        http_date(tt, buf);
+        return buf;
+    }
+
+    // an HTTP-date in any of its three forms: the IMF-fixdate of
+    // res_ftime, the obsolete RFC 850 form, or asctime's. -1 when it is
+    // none of them.
+    static time_t parse_http_date(const std::string& value) {
+        int day, year, hour, min, sec;
+        char mon[4];
+        const char* comma = strchr(value.c_str(), ',');
+        if (comma) {
+            if (sscanf(comma + 1, " %2d %3s %4d %2d:%2d:%2d", &day, mon, &year, &hour, &min, &sec) != 6
+                    && sscanf(comma + 1, " %2d-%3[A-Za-z]-%4d %2d:%2d:%2d", &day, mon, &year, &hour, &min, &sec) != 6)
+                return -1;
+        } else if (sscanf(value.c_str(), "%*s %3s %d %d:%d:%d %d", mon, &day, &hour, &min, &sec, &year) != 6)
+            return -1;
+        if (year < 70)
+            year += 2000;
+        else if (year < 100)
+            year += 1900;
+        int m = 0;
+        while (m < 12 && stricmp(months[m], mon))
+            m++;
+        if (m == 12 || day < 1 || day > 31 || hour > 23 || min > 59 || sec > 60)
+            return -1;
+        // days since the epoch of the civil date, without the local time
+        // zone of mktime.
+        long y = year - (m < 2);
+        long era = (y >= 0 ? y : y - 399) / 400;
+        long yoe = y - era * 400;
+        long doy = (153 * (m + (m > 1 ? -2 : 10)) + 2) / 5 + day - 1;
+        long days = era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+        return (time_t)days * 86400 + hour * 3600 + min * 60 + sec;
+    }
+
+    // a weak validator from the identity, size and mtime of a file.
+    static std::string res_etag(const struct stat& st) {
+        char buf[64];
+        sprintf(buf, "W/\"%llx-%llx-%llx\"", (unsigned long long)st.st_ino,
+                (unsigned long long)st.st_size, (unsigned long long)st.st_mtime);
         return buf;
     }
 
+    // the Last-Modified of an opened file of stat st, as formatted once by
+    // the cache holding it, if any.
+    static std::string res_file_time(const RES_INFO* res_info, const struct stat& st) {
+        if (res_info->mem)
+            return res_info->mem->file_time;
+#ifndef _WIN32
+        if (res_info->cache)
+            return res_info->cache->file_time;
+#endif
+        return res_ftime(st.st_mtime);
+    }
+
+    // the headers describing a static body, as kept by the memory cache.
+    static void res_entity_head(std::string& head, const std::string& type, unsigned long long length,
+            const std::string& file_time, const std::string& etag) {
+        char buf[32];
+        if (!type.empty()) {
+            head += "Content-Type: ";
+            head += type;
+            head += "\r\n";
+        }
+        sprintf(buf, SIZE_FORMAT, length);
+        head += "Accept-Ranges: bytes\r\n";
+        head += "Content-Length: ";
+        head += buf;
+        head += "\r\n";
+        head += "Last-Modified: ";
+        head += file_time;
+        head += "\r\n";
+        head += "ETag: ";
+        head += etag;
+        head += "\r\n";
+    }
+
     static void my_perror(std::string mes) {
 #ifdef _WIN32
         void*  pMsgBuf;
@@ -410,8 +663,711 @@ namespace tthttpd {
 #endif
     }
 
+#ifndef _WIN32
+    // open descriptors of static files, shared by every request for the
+    // same resolved path. an entry is referenced by each response using
+    // it; one which is evicted or found stale while in use is closed by
+    // its last user. entries are checked against the file every
+    // fd_cache_check seconds, and at once when inotify reports a change.
+    struct FdCacheShard {
+        pthread_mutex_t lock;
+        std::map<std::string, FD_ENTRY*> entries;
+        FD_ENTRY* head;
+        FD_ENTRY* tail;
+        int open;
+    };
+
+    struct FdCache {
+        FdCacheShard shards[FD_CACHE_SHARDS];
+        int max_open;
+        int check;
+        int inotify;
+        pthread_mutex_t watch_lock;
+        std::multimap<int, std::string> watches;
+        volatile unsigned long hits;
+        volatile unsigned long misses;
+    };
+
+    static FdCache* fd_cache_create(server* httpd) {
+        if (httpd->fd_cache_size <= 0)
+            return NULL;
+        FdCache* cache = new FdCache;
+        for (int n = 0; n < FD_CACHE_SHARDS; n++) {
+            pthread_mutex_init(&cache->shards[n].lock, NULL);
+            cache->shards[n].head = cache->shards[n].tail = NULL;
+            cache->shards[n].open = 0;
+        }
+        cache->max_open = httpd->fd_cache_size / FD_CACHE_SHARDS;
+        if (cache->max_open <= 0)
+            cache->max_open = 1;
+        cache->check = httpd->fd_cache_check;
+        pthread_mutex_init(&cache->watch_lock, NULL);
+        cache->hits = cache->misses = 0;
+        cache->inotify = -1;
+#ifdef HAVE_SYS_INOTIFY_H
+        cache->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+        return cache;
+    }
+
+    // FNV-1a, to pick the shard of a cache.
+    static unsigned int string_hash(const std::string& str) {
+        unsigned int hash = 2166136261U;
+        for (size_t n = 0; n < str.size(); n++)
+            hash = (hash ^ (unsigned char)str[n]) * 16777619U;
+        return hash;
+    }
+
+    static FdCacheShard* fd_cache_shard(FdCache* cache, const std::string& path) {
+        return &cache->shards[string_hash(path) % FD_CACHE_SHARDS];
+    }
+
+    static void fd_cache_unwatch(FdCache* cache, FD_ENTRY* entry) {
+#ifdef HAVE_SYS_INOTIFY_H
+        if (entry->wd < 0)
+            return;
+        // hard links share a watch.
+        pthread_mutex_lock(&cache->watch_lock);
+        std::multimap<int, std::string>::iterator it = cache->watches.lower_bound(entry->wd);
+        while (it != cache->watches.end() && it->first == entry->wd && it->second != entry->path)
+            it++;
+        if (it != cache->watches.end() && it->first == entry->wd)
+            cache->watches.erase(it);
+        if (cache->watches.find(entry->wd) == cache->watches.end())
+            inotify_rm_watch(cache->inotify, entry->wd);
+        pthread_mutex_unlock(&cache->watch_lock);
+        entry->wd = -1;
+#endif
+    }
+
+    // caller holds the shard lock.
+    static void fd_cache_drop(FdCache* cache, FdCacheShard* shard, FD_ENTRY* entry) {
+        shard->entries.erase(entry->path);
+        if (entry->prev)
+            entry->prev->next = entry->next;
+        else
+            shard->head = entry->next;
+        if (entry->next)
+            entry->next->prev = entry->prev;
+        else
+            shard->tail = entry->prev;
+        entry->prev = entry->next = NULL;
+        entry->cached = false;
+        fd_cache_unwatch(cache, entry);
+        if (entry->refs == 0) {
+            close(entry->fd);
+            shard->open--;
+            delete entry;
+        }
+    }
+
+    static void fd_cache_release(FD_ENTRY* entry) {
+        FdCacheShard* shard = entry->shard;
+        pthread_mutex_lock(&shard->lock);
+        if (--entry->refs == 0 && !entry->cached) {
+            close(entry->fd);
+            shard->open--;
+            delete entry;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    // a referenced entry for the path. NULL with errno set when the file
+    // cannot be opened, and with errno 0 when the cache is full of
+    // descriptors in use, so the caller should open its own. a caller
+    // which has just opened and fstat'ed the file passes both in; the
+    // descriptor is then the cache's, or still the caller's on NULL.
+    static FD_ENTRY* fd_cache_acquire(FdCache* cache, const std::string& path,
+            int opened = -1, const struct stat* opened_st = NULL) {
+        FdCacheShard* shard = fd_cache_shard(cache, path);
+        time_t now = time(NULL);
+        struct stat st;
+        std::map<std::string, FD_ENTRY*>::iterator it;
+
+        pthread_mutex_lock(&shard->lock);
+        it = opened < 0 ? shard->entries.find(path) : shard->entries.end();
+        if (it != shard->entries.end()) {
+            FD_ENTRY* entry = it->second;
+            if (now - entry->checked >= cache->check) {
+                if (stat(path.c_str(), &st) || st.st_ino != entry->st.st_ino
+                        || st.st_dev != entry->st.st_dev || st.st_size != entry->st.st_size
+                        || st.st_mtime != entry->st.st_mtime) {
+                    fd_cache_drop(cache, shard, entry);
+                    entry = NULL;
+                } else
+                    entry->checked = now;
+            }
+            if (entry) {
+                if (entry->prev) {
+                    entry->prev->next = entry->next;
+                    if (entry->next)
+                        entry->next->prev = entry->prev;
+                    else
+                        shard->tail = entry->prev;
+                    entry->prev = NULL;
+                    entry->next = shard->head;
+                    shard->head->prev = entry;
+                    shard->head = entry;
+                }
+                entry->refs++;
+                pthread_mutex_unlock(&shard->lock);
+                __sync_fetch_and_add(&cache->hits, 1);
+                return entry;
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
+        __sync_fetch_and_add(&cache->misses, 1);
+
+        // open outside the lock; whoever inserts first wins.
+        int fd = opened;
+        if (fd >= 0)
+            st = *opened_st;
+        else {
+            fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+                return NULL;
+            if (fstat(fd, &st)) {
+                close(fd);
+                return NULL;
+            }
+        }
+
+        pthread_mutex_lock(&shard->lock);
+        it = shard->entries.find(path);
+        if (it != shard->entries.end() && it->second->st.st_ino == st.st_ino
+                && it->second->st.st_mtime == st.st_mtime && it->second->st.st_size == st.st_size) {
+            FD_ENTRY* entry = it->second;
+            entry->refs++;
+            pthread_mutex_unlock(&shard->lock);
+            close(fd);
+            return entry;
+        }
+        if (it != shard->entries.end())
+            fd_cache_drop(cache, shard, it->second);
+        for (FD_ENTRY* victim = shard->tail; victim && shard->open >= cache->max_open; ) {
+            FD_ENTRY* prev = victim->prev;
+            if (victim->refs == 0)
+                fd_cache_drop(cache, shard, victim);
+            victim = prev;
+        }
+        if (shard->open >= cache->max_open) {
+            pthread_mutex_unlock(&shard->lock);
+            if (opened < 0)
+                close(fd);
+            errno = 0;
+            return NULL;
+        }
+
+        FD_ENTRY* entry = new FD_ENTRY;
+        entry->path = path;
+        entry->fd = fd;
+        entry->st = st;
+        entry->file_time = res_ftime(st.st_mtime);
+        entry->checked = now;
+        entry->refs = 1;
+        entry->cached = true;
+        entry->shard = shard;
+        entry->wd = -1;
+#ifdef HAVE_SYS_INOTIFY_H
+        if (cache->inotify >= 0) {
+            entry->wd = inotify_add_watch(cache->inotify, path.c_str(),
+                    IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+            if (entry->wd >= 0) {
+                pthread_mutex_lock(&cache->watch_lock);
+                cache->watches.insert(std::make_pair(entry->wd, path));
+                pthread_mutex_unlock(&cache->watch_lock);
+            }
+        }
+#endif
+        entry->prev = NULL;
+        entry->next = shard->head;
+        if (shard->head)
+            shard->head->prev = entry;
+        else
+            shard->tail = entry;
+        shard->head = entry;
+        shard->entries[path] = entry;
+        shard->open++;
+        pthread_mutex_unlock(&shard->lock);
+        return entry;
+    }
+
+    // drops the entries inotify reported as changed. called by the
+    // acceptors on every tick of their timer wheel.
+    static void fd_cache_poll(FdCache* cache) {
+#ifdef HAVE_SYS_INOTIFY_H
+        char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        if (!cache || cache->inotify < 0)
+            return;
+        while (true) {
+            ssize_t len = read(cache->inotify, buf, sizeof(buf));
+            if (len <= 0)
+                break;
+            for (char* ptr = buf; ptr < buf + len; ) {
+                struct inotify_event* event = (struct inotify_event*)ptr;
+                ptr += sizeof(struct inotify_event) + event->len;
+                if (event->mask & IN_IGNORED)
+                    continue;
+                std::vector<std::string> paths;
+                pthread_mutex_lock(&cache->watch_lock);
+                std::multimap<int, std::string>::iterator it = cache->watches.lower_bound(event->wd);
+                for (; it != cache->watches.end() && it->first == event->wd; it++)
+                    paths.push_back(it->second);
+                pthread_mutex_unlock(&cache->watch_lock);
+                for (size_t n = 0; n < paths.size(); n++) {
+                    FdCacheShard* shard = fd_cache_shard(cache, paths[n]);
+                    pthread_mutex_lock(&shard->lock);
+                    std::map<std::string, FD_ENTRY*>::iterator found = shard->entries.find(paths[n]);
+                    if (found != shard->entries.end() && found->second->wd == event->wd)
+                        fd_cache_drop(cache, shard, found->second);
+                    pthread_mutex_unlock(&shard->lock);
+                }
+            }
+        }
+#endif
+    }
+
+    static void fd_cache_stats(FdCache* cache) {
+        int open = 0;
+        for (int n = 0; n < FD_CACHE_SHARDS; n++)
+            open += cache->shards[n].open;
+        printf("* fd cache: %d/%d open, hits: %lu, misses: %lu\n",
+                open, cache->max_open * FD_CACHE_SHARDS, cache->hits, cache->misses);
+    }
+
+    // static files, whole, with their entity headers. an entry is good
+    // while the stat the request resolved to (from the path cache, or
+    // fresh) still matches the one it was read with. each shard is an LRU
+    // list within its part of the cache bytes; like the fd cache, an entry
+    // evicted while a response sends from it is freed by its last user.
+    // there are two of these, one per size class: the mem cache copies
+    // files up to mem_cache_file bytes, and the map cache maps those above
+    // that, up to map_cache_file. larger files go out with sendfile.
+    struct MemCacheShard {
+        pthread_mutex_t lock;
+        std::map<std::string, MEM_ENTRY*> entries;
+        MEM_ENTRY* head;
+        MEM_ENTRY* tail;
+        unsigned long long bytes;
+        int count;
+    };
+
+    // one mapping for the bodies of the mem cache, registered with each
+    // worker's ring so that hits go out from fixed buffers. the free
+    // blocks are kept by offset and merged as entries are freed; when none
+    // is large enough, the entry goes on the heap instead.
+    struct MemArena {
+        char* base;
+        size_t size;
+        pthread_mutex_t lock;
+        std::map<size_t, size_t> free;
+    };
+
+    struct MemCache {
+        MemCacheShard shards[MEM_CACHE_SHARDS];
+        const char* name;
+        bool map;
+        MemArena* arena;
+        unsigned long long max_bytes;
+        unsigned long long min_file;
+        unsigned long long max_file;
+        volatile unsigned long hits;
+        volatile unsigned long misses;
+    };
+
+    static MemCache* mem_cache_create(const char* name, long size, long min_file, long max_file, bool map) {
+        if (size <= 0 || max_file <= min_file)
+            return NULL;
+        MemCache* cache = new MemCache;
+        for (int n = 0; n < MEM_CACHE_SHARDS; n++) {
+            pthread_mutex_init(&cache->shards[n].lock, NULL);
+            cache->shards[n].head = cache->shards[n].tail = NULL;
+            cache->shards[n].bytes = 0;
+            cache->shards[n].count = 0;
+        }
+        cache->name = name;
+        cache->map = map;
+        cache->max_bytes = (unsigned long long)size / MEM_CACHE_SHARDS;
+        cache->min_file = min_file > 0 ? min_file : 0;
+        cache->max_file = max_file;
+        if (cache->max_file > cache->max_bytes)
+            cache->max_file = cache->max_bytes;
+        cache->hits = cache->misses = 0;
+        cache->arena = NULL;
+        return cache;
+    }
+
+    static MemArena* mem_arena_create(size_t size) {
+        void* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED)
+            return NULL;
+        MemArena* arena = new MemArena;
+        arena->base = (char*)base;
+        arena->size = size;
+        pthread_mutex_init(&arena->lock, NULL);
+        arena->free[0] = size;
+        return arena;
+    }
+
+    // first fit, in 64 byte units.
+    static char* mem_arena_alloc(MemArena* arena, size_t length) {
+        length = (length + 63) & ~(size_t)63;
+        char* ptr = NULL;
+        pthread_mutex_lock(&arena->lock);
+        for (std::map<size_t, size_t>::iterator it = arena->free.begin(); it != arena->free.end(); it++) {
+            if (it->second < length)
+                continue;
+            size_t offset = it->first, left = it->second - length;
+            arena->free.erase(it);
+            if (left)
+                arena->free[offset + length] = left;
+            ptr = arena->base + offset;
+            break;
+        }
+        pthread_mutex_unlock(&arena->lock);
+        return ptr;
+    }
+
+    static void mem_arena_free(MemArena* arena, const char* ptr, size_t length) {
+        size_t offset = ptr - arena->base;
+        length = (length + 63) & ~(size_t)63;
+        pthread_mutex_lock(&arena->lock);
+        std::map<size_t, size_t>::iterator next = arena->free.lower_bound(offset);
+        if (next != arena->free.end() && offset + length == next->first) {
+            length += next->second;
+            arena->free.erase(next++);
+        }
+        if (next != arena->free.begin()) {
+            std::map<size_t, size_t>::iterator prev = next;
+            prev--;
+            if (prev->first + prev->second == offset) {
+                prev->second += length;
+                pthread_mutex_unlock(&arena->lock);
+                return;
+            }
+        }
+        arena->free[offset] = length;
+        pthread_mutex_unlock(&arena->lock);
+    }
+
+    static MemCacheShard* mem_cache_shard(MemCache* cache, const std::string& path) {
+        return &cache->shards[string_hash(path) % MEM_CACHE_SHARDS];
+    }
+
+    static bool mem_cache_same(const struct stat& a, const struct stat& b) {
+        return a.st_ino == b.st_ino && a.st_dev == b.st_dev
+            && a.st_size == b.st_size && a.st_mtime == b.st_mtime;
+    }
+
+    // whether a file of this size belongs to the cache's size class.
+    static bool mem_cache_fits(MemCache* cache, const struct stat& st) {
+        return S_ISREG(st.st_mode) && (unsigned long long)st.st_size > cache->min_file
+            && (unsigned long long)st.st_size <= cache->max_file;
+    }
+
+    static void mem_cache_free(MEM_ENTRY* entry) {
+        if (entry->map)
+            munmap(entry->map, entry->length);
+        else if (entry->arena)
+            mem_arena_free(entry->arena, entry->data, entry->length);
+        delete entry;
+    }
+
+    // caller holds the shard lock.
+    static void mem_cache_drop(MemCacheShard* shard, MEM_ENTRY* entry) {
+        shard->entries.erase(entry->path);
+        if (entry->prev)
+            entry->prev->next = entry->next;
+        else
+            shard->head = entry->next;
+        if (entry->next)
+            entry->next->prev = entry->prev;
+        else
+            shard->tail = entry->prev;
+        entry->prev = entry->next = NULL;
+        entry->cached = false;
+        shard->bytes -= entry->length;
+        shard->count--;
+        if (entry->refs == 0)
+            mem_cache_free(entry);
+    }
+
+    static void mem_cache_release(MEM_ENTRY* entry) {
+        MemCacheShard* shard = entry->shard;
+        pthread_mutex_lock(&shard->lock);
+        bool gone = --entry->refs == 0 && !entry->cached;
+        pthread_mutex_unlock(&shard->lock);
+        if (gone)
+            mem_cache_free(entry);
+    }
+
+    // a referenced entry for the file the request resolved to, or NULL.
+    // an entry whose file has changed is dropped, and its mapping goes
+    // with the last response sending from it. the caller has chosen the
+    // cache by mem_cache_fits, or keeps other than files in it.
+    static MEM_ENTRY* mem_cache_acquire(MemCache* cache, const std::string& path, const struct stat& st) {
+        MemCacheShard* shard = mem_cache_shard(cache, path);
+        pthread_mutex_lock(&shard->lock);
+        std::map<std::string, MEM_ENTRY*>::iterator it = shard->entries.find(path);
+        MEM_ENTRY* entry = it != shard->entries.end() ? it->second : NULL;
+        if (entry && !mem_cache_same(entry->st, st)) {
+            mem_cache_drop(shard, entry);
+            entry = NULL;
+        }
+        if (entry) {
+            if (entry->prev) {
+                entry->prev->next = entry->next;
+                if (entry->next)
+                    entry->next->prev = entry->prev;
+                else
+                    shard->tail = entry->prev;
+                entry->prev = NULL;
+                entry->next = shard->head;
+                shard->head->prev = entry;
+                shard->head = entry;
+            }
+            entry->refs++;
+        }
+        pthread_mutex_unlock(&shard->lock);
+        __sync_fetch_and_add(entry ? &cache->hits : &cache->misses, 1);
+        return entry;
+    }
+
+    // adds a new entry, filled in up to its refs, in place of any other of
+    // its path, and makes room for it.
+    static void mem_cache_insert(MemCache* cache, MEM_ENTRY* entry) {
+        MemCacheShard* shard = mem_cache_shard(cache, entry->path);
+        entry->shard = shard;
+        entry->cached = true;
+        pthread_mutex_lock(&shard->lock);
+        std::map<std::string, MEM_ENTRY*>::iterator it = shard->entries.find(entry->path);
+        if (it != shard->entries.end())
+            mem_cache_drop(shard, it->second);
+        while (shard->tail && shard->bytes + entry->length > cache->max_bytes)
+            mem_cache_drop(shard, shard->tail);
+        entry->prev = NULL;
+        entry->next = shard->head;
+        if (shard->head)
+            shard->head->prev = entry;
+        else
+            shard->tail = entry;
+        shard->head = entry;
+        shard->entries[entry->path] = entry;
+        shard->bytes += entry->length;
+        shard->count++;
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    // reads or maps a file the response has just opened into a new entry,
+    // which the response sends from. NULL when the file is not of the
+    // cache's size class or changes while it is read.
+    static MEM_ENTRY* mem_cache_fill(MemCache* cache, const std::string& path, RES_INFO* res_info,
+            const std::string& head, const std::string& file_time, const std::string& etag) {
+        const struct stat& st = res_info->st;
+        if (!mem_cache_fits(cache, st))
+            return NULL;
+        MEM_ENTRY* entry = new MEM_ENTRY;
+        entry->length = (size_t)st.st_size;
+        entry->map = NULL;
+        entry->arena = NULL;
+        size_t got = 0;
+        if (cache->map) {
+            void* map = mmap(NULL, entry->length, PROT_READ, MAP_SHARED, res_info->read, 0);
+            if (map == MAP_FAILED) {
+                delete entry;
+                return NULL;
+            }
+            // the whole file is going out, front to back, and soon.
+            madvise(map, entry->length, MADV_SEQUENTIAL);
+            madvise(map, entry->length, MADV_WILLNEED);
+            entry->map = map;
+            entry->data = (const char*)map;
+            got = entry->length;
+        } else {
+            char* data = cache->arena ? mem_arena_alloc(cache->arena, entry->length) : NULL;
+            if (data)
+                entry->arena = cache->arena;
+            else {
+                entry->body.resize(entry->length);
+                data = &entry->body[0];
+            }
+            entry->data = data;
+            while (got < entry->length) {
+                ssize_t r = pread(res_info->read, data + got, entry->length - got, (off_t)got);
+                if (r < 0 && errno == EINTR)
+                    continue;
+                if (r <= 0)
+                    break;
+                got += r;
+            }
+        }
+        struct stat after;
+        if (got != entry->length || fstat(res_info->read, &after) || !mem_cache_same(after, st)) {
+            mem_cache_free(entry);
+            return NULL;
+        }
+        entry->path = path;
+        entry->head = head;
+        entry->file_time = file_time;
+        entry->etag = etag;
+        entry->st = st;
+        entry->refs = 1;
+        mem_cache_insert(cache, entry);
+        return entry;
+    }
+
+    // a response sending a cached file from memory, without opening it.
+    static RES_INFO* mem_cache_open(MemCache* cache, const std::string& path, const struct stat& st) {
+        MEM_ENTRY* entry = mem_cache_acquire(cache, path, st);
+        if (!entry)
+            return NULL;
+        RES_INFO* res_info = new RES_INFO;
+        res_info->read = 0;
+        res_info->write = 0;
+        res_info->process = 0;
+        res_info->size = (unsigned long long)-1;
+        res_info->offset = 0;
+        res_info->mem = entry;
+        res_info->cache = NULL;
+        res_info->position = 0;
+        // the entry is checked against the stat of its source file, but
+        // a compressed variant sends fewer bytes than that.
+        res_info->st = entry->st;
+        res_info->st.st_size = (off_t)entry->length;
+        return res_info;
+    }
+
+    // the cache for a file of this size, by the mem_cache_file and
+    // map_cache_file bounds, or NULL for sendfile.
+    static MemCache* mem_cache_class(server* httpd, const struct stat& st) {
+        if (httpd->memcache && mem_cache_fits(httpd->memcache, st))
+            return httpd->memcache;
+        if (httpd->mapcache && mem_cache_fits(httpd->mapcache, st))
+            return httpd->mapcache;
+        return NULL;
+    }
+
+    static void mem_cache_stats(MemCache* cache) {
+        unsigned long long bytes = 0;
+        int count = 0;
+        for (int n = 0; n < MEM_CACHE_SHARDS; n++) {
+            bytes += cache->shards[n].bytes;
+            count += cache->shards[n].count;
+        }
+        printf("* %s cache: %d files, " SIZE_FORMAT "/" SIZE_FORMAT " bytes, hits: %lu, misses: %lu\n",
+                cache->name, count, bytes, cache->max_bytes * MEM_CACHE_SHARDS, cache->hits, cache->misses);
+    }
+#endif
+
+#define MIME_EXT_MAX 16
+
+    // server::mime_types compiled at startup into two open-addressed
+    // tables keyed on the lowercased extension, one of mime types and one
+    // of the handlers of cgi ('@' types). they never change afterwards,
+    // so lookups take no lock, and a path costs one hash of its final
+    // extension.
+    typedef struct {
+        std::string ext;
+        std::string type;
+    } MIME_SLOT;
+
+    typedef struct {
+        std::vector<MIME_SLOT> slots;
+        size_t mask;
+        size_t count;
+    } MIME_HASH;
+
+    struct MimeTable {
+        MIME_HASH types;
+        MIME_HASH handlers;
+    };
+
+    static unsigned int mime_hash(const char* ext, size_t len) {
+        unsigned int h = 2166136261u;
+        for (size_t n = 0; n < len; n++)
+            h = (h ^ (unsigned char)ext[n]) * 16777619u;
+        return h;
+    }
+
+    // the extension of path after its last '.', lowercased into ext.
+    // false when the last component has none, or one too long to be in
+    // the tables.
+    static bool mime_ext(const std::string& path, char* ext, size_t& len) {
+        size_t dot = path.find_last_of("./");
+        if (dot == std::string::npos || path[dot] != '.')
+            return false;
+        len = path.size() - dot - 1;
+        if (len == 0 || len >= MIME_EXT_MAX)
+            return false;
+        for (size_t n = 0; n < len; n++) {
+            char c = path[dot + 1 + n];
+            ext[n] = c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+        }
+        return true;
+    }
+
+    static const std::string* mime_hash_find(const MIME_HASH& hash, const char* ext, size_t len, unsigned int h) {
+        if (!hash.count)
+            return NULL;
+        for (size_t n = h & hash.mask; !hash.slots[n].ext.empty(); n = (n + 1) & hash.mask) {
+            const std::string& key = hash.slots[n].ext;
+            if (key.size() == len && !memcmp(key.data(), ext, len))
+                return &hash.slots[n].type;
+        }
+        return NULL;
+    }
+
+    static void mime_hash_insert(MIME_HASH& hash, const std::string& ext, const std::string& type) {
+        size_t n = mime_hash(ext.data(), ext.size()) & hash.mask;
+        while (!hash.slots[n].ext.empty() && hash.slots[n].ext != ext)
+            n = (n + 1) & hash.mask;
+        if (hash.slots[n].ext.empty())
+            hash.count++;
+        hash.slots[n].ext = ext;
+        hash.slots[n].type = type;
+    }
+
+    static MimeTable* mime_table_create(server* httpd) {
+        MimeTable* table = new MimeTable;
+        size_t size = 8;
+        while (size < httpd->mime_types.size() * 2)
+            size *= 2;
+        table->types.slots.resize(size);
+        table->types.mask = size - 1;
+        table->types.count = 0;
+        table->handlers.slots.resize(size);
+        table->handlers.mask = size - 1;
+        table->handlers.count = 0;
+        server::MimeTypes::iterator it_mime;
+        for(it_mime = httpd->mime_types.begin(); it_mime != httpd->mime_types.end(); it_mime++) {
+            char ext[MIME_EXT_MAX];
+            size_t len;
+            if (it_mime->second.empty() || !mime_ext("." + it_mime->first, ext, len))
+                continue;
+            mime_hash_insert(it_mime->second[0] == '@' ? table->handlers : table->types,
+                    std::string(ext, len), it_mime->second);
+        }
+        return table;
+    }
+
+    // the handler of a cgi for the extension of path, else its mime type
+    // unless handler_only; NULL when there is neither.
+    static const std::string* mime_table_find(const MimeTable* table, const std::string& path, bool handler_only = false) {
+        char ext[MIME_EXT_MAX];
+        size_t len;
+        if (!mime_ext(path, ext, len))
+            return NULL;
+        unsigned int h = mime_hash(ext, len);
+        const std::string* type = mime_hash_find(table->handlers, ext, len, h);
+        if (!type && !handler_only)
+            type = mime_hash_find(table->types, ext, len, h);
+        return type;
+    }
+
 #ifdef _WIN32
-    static RES_INFO* res_fopen(std::string& file) {
+    // there is no fd cache on windows, and nothing is opened in advance.
+    static RES_INFO* res_fopen(std::string& file, FdCache* cache = NULL,
+            int opened = -1, const struct stat* st = NULL) {
         HANDLE hFile;
         hFile = CreateFileA(
                 file.c_str(),
@@ -428,21 +1384,18 @@ namespace tthttpd {
         res_info->read = hFile;
         res_info->write = 0;
         res_info->process = 0;
-        res_info->size = (unsigned long)-1;
+        res_info->size = (unsigned long long)-1;
+        res_info->offset = 0;
+        res_info->mem = NULL;
         return res_info;
     }
 
-    static bool res_isfile(std::string& file) {
-        DWORD dwAttr = GetFileAttributesA(file.c_str());
-        return (dwAttr != (DWORD)-1 && !(dwAttr & FILE_ATTRIBUTE_DIRECTORY));
-    }
-
     static bool res_isdir(std::string& file) {
         DWORD dwAttr = GetFileAttributesA(file.c_str());
         return (dwAttr != (DWORD)-1 && (dwAttr & FILE_ATTRIBUTE_DIRECTORY));
     }
 
-    static bool res_isexe(std::string& file, std::string& path_info, std::string& script_name) {
+    static bool res_isexe(std::string& file, std::string& path_info, std::string& script) {
         std::vector<std::string> split_path;
         std::string path;
         const char* env = getenv("PATHEXT");
@@ -464,9 +1417,8 @@ namespace tthttpd {
                 for (itext = pathexts.begin(); itext != pathexts.end(); itext++) {
                     if (path.substr(path.size() - itext->size()) == *itext) {
                         path_info = file.c_str() + path.size();
-                        script_name.resize(script_name.size() - path_info.size());
                         file = path;
-                        if (path_info.empty()) script_name += *it;
+                        script = *it;
                         return true;
                     }
                 }
@@ -475,9 +1427,8 @@ namespace tthttpd {
                 std::string tmp = path + *itext;
                 if (stat((char *)tmp.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
                     path_info = file.c_str() + path.size();
-                    script_name.resize(script_name.size() - path_info.size());
                     file = tmp;
-                    if (path_info.empty()) script_name += *it;
+                    script = *it;
                     return true;
                 }
             }
@@ -485,7 +1436,7 @@ namespace tthttpd {
         return false;
     }
 
-    static bool res_iscgi(std::string& file, std::string& path_info, std::string& script_name, server::MimeTypes& mime_types, std::string& type) {
+    static bool res_iscgi(std::string& file, std::string& path_info, std::string& script, const MimeTable* mimes, std::string& type) {
         std::vector<std::string> split_path;
         std::string path;
 
@@ -494,29 +1445,20 @@ namespace tthttpd {
             if (it->empty()) continue;
             if (!path.empty()) path += "/";
             path += *it;
+            const std::string* handler = mime_table_find(mimes, path, true);
             struct stat  st;
-            if (stat((char *)path.c_str(), &st))
+            if (!handler || stat((char *)path.c_str(), &st))
                 continue;
-            server::MimeTypes::iterator it_mime;
-            for(it_mime = mime_types.begin(); it_mime != mime_types.end(); it_mime++) {
-                if (it_mime->second[0] != '@') continue;
-                std::string match = ".";
-                match += it_mime->first;
-                if (!strcmp(path.c_str()+path.size()-match.size(), match.c_str())) {
-                    type = it_mime->second;
-                    path_info = file.c_str() + path.size();
-                    script_name.resize(script_name.size() - path_info.size());
-                    file = path;
-                    if (script_name == "/")
-                        script_name += *it;
-                    return true;
-                }
-            }
+            type = *handler;
+            path_info = file.c_str() + path.size();
+            file = path;
+            script = *it;
+            return true;
         }
         return false;
     }
 
-    static std::vector<server::ListInfo> res_flist(std::string& path) {
+    static std::vector<server::ListInfo> res_flist(server* httpd, std::string& path) {
         WIN32_FIND_DATAA fData;
         std::vector<server::ListInfo> ret;
         if (path.size() && path[path.size()-1] != '/')
@@ -531,8 +1473,8 @@ namespace tthttpd {
                 listInfo.name = fData.cFileName;
                 listInfo.isdir = (fData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
                     ? true : false;
-                listInfo.size = fData.nFileSizeLow;
-                filetime2unixtime(&fData.ftLastWriteTime, &listInfo.date);
+                listInfo.size = ((unsigned long long)fData.nFileSizeHigh << 32) | fData.nFileSizeLow;
+                listInfo.date = filetime2unixtime(&fData.ftLastWriteTime);
                 ret.push_back(listInfo);
             }
         } while(FindNextFileA(hFind, &fData));
@@ -541,59 +1483,17 @@ namespace tthttpd {
         return ret;
     }
 
-    static unsigned long res_fsize(RES_INFO* res_info) {
-        return GetFileSize(res_info->read, NULL);
+    static unsigned long long res_fsize(RES_INFO* res_info) {
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(res_info->read, &size))
+            return 0;
+        return size.QuadPart;
     }
 
-    static std::string res_ftime(std::string& file, int diff = 0) {
-        HANDLE hFile;
-        hFile = CreateFileA(
-                file.c_str(),
-                GENERIC_READ,
-                FILE_SHARE_READ,
-                NULL,
-                OPEN_EXISTING,
-                FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
-                NULL);
-        if (hFile == INVALID_HANDLE_VALUE)
-            return "";
-        FILETIME filetime = {0};
-        SYSTEMTIME systemtime = {0};
-        GetFileTime(hFile, NULL, NULL, &filetime);
-        CloseHandle(hFile);
-        FileTimeToSystemTime(&filetime, &systemtime);
-        struct tm t = {0};
-        t.tm_year = systemtime.wYear-1900;
-        t.tm_mon = systemtime.wMonth;
-        t.tm_mday = systemtime.wDay;
-        t.tm_hour = systemtime.wHour;
-        t.tm_min = systemtime.wMinute;
-        t.tm_sec = systemtime.wSecond;
-        t.tm_isdst = 0;
-        time_t tt = mktime(&t) + diff;
-        struct tm* p = localtime(&tt);
-        //int offset= -(int)timezone;
-        //offset = offset/60/60*100 + (offset/60)%60;
-
-        char buf[256];
-        //sprintf(buf, "%s, %02d %s %04d %02d:%02d:%02d %+05d",
-        //  wdays[p->tm_wday],
-        //  p->tm_mday,
-        //  months[p->tm_mon-1],
-        //  p->tm_year+1900,
-        //  p->tm_hour,
-        //  p->tm_min,
-        //  p->tm_sec,
-        //  offset);
-        sprintf(buf, "%s, %02d %s %04d %02d:%02d:%02d GMT",
-                wdays[p->tm_wday],
-                p->tm_mday,
-                months[p->tm_mon],
-                p->tm_year+1900,
-                p->tm_hour,
-                p->tm_min,
-                p->tm_sec);
-        return buf;
+    static bool res_fseek(RES_INFO* res_info, unsigned long long offset) {
+        LARGE_INTEGER pos;
+        pos.QuadPart = offset;
+        return SetFilePointerEx(res_info->read, pos, NULL, FILE_BEGIN) != FALSE;
     }
 
     static std::string res_fgets(RES_INFO* res_info) {
@@ -737,7 +1637,9 @@ namespace tthttpd {
         res_info->read = hClientOut_rd;
         res_info->write = hClientIn_wr;
         res_info->process = pi.hProcess;
-        res_info->size = (unsigned long)-1;
+        res_info->size = (unsigned long long)-1;
+        res_info->offset = 0;
+        res_info->mem = NULL;
         return res_info;
     }
 
@@ -757,32 +1659,45 @@ namespace tthttpd {
         }
     }
 #else
-    static RES_INFO* res_fopen(std::string& file) {
-        int fd = open(file.c_str(), O_RDONLY);
-        if (fd < 0)
+    // opened is a descriptor of the file the caller has just fstat'ed into
+    // st, which the response takes over; otherwise the file is opened here.
+    // either way the stat is done once, and size and Last-Modified are
+    // taken from it.
+    static RES_INFO* res_fopen(std::string& file, FdCache* cache = NULL,
+            int opened = -1, const struct stat* st = NULL) {
+        FD_ENTRY* entry = cache ? fd_cache_acquire(cache, file, opened, st) : NULL;
+        if (!entry && cache && errno)
             return NULL;
+        struct stat statbuf;
+        int fd = entry ? entry->fd : opened;
+        if (entry)
+            statbuf = entry->st;
+        else if (fd >= 0)
+            statbuf = *st;
+        else {
+            fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+                return NULL;
+            if (fstat(fd, &statbuf)) {
+                close(fd);
+                return NULL;
+            }
+        }
 
         RES_INFO* res_info = new RES_INFO;
         res_info->read = fd;
         res_info->write = 0;
         res_info->process = 0;
-        res_info->size = (unsigned long)-1;
+        res_info->size = (unsigned long long)-1;
+        res_info->offset = 0;
+        res_info->mem = NULL;
+        res_info->cache = entry;
+        res_info->position = 0;
+        res_info->st = statbuf;
         return res_info;
     }
 
-    static bool res_isfile(std::string& file) {
-        struct stat statbuf = {0};
-        stat(file.c_str(), &statbuf);
-        return statbuf.st_mode & S_IFREG;
-    }
-
-    static bool res_isdir(std::string& file) {
-        struct stat statbuf = {0};
-        stat(file.c_str(), &statbuf);
-        return statbuf.st_mode & S_IFDIR;
-    }
-
-    static bool res_isexe(std::string& file, std::string& path_info, std::string& script_name) {
+    static bool res_isexe(std::string& file, std::string& path_info, std::string& script) {
         std::vector<std::string> split_path;
         std::string path;
 
@@ -796,16 +1711,15 @@ namespace tthttpd {
                 continue;
             if (S_ISREG(st.st_mode) && access(path.c_str(), X_OK) == 0) {
                 path_info = file.c_str() + path.size();
-                script_name.resize(script_name.size() - path_info.size());
                 file = path;
-                if (path_info.empty()) script_name += *it;
+                script = *it;
                 return true;
             }
         }
         return false;
     }
 
-    static bool res_iscgi(std::string& file, std::string& path_info, std::string& script_name, server::MimeTypes& mime_types, std::string& type) {
+    static bool res_iscgi(std::string& file, std::string& path_info, std::string& script, const MimeTable* mimes, std::string& type) {
         std::vector<std::string> split_path;
         std::string path;
 
@@ -814,93 +1728,141 @@ namespace tthttpd {
             if (it->empty()) continue;
             path += "/";
             path += *it;
+            const std::string* handler = mime_table_find(mimes, path, true);
             struct stat  st;
-            if (stat((char *)path.c_str(), &st))
+            if (!handler || stat((char *)path.c_str(), &st))
                 continue;
-            server::MimeTypes::iterator it_mime;
-            for(it_mime = mime_types.begin(); it_mime != mime_types.end(); it_mime++) {
-                if (it_mime->second[0] != '@') continue;
-                std::string match = ".";
-                match += it_mime->first;
-                if (!strcmp(path.c_str()+path.size()-match.size(), match.c_str())) {
-                    type = it_mime->second;
-                    path_info = file.c_str() + path.size();
-                    script_name.resize(script_name.size() - path_info.size());
-                    file = path;
-                    if (script_name == "/")
-                        script_name += *it;
-                    return true;
-                }
-            }
+            type = *handler;
+            path_info = file.c_str() + path.size();
+            file = path;
+            script = *it;
+            return true;
         }
         return false;
     }
 
-    static std::vector<server::ListInfo> res_flist(std::string& path) {
-        std::vector<server::ListInfo> ret;
-        DIR* dir;
-        struct dirent* dirp;
-        if (!path.empty() && path[path.size()-1] != '/')
-            path += "/";
-        dir = opendir(path.c_str());
-        while((dirp = readdir(dir))) {
-            if (strcmp(dirp->d_name, ".")) {
-                server::ListInfo listInfo;
-                listInfo.name = dirp->d_name;
-                std::string file = path + listInfo.name;
-                struct stat statbuf = {0};
-                stat(file.c_str(), &statbuf);
-                listInfo.size = statbuf.st_size;
-                memcpy(&listInfo.date, gmtime(&statbuf.st_mtime), sizeof(struct tm));
-                listInfo.isdir = res_isdir(file);
-                ret.push_back(listInfo);
-            }
-        }
-        closedir(dir);
-        sort(ret.begin(), ret.end());
-        return ret;
+#if defined __linux__ && defined SYS_getdents64
+    // a record of getdents64, which the C library need not declare.
+    typedef struct {
+        unsigned long long d_ino;
+        long long d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[1];
+    } LIST_DIRENT;
+#endif
+
+    // the entries first..last of a listing, stat'ed below dfd.
+    typedef struct {
+        int dfd;
+        server::ListInfo* first;
+        server::ListInfo* last;
+    } LIST_SLICE;
+
+    static void res_flist_add(std::vector<server::ListInfo>& list, const char* name, bool isdir) {
+        if (!strcmp(name, "."))
+            return;
+        server::ListInfo listInfo;
+        listInfo.name = name;
+        listInfo.size = 0;
+        listInfo.date = 0;
+        listInfo.isdir = isdir;
+        list.push_back(listInfo);
     }
 
-    static unsigned long res_fsize(RES_INFO* res_info) {
-        struct stat statbuf = {0};
-        fstat(res_info->read, &statbuf);
-        return statbuf.st_size;
-    }
-
-    static std::string res_ftime(std::string& file, int diff = 0) {
-        struct stat statbuf = {0};
-        stat(file.c_str(), &statbuf);
-        time_t tt = statbuf.st_mtime + diff;
-        struct tm* p=gmtime(&tt);
-        //int  offset;
-        //int offset= -(int)timezone;
-        //offset = offset/60/60*100 + (offset/60)%60;
-
-        char buf[256];
-        //sprintf(buf, "%s, %02d %s %04d %02d:%02d:%02d %+05d",
-        //  wdays[p->tm_wday],
-        //  p->tm_mday,
-        //  months[p->tm_mon-1],
-        //  p->tm_year+1900,
-        //  p->tm_hour,
-        //  p->tm_min,
-        //  p->tm_sec,
-        //  offset);
-        sprintf(buf, "%s, %02d %s %04d %02d:%02d:%02d GMT",
-                wdays[p->tm_wday],
-                p->tm_mday,
-                months[p->tm_mon],
-                p->tm_year+1900,
-                p->tm_hour,
-                p->tm_min,
-                p->tm_sec);
-        return buf;
+    // the listing shows the size and date of every entry, so each one
+    // costs an fstatat relative to the directory, and no path is built.
+    // an entry that will not stat keeps what d_type told of it.
+    static void* res_flist_stat(void* param) {
+        LIST_SLICE* slice = (LIST_SLICE*)param;
+        for (server::ListInfo* info = slice->first; info != slice->last; info++) {
+            struct stat st;
+            if (fstatat(slice->dfd, info->name.c_str(), &st, 0))
+                continue;
+            info->size = st.st_size;
+            info->date = st.st_mtime;
+            info->isdir = S_ISDIR(st.st_mode);
+        }
+        return NULL;
     }
 
-    static std::string res_fgets(RES_INFO* res_info) {
-        std::stringstream ss;
-        char c;
-        while (1) {
+    // the entries of a directory, read through one descriptor with
+    // getdents64 where there is one. the fstatat calls of a large
+    // directory are spread over up to list_threads threads of at least
+    // LIST_SPLIT entries each, which matters most when the inodes are
+    // cold.
+    static std::vector<server::ListInfo> res_flist(server* httpd, std::string& path) {
+        std::vector<server::ListInfo> ret;
+        int dfd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dfd < 0)
+            return ret;
+#if defined __linux__ && defined SYS_getdents64
+        std::vector<char> buf(LIST_BUFFER);
+        long nread;
+        while ((nread = syscall(SYS_getdents64, dfd, &buf[0], buf.size())) > 0) {
+            for (long off = 0; off < nread; ) {
+                LIST_DIRENT* d = (LIST_DIRENT*)(&buf[0] + off);
+                off += d->d_reclen;
+                res_flist_add(ret, d->d_name, d->d_type == DT_DIR);
+            }
+        }
+#else
+        int fd = dup(dfd);
+        DIR* dir = fd < 0 ? NULL : fdopendir(fd);
+        struct dirent* dirp;
+        while (dir && (dirp = readdir(dir))) {
+#ifdef DT_DIR
+            res_flist_add(ret, dirp->d_name, dirp->d_type == DT_DIR);
+#else
+            res_flist_add(ret, dirp->d_name, false);
+#endif
+        }
+        if (dir)
+            closedir(dir);
+        else if (fd >= 0)
+            close(fd);
+#endif
+
+        size_t count = ret.size();
+        size_t threads = httpd->list_threads > 1 ? httpd->list_threads : 1;
+        if (threads > count / LIST_SPLIT)
+            threads = count / LIST_SPLIT ? count / LIST_SPLIT : 1;
+        size_t per = (count + threads - 1) / threads;
+        std::vector<LIST_SLICE> slices(threads);
+        std::vector<pthread_t> tids(threads);
+        std::vector<bool> started(threads, false);
+        for (size_t n = 0; n < threads; n++) {
+            slices[n].dfd = dfd;
+            slices[n].first = count ? &ret[0] + std::min(n * per, count) : NULL;
+            slices[n].last = count ? &ret[0] + std::min((n + 1) * per, count) : NULL;
+            if (n > 0)
+                started[n] = pthread_create(&tids[n], NULL, res_flist_stat, &slices[n]) == 0;
+        }
+        res_flist_stat(&slices[0]);
+        for (size_t n = 1; n < threads; n++) {
+            if (started[n])
+                pthread_join(tids[n], NULL);
+            else
+                res_flist_stat(&slices[n]);
+        }
+        close(dfd);
+        sort(ret.begin(), ret.end());
+        return ret;
+    }
+
+    static unsigned long long res_fsize(RES_INFO* res_info) {
+        return res_info->st.st_size;
+    }
+
+    static bool res_fseek(RES_INFO* res_info, unsigned long long offset) {
+        res_info->position = offset;
+        return true;
+    }
+
+    static std::string res_fgets(RES_INFO* res_info) {
+        std::stringstream ss;
+        char c;
+        while (1) {
             if (read(res_info->read, &c, 1) != 1) break;
             if (c == '\n') break;
             if (c != '\r') ss << c;
@@ -913,11 +1875,21 @@ namespace tthttpd {
     }
 
     static long long res_read(RES_INFO* res_info, char* data, unsigned long size) {
-        if (res_info->process) {
-            int s = 0;
-            if (waitpid(res_info->process, &s, WNOHANG) == -1) {
-                return -1;
-            }
+        if (res_info->mem) {
+            const MEM_ENTRY* mem = res_info->mem;
+            if (res_info->position >= mem->length)
+                return 0;
+            if (size > mem->length - res_info->position)
+                size = (unsigned long)(mem->length - res_info->position);
+            memcpy(data, mem->data + res_info->position, size);
+            res_info->position += size;
+            return size;
+        }
+        if (!res_info->process && !res_info->write) {
+            ssize_t r = pread(res_info->read, data, size, (off_t)res_info->position);
+            if (r > 0)
+                res_info->position += r;
+            return r;
         }
         fd_set fdset;
         FD_ZERO(&fdset);
@@ -928,7 +1900,16 @@ namespace tthttpd {
         int r = select(FD_SETSIZE, &fdset, NULL, NULL, &tv);
         if (r == -1) return -1;
         if (FD_ISSET(res_info->read, &fdset)) {
-            return (long long) read(res_info->read, data, size);
+            // the pipe is drained before the exit of a cgi counts, as
+            // SIGCHLD may have reaped it with output still unread.
+            ssize_t got = read(res_info->read, data, size);
+            return got == 0 && res_info->process ? -1 : (long long) got;
+        }
+        if (res_info->process) {
+            int s = 0;
+            if (waitpid(res_info->process, &s, WNOHANG) == -1) {
+                return -1;
+            }
         }
         return 0;
     }
@@ -971,6 +1952,7 @@ namespace tthttpd {
             setsid();
             setpgid(0, 0);
             sigemptyset(&newmask);
+            sigaddset(&newmask, SIGCHLD);
             sigaddset(&newmask, SIGTERM);
             sigaddset(&newmask, SIGKILL);
             pthread_sigmask(SIG_UNBLOCK, &newmask, 0L);
@@ -1007,7 +1989,11 @@ namespace tthttpd {
             res_info->read = filedesr[0];
             res_info->write = filedesw[1];
             res_info->process = child;
-            res_info->size = (unsigned long)-1;
+            res_info->size = (unsigned long long)-1;
+            res_info->offset = 0;
+            res_info->mem = NULL;
+            res_info->cache = NULL;
+            res_info->position = 0;
             return res_info;
         }
         return NULL;
@@ -1022,7 +2008,11 @@ namespace tthttpd {
 
     static void res_close(RES_INFO* res_info) {
         if (res_info) {
-            if (res_info->read) close(res_info->read);
+            if (res_info->mem)
+                mem_cache_release(res_info->mem);
+            if (res_info->cache)
+                fd_cache_release(res_info->cache);
+            else if (res_info->read) close(res_info->read);
             if (res_info->write) close(res_info->write);
             delete res_info;
         }
@@ -1030,815 +2020,4282 @@ namespace tthttpd {
 
 #endif
 
-    static bool get_line(int fd, std::string& s) {
-        char c = 0;
-        std::stringstream ss;
-        while (1) {
-            if (recv(fd, &c, 1, 0) <= 0)
-                return false;
-            if (c == '\r')
+    enum {
+        HANDLER_NONE, HANDLER_EXE, HANDLER_CGI
+    };
+
+    // content codings, in the order they are preferred. those with an
+    // ext may be found as precompressed sidecars; gzip, deflate and zstd
+    // may be applied on the fly.
+    enum {
+        CODING_BR, CODING_ZSTD, CODING_GZIP, CODING_DEFLATE, CODING_MAX
+    };
+
+    static const struct {
+        const char* name;
+        const char* ext;
+    } content_codings[CODING_MAX] = {
+        { "br", ".br" },
+        { "zstd", ".zst" },
+        { "gzip", ".gz" },
+        { "deflate", NULL },
+    };
+
+    // what a request path resolves to: the real path under the root, the
+    // default page of a directory or default_cgi in place of a missing
+    // file, then an executable or a cgi along the path, the rest of which
+    // is PATH_INFO, or else the mime type of the file.
+    typedef struct {
+        std::string real;
+        std::string path;
+        std::string type;
+        std::string path_info;
+        std::string script;
+        int handler;
+        bool isdir;   // real is a directory
+        bool found;   // path exists, and st is its stat
+        bool outside; // real is not below the root
+        struct stat st;
+        int fd;       // path, opened by resolve_at for the response
+        int codings;  // sidecars of path found, a bit per CODING_*
+        struct stat coded[CODING_MAX];
+    } RESOLVED;
+
+    // whether real, a path without '..', names the root or lies below it.
+    static bool resolve_below_root(server* httpd, const std::string& real) {
+        const std::string& root = httpd->root;
+        size_t base = root.size() - 1;
+        return real.compare(0, base, root, 0, base) == 0
+            && (real.size() == base || real[base] == '/');
+    }
+
+    // the mime type, or the handler of a cgi, by the extension of path.
+    static void resolve_type(server* httpd, const std::string& path, RESOLVED& res) {
+        const std::string* type = mime_table_find(httpd->mimetable, path);
+        if (type)
+            res.type = *type;
+    }
+
+    // the precompressed sidecars of a static file, path.gz and the like,
+    // which go out in its place to clients accepting them. one older than
+    // the file is stale and left alone.
+    static void resolve_codings(server* httpd, RESOLVED& res) {
+        std::string rel = res.path;
+#ifndef _WIN32
+        size_t start = res.path.find_first_not_of('/', httpd->root.size() - 1);
+        if (httpd->root_fd >= 0 && start != std::string::npos)
+            rel = res.path.substr(start);
+#endif
+        for (int n = 0; n < CODING_MAX; n++) {
+            if (!content_codings[n].ext)
                 continue;
-            if (c == '\n')
-                break;
-            ss << c;
+            std::string coded = rel + content_codings[n].ext;
+            struct stat& st = res.coded[n];
+#ifndef _WIN32
+            // a sidecar is opened by name later; a symlink could lead anywhere.
+            if (rel != res.path ? fstatat(httpd->root_fd, coded.c_str(), &st, AT_SYMLINK_NOFOLLOW) : lstat(coded.c_str(), &st))
+#else
+            if (stat(coded.c_str(), &st))
+#endif
+                continue;
+            if (S_ISREG(st.st_mode) && st.st_mtime >= res.st.st_mtime)
+                res.codings |= 1 << n;
+        }
+    }
+
+    // walks the path component by component: get_realpath, a stat of the
+    // result and of each default page, and res_isexe/res_iscgi stat every
+    // prefix. used where the path does not open as is.
+    static void resolve_walk(server* httpd, const std::string& before, RESOLVED& res) {
+        struct stat st;
+
+        res.real = server::get_realpath(before);
+        res.fd = -1;
+        res.codings = 0;
+        // a symlink may lead out of the root.
+        res.outside = !resolve_below_root(httpd, res.real);
+        if (res.outside) {
+            res.path = res.real;
+            res.handler = HANDLER_NONE;
+            res.isdir = res.found = false;
+            return;
+        }
+        res.isdir = stat(res.real.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+        res.path = res.real;
+        res.found = !res.isdir && stat(res.path.c_str(), &res.st) == 0;
+        if (res.isdir) {
+            res.st = st;
+            res.found = true;
+            std::string try_path = res.path;
+            if (try_path[try_path.size()-1] != '/')
+                try_path += "/";
+            server::DefaultPages::iterator it_page;
+            for(it_page = httpd->default_pages.begin(); it_page != httpd->default_pages.end(); it_page++) {
+                std::string check_path = try_path + *it_page;
+                if (stat(check_path.c_str(), &st) == 0 && S_ISREG(st.st_mode)
+                        && resolve_below_root(httpd, server::get_realpath(check_path))) {
+                    res.path = check_path;
+                    res.st = st;
+                    break;
+                }
+            }
+        }
+        if (!(res.found && S_ISREG(res.st.st_mode)) && !httpd->default_cgi.empty()) {
+            res.path = httpd->default_cgi;
+            res.found = stat(res.path.c_str(), &res.st) == 0;
+        }
+
+        std::string path = res.path;
+        res.handler = HANDLER_NONE;
+        res.type.clear();
+        res.path_info.clear();
+        res.script.clear();
+        if (httpd->spawn_executable && res_isexe(res.path, res.path_info, res.script)) {
+            res.handler = HANDLER_EXE;
+            res.type = "@";
+        } else if (res_iscgi(res.path, res.path_info, res.script, httpd->mimetable, res.type)) {
+            res.handler = HANDLER_CGI;
+        } else
+            resolve_type(httpd, path, res);
+        if (res.path != path)
+            res.found = stat(res.path.c_str(), &res.st) == 0;
+        if (httpd->precompressed && res.handler == HANDLER_NONE && res.found && S_ISREG(res.st.st_mode))
+            resolve_codings(httpd, res);
+    }
+
+#ifndef _WIN32
+#if defined HAVE_LINUX_OPENAT2_H && defined SYS_openat2
+    static bool openat2_missing = false;
+#endif
+
+    // opens rel, a path relative to the root, failing with EXDEV where
+    // '..' or a symlink would lead out of the root. openat2 refuses to go
+    // there; without it the real path of what opened is checked instead.
+    static int resolve_open(server* httpd, const std::string& rel) {
+#if defined HAVE_LINUX_OPENAT2_H && defined SYS_openat2
+        if (!openat2_missing) {
+            struct open_how how;
+            memset(&how, 0, sizeof(how));
+            how.flags = O_RDONLY | O_CLOEXEC;
+            how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+            int fd = (int)syscall(SYS_openat2, httpd->root_fd, rel.c_str(), &how, sizeof(how));
+            if (fd >= 0 || errno != ENOSYS)
+                return fd;
+            openat2_missing = true;
+        }
+#endif
+        int fd = openat(httpd->root_fd, rel.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd >= 0 && !resolve_below_root(httpd, server::get_realpath(httpd->root + rel))) {
+            close(fd);
+            errno = EXDEV;
+            return -1;
+        }
+        return fd;
+    }
+
+    // the usual request costs one openat below the root directory and one
+    // fstat, which tell whether it is a directory, and the size and mtime
+    // of a file; a directory adds the same for its default page. the file
+    // stays open for res_fopen. false when the path does not open and may
+    // still name a cgi with PATH_INFO or fall to default_cgi.
+    static bool resolve_at(server* httpd, const std::string& before, RESOLVED& res) {
+        const std::string& root = httpd->root;
+        size_t base = root.size() - 1;
+
+        res.real = server::normalize_path(before);
+        res.path = res.real;
+        res.handler = HANDLER_NONE;
+        res.type.clear();
+        res.path_info.clear();
+        res.script.clear();
+        res.isdir = res.found = false;
+        res.fd = -1;
+        res.codings = 0;
+        // '..' may take the path above the root.
+        res.outside = res.real.compare(0, base, root, 0, base) != 0
+            || (res.real.size() > base && res.real[base] != '/');
+        if (res.outside)
+            return true;
+        size_t start = res.real.find_first_not_of('/', base);
+        std::string rel = start == std::string::npos ? "." : res.real.substr(start);
+
+        int fd = resolve_open(httpd, rel);
+        if (fd < 0) {
+            // resolve_walk finds where the path leads and redirects.
+            if (errno == EXDEV || errno == EAGAIN)
+                return false;
+            bool handlers = httpd->spawn_executable || !httpd->default_cgi.empty()
+                || httpd->mimetable->handlers.count;
+            if (handlers && (errno == ENOENT || errno == ENOTDIR))
+                return false;
+            resolve_type(httpd, res.path, res);
+            return true;
+        }
+        if (fstat(fd, &res.st)) {
+            close(fd);
+            return false;
+        }
+        res.found = true;
+        res.isdir = S_ISDIR(res.st.st_mode);
+        if (res.isdir) {
+            std::string try_path = res.path;
+            if (try_path[try_path.size()-1] != '/')
+                try_path += "/";
+            server::DefaultPages::iterator it_page;
+            for(it_page = httpd->default_pages.begin(); it_page != httpd->default_pages.end(); it_page++) {
+                struct stat st;
+                int page = resolve_open(httpd, rel == "." ? *it_page : rel + "/" + *it_page);
+                if (page < 0) {
+                    if (errno == EXDEV || errno == EAGAIN) {
+                        close(fd);
+                        return false;
+                    }
+                    continue;
+                }
+                if (fstat(page, &st) == 0 && S_ISREG(st.st_mode)) {
+                    close(fd);
+                    fd = page;
+                    res.path = try_path + *it_page;
+                    res.st = st;
+                    break;
+                }
+                close(page);
+            }
+        }
+        if (!S_ISREG(res.st.st_mode)) {
+            close(fd);
+            if (!httpd->default_cgi.empty())
+                return false;
+            return true;
+        }
+
+        if (httpd->spawn_executable && (res.st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH))) {
+            res.handler = HANDLER_EXE;
+            res.type = "@";
+        } else {
+            resolve_type(httpd, res.path, res);
+            if (res.type[0] == '@')
+                res.handler = HANDLER_CGI;
+        }
+        if (res.handler != HANDLER_NONE) {
+            close(fd);
+            res.script = res.path.substr(res.path.find_last_of('/') + 1);
+        } else {
+            res.fd = fd;
+            if (httpd->precompressed)
+                resolve_codings(httpd, res);
         }
-        s = ss.str();
         return true;
     }
+#endif
 
-    void* response_thread(void* param) {
-        server::HttpdInfo *pHttpdInfo = (server::HttpdInfo*)param;
-        server *httpd = pHttpdInfo->httpd;
-        int msgsock = (int)pHttpdInfo->msgsock;
-        std::string address = pHttpdInfo->address;
-        std::string port = pHttpdInfo->port;
-        int servno = pHttpdInfo->servno;
-        std::string str, req, ret;
-        std::vector<std::string> vparam;
-        std::vector<std::string> vauth;
-        std::string res_code;
-        std::string res_proto;
-        std::string res_msg;
-        std::string res_type;
-        std::string res_body;
-        std::string res_head;
-        server::HttpHeader http_headers;
-        unsigned long content_length;
-        RES_INFO* res_info;
-        char buf[BUFSIZ];
-        char length[256];
-        bool keep_alive;
+    static void resolve_path(server* httpd, const std::string& before, RESOLVED& res) {
+#ifndef _WIN32
+        if (httpd->root_fd >= 0 && resolve_at(httpd, before, res))
+            return;
+#endif
+        resolve_walk(httpd, before, res);
+    }
 
-request_top:
-        keep_alive = false;
-        res_code.clear();
-        res_proto.clear();
-        res_msg.clear();
-        res_type.clear();
-        res_head.clear();
-        res_body.clear();
-        res_info = NULL;
-        http_headers.clear();
-        content_length = 0;
-        vauth.clear();
+#ifndef _WIN32
+    // resolutions of request paths, so that a warm request costs no
+    // realpath or stat at all. an entry is resolved again after
+    // path_cache_ttl seconds, and dropped at once when inotify reports a
+    // change in the directory holding it. missing paths are cached too.
+    typedef struct PATH_ENTRY {
+        std::string key;
+        RESOLVED res;
+        time_t checked;
+        int wd;
+        struct PATH_ENTRY *prev;
+        struct PATH_ENTRY *next;
+    } PATH_ENTRY;
+
+    struct PathCacheShard {
+        pthread_mutex_t lock;
+        std::map<std::string, PATH_ENTRY*> entries;
+        PATH_ENTRY* head;
+        PATH_ENTRY* tail;
+        int count;
+    };
+
+    struct PathCache {
+        PathCacheShard shards[PATH_CACHE_SHARDS];
+        int max_entries;
+        int ttl;
+        int inotify;
+        pthread_mutex_t watch_lock;
+        std::multimap<int, std::string> watches;
+        volatile unsigned long hits;
+        volatile unsigned long misses;
+    };
+
+    static PathCache* path_cache_create(server* httpd) {
+        if (httpd->path_cache_size <= 0)
+            return NULL;
+        PathCache* cache = new PathCache;
+        for (int n = 0; n < PATH_CACHE_SHARDS; n++) {
+            pthread_mutex_init(&cache->shards[n].lock, NULL);
+            cache->shards[n].head = cache->shards[n].tail = NULL;
+            cache->shards[n].count = 0;
+        }
+        cache->max_entries = httpd->path_cache_size / PATH_CACHE_SHARDS;
+        if (cache->max_entries <= 0)
+            cache->max_entries = 1;
+        cache->ttl = httpd->path_cache_ttl;
+        pthread_mutex_init(&cache->watch_lock, NULL);
+        cache->hits = cache->misses = 0;
+        cache->inotify = -1;
+#ifdef HAVE_SYS_INOTIFY_H
+        cache->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+        return cache;
+    }
 
-        if (!get_line(msgsock, req) || req.empty())
-            goto request_end;
-        if (VERBOSE(1)) printf("* %s\n", req.c_str());
+    static PathCacheShard* path_cache_shard(PathCache* cache, const std::string& key) {
+        return &cache->shards[string_hash(key) % PATH_CACHE_SHARDS];
+    }
 
-        do {
-            if (!get_line(msgsock, str))
-                goto request_end;
-            if (str.empty())
-                break;
-            const char *ptr = str.c_str();
+    // the directory which changes when the resolution may: the directory
+    // listed or searched for a default page, else the one holding the file.
+    static void path_cache_watch(PathCache* cache, PATH_ENTRY* entry) {
+        entry->wd = -1;
+#ifdef HAVE_SYS_INOTIFY_H
+        if (cache->inotify < 0)
+            return;
+        std::string dir = entry->res.handler ? entry->res.path : entry->res.real;
+        if (!entry->res.isdir || entry->res.handler) {
+            size_t end_pos = dir.find_last_of('/');
+            if (end_pos == std::string::npos)
+                return;
+            dir.resize(end_pos ? end_pos : 1);
+        }
+        entry->wd = inotify_add_watch(cache->inotify, dir.c_str(),
+                IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_ATTRIB
+                | IN_DELETE_SELF | IN_MOVE_SELF);
+        if (entry->wd >= 0) {
+            pthread_mutex_lock(&cache->watch_lock);
+            cache->watches.insert(std::make_pair(entry->wd, entry->key));
+            pthread_mutex_unlock(&cache->watch_lock);
+        }
+#endif
+    }
 
-            if (!strnicmp(ptr, "SERVER_", 7) || !strnicmp(ptr, "REMOTE_", 7))
-                continue;
-            char* stp = (char*)strchr(ptr, ':');
-            if (stp) {
-                *stp = 0;
-                std::string key = ptr;
-                std::transform(key.begin(), key.end(), key.begin(), toupper);
-                std::string val = trim_string(stp + 1);
-                replace_string(key, "-", "_");
-                std::transform(key.begin(), key.end(), key.begin(), toupper);
-                http_headers[key] = val;
-            }
-        } while (true);
+    static void path_cache_unwatch(PathCache* cache, PATH_ENTRY* entry) {
+#ifdef HAVE_SYS_INOTIFY_H
+        if (entry->wd < 0)
+            return;
+        // entries in one directory share its watch.
+        pthread_mutex_lock(&cache->watch_lock);
+        std::multimap<int, std::string>::iterator it = cache->watches.lower_bound(entry->wd);
+        while (it != cache->watches.end() && it->first == entry->wd && it->second != entry->key)
+            it++;
+        if (it != cache->watches.end() && it->first == entry->wd)
+            cache->watches.erase(it);
+        if (cache->watches.find(entry->wd) == cache->watches.end())
+            inotify_rm_watch(cache->inotify, entry->wd);
+        pthread_mutex_unlock(&cache->watch_lock);
+        entry->wd = -1;
+#endif
+    }
 
-        if (VERBOSE(2)) {
-            server::HttpHeader::const_iterator it;
-            for (it = http_headers.begin(); it != http_headers.end(); it++)
-                printf("  %s=%s\n", it->first.c_str(), it->second.c_str());
+    // caller holds the shard lock.
+    static void path_cache_drop(PathCache* cache, PathCacheShard* shard, PATH_ENTRY* entry) {
+        shard->entries.erase(entry->key);
+        if (entry->prev)
+            entry->prev->next = entry->next;
+        else
+            shard->head = entry->next;
+        if (entry->next)
+            entry->next->prev = entry->prev;
+        else
+            shard->tail = entry->prev;
+        path_cache_unwatch(cache, entry);
+        shard->count--;
+        delete entry;
+    }
+
+    static void path_cache_resolve(PathCache* cache, server* httpd, const std::string& key, RESOLVED& res) {
+        PathCacheShard* shard = path_cache_shard(cache, key);
+        time_t now = time(NULL);
+
+        pthread_mutex_lock(&shard->lock);
+        std::map<std::string, PATH_ENTRY*>::iterator it = shard->entries.find(key);
+        if (it != shard->entries.end() && now - it->second->checked < cache->ttl) {
+            PATH_ENTRY* entry = it->second;
+            if (entry->prev) {
+                entry->prev->next = entry->next;
+                if (entry->next)
+                    entry->next->prev = entry->prev;
+                else
+                    shard->tail = entry->prev;
+                entry->prev = NULL;
+                entry->next = shard->head;
+                shard->head->prev = entry;
+                shard->head = entry;
+            }
+            res = entry->res;
+            pthread_mutex_unlock(&shard->lock);
+            __sync_fetch_and_add(&cache->hits, 1);
+            return;
         }
+        pthread_mutex_unlock(&shard->lock);
+        __sync_fetch_and_add(&cache->misses, 1);
+
+        // resolve outside the lock; the last one in wins.
+        resolve_path(httpd, key, res);
+        PATH_ENTRY* entry = new PATH_ENTRY;
+        entry->key = key;
+        entry->res = res;
+        entry->res.fd = -1;
+        entry->checked = now;
+        path_cache_watch(cache, entry);
+
+        pthread_mutex_lock(&shard->lock);
+        it = shard->entries.find(key);
+        if (it != shard->entries.end())
+            path_cache_drop(cache, shard, it->second);
+        while (shard->count >= cache->max_entries)
+            path_cache_drop(cache, shard, shard->tail);
+        entry->prev = NULL;
+        entry->next = shard->head;
+        if (shard->head)
+            shard->head->prev = entry;
+        else
+            shard->tail = entry;
+        shard->head = entry;
+        shard->entries[key] = entry;
+        shard->count++;
+        pthread_mutex_unlock(&shard->lock);
+    }
 
-        if (http_headers.count("CONNECTION")
-                && !stricmp(http_headers["CONNECTION"].c_str(), "keep-alive"))
-            keep_alive = true;
+    // drops the entries of directories inotify reported as changed.
+    // called by the acceptors on every tick of their timer wheel.
+    static void path_cache_poll(PathCache* cache) {
+#ifdef HAVE_SYS_INOTIFY_H
+        char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        if (!cache || cache->inotify < 0)
+            return;
+        while (true) {
+            ssize_t len = read(cache->inotify, buf, sizeof(buf));
+            if (len <= 0)
+                break;
+            for (char* ptr = buf; ptr < buf + len; ) {
+                struct inotify_event* event = (struct inotify_event*)ptr;
+                ptr += sizeof(struct inotify_event) + event->len;
+                if (event->mask & IN_IGNORED)
+                    continue;
+                std::vector<std::string> keys;
+                pthread_mutex_lock(&cache->watch_lock);
+                std::multimap<int, std::string>::iterator it = cache->watches.lower_bound(event->wd);
+                for (; it != cache->watches.end() && it->first == event->wd; it++)
+                    keys.push_back(it->second);
+                pthread_mutex_unlock(&cache->watch_lock);
+                for (size_t n = 0; n < keys.size(); n++) {
+                    PathCacheShard* shard = path_cache_shard(cache, keys[n]);
+                    pthread_mutex_lock(&shard->lock);
+                    std::map<std::string, PATH_ENTRY*>::iterator found = shard->entries.find(keys[n]);
+                    if (found != shard->entries.end() && found->second->wd == event->wd)
+                        path_cache_drop(cache, shard, found->second);
+                    pthread_mutex_unlock(&shard->lock);
+                }
+            }
+        }
+#endif
+    }
 
-        if (http_headers.count("CONTENT_LENGTH"))
-            content_length = atol(http_headers["CONTENT_LENGTH"].c_str());
+    static void path_cache_stats(PathCache* cache) {
+        int count = 0;
+        for (int n = 0; n < PATH_CACHE_SHARDS; n++)
+            count += cache->shards[n].count;
+        printf("* path cache: %d/%d entries, hits: %lu, misses: %lu\n",
+                count, cache->max_entries * PATH_CACHE_SHARDS, cache->hits, cache->misses);
+    }
+#endif
 
-        if (httpd->loggerfunc) {
-            httpd->loggerfunc(pHttpdInfo, req);
+    static void resolve_request(server* httpd, const std::string& before, RESOLVED& res) {
+#ifndef _WIN32
+        if (httpd->pathcache) {
+            path_cache_resolve(httpd->pathcache, httpd, before, res);
+            return;
         }
+#endif
+        resolve_path(httpd, before, res);
+    }
 
-        split_string(req, " ", vparam);
-        try {
-            if (httpd->accept_ips.size() > 0 &&
-                    std::find(httpd->accept_ips.begin(), httpd->accept_ips.end(), address)
-                    == httpd->accept_ips.end()) {
-                res_code = "403";
-                res_msg = "Forbidden";
-                res_body = "Forbidden";
-                goto request_done;
-            } else
-                if (vparam.size() < 2 || vparam[1][0] != '/') {
-                    res_code = "500";
-                    res_msg = "Bad Request";
-                    res_body = "Bad Request\n";
-                    goto request_done;
-                } else {
-                    if (vparam.size() == 2)
-                        res_proto = "HTTP/1.0";
-                    else
-                        res_proto = vparam[2];
-                    std::string auth = http_headers["AUTHORIZATION"];
-                    if (!auth.empty()) {
-                        if (!strnicmp(auth.c_str(), "basic ", 6))
-                            auth = base64_decode(auth.c_str()+6);
-                        split_string(auth, ":", vauth);
-                    }
-                    if (vparam[0] == "GET" || vparam[0] == "POST" || vparam[0] == "HEAD") {
-                        std::string root = server::get_realpath(httpd->root + "/");
-                        std::string request_uri = vparam[1];
-                        std::string script_name = vparam[1];
-                        std::string query_string;
-                        std::string path_info = "/";
-                        size_t end_pos = vparam[1].find_first_of('?');
-                        if (end_pos != std::string::npos) {
-                            query_string = script_name.substr(end_pos+1);
-                            script_name = script_name.substr(0, end_pos);
-                            //request_uri = script_name;
-                            path_info = script_name;
-                        }
+    static bool sock_wait(int fd, bool writing, int timeout) {
+#ifdef _WIN32
+        fd_set fdset;
+        FD_ZERO(&fdset);
+        FD_SET((unsigned int) fd, &fdset);
+        struct timeval tv;
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+        return select(fd + 1, writing ? NULL : &fdset, writing ? &fdset : NULL, NULL, &tv) > 0;
+#else
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = writing ? POLLOUT : POLLIN;
+        pfd.revents = 0;
+        int r;
+        do {
+            r = poll(&pfd, 1, timeout);
+        } while (r < 0 && errno == EINTR);
+        return r > 0;
+#endif
+    }
 
-                        server::RequestAliases::iterator it_alias;
-                        for(it_alias = httpd->request_aliases.begin();
-                                it_alias != httpd->request_aliases.end(); it_alias++) {
-                            if (path_info == it_alias->first) {
-                                vparam[1] = it_alias->second;
-                                break;
-                            }
-                        }
+    // recv/send which also work for nonblocking sockets owned by the
+    // event loop: EAGAIN waits for readiness instead of failing.
+    static int sock_recv(int fd, char* buf, int size) {
+        while (1) {
+            int r = recv(fd, buf, size, 0);
+            if (r >= 0) return r;
+            if (errno == EINTR) continue;
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && sock_wait(fd, false, RECV_TIMEOUT))
+                continue;
+            return -1;
+        }
+    }
 
-                        std::string before = root;
-                        if (before[before.size()-1] == '/')
-                            before.resize(before.size() - 1);
-                        before += tthttpd::url_decode(script_name);
-                        std::string path = server::get_realpath(before);
-                        if (before != path && (path.size() < root.size() || path.substr(root.size()) == root)) {
-                            if (path.size() > root.size())
-                                path = path.c_str() + root.size();
-                            else
-                                path = "/";
-                            res_code = "301";
-                            res_msg = "Document Moved";
-                            res_body = "Document Moved\n";
-                            res_head = "Location: ";
-                            res_head += path;
-                            res_head += "\n";
-                            goto request_done;
-                        }
-                        /*
-                           if (strncmp(root.c_str(), path.c_str(), root.size())) {
-                           res_code = "500";
-                           res_msg = "Bad Request";
-                           res_body = "Bad Request\n";
-                           goto request_done;
-                           }
-                         */
+    static bool sock_send(int fd, const char* buf, size_t size) {
+        while (size > 0) {
+            int r = send(fd, buf, (int)size, 0);
+            if (r > 0) {
+                buf += r;
+                size -= r;
+                continue;
+            }
+            if (r < 0 && errno == EINTR) continue;
+            if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && sock_wait(fd, true, SEND_TIMEOUT))
+                continue;
+            return false;
+        }
+        return true;
+    }
 
-                        std::vector<server::BasicAuthInfo>::iterator it_basicauth;
-                        std::vector<std::string> methods;
-                        for (it_basicauth = httpd->basic_auths.begin(); it_basicauth != httpd->basic_auths.end(); it_basicauth++) {
-                            split_string(it_basicauth->method, "/", methods);
-                            if (!methods.empty() && std::find(methods.begin(), methods.end(), vparam[0]) == methods.end()) continue;
-                            if (!it_basicauth->target.empty() && strncmp(vparam[1].c_str(), it_basicauth->target.c_str(), it_basicauth->target.size())) continue;
-                            break;
-                        }
-                        if (it_basicauth != httpd->basic_auths.end()) {
-                            bool authorized = false;
-                            if (!vauth.empty()) {
-                                if (VERBOSE(2)) printf("  authorizing %s\n", vparam[1].c_str());
-                                std::vector<server::AuthInfo>::iterator it_auth;
-                                for (it_auth = it_basicauth->auths.begin(); it_auth != it_basicauth->auths.end(); it_auth++) {
-                                    if (it_auth->user != vauth[0]) continue;
-                                    /*
-                                       std::vector<std::string> pwd = split_string(it_auth->pass, "$");
-                                       std::string tmp = vauth[1];
-                                       tmp += "$apr1$";
-                                       tmp += pwd[2];
-                                       std::string pwd_md5 = string_to_hex(crypt(vauth[1].c_str(), pwd[2].c_str()));
-                                       printf("%s, %s\n", pwd_md5.c_str(), it_auth->pass.c_str());
-                                       if (it_auth->pass != pwd_md5) continue;
-                                     */
-                                    // TODO: only support plain-text password.
-                                    //  hope to access .htpasswd file.
-                                    if (it_auth->pass != vauth[1]) continue;
-                                    authorized = true;
-                                }
-                            }
-                            if (!authorized) {
-                                res_code = "401";
-                                res_msg = "Authorization Required";
-                                res_head = "WWW-Authenticate: Basic";
-                                if (!it_basicauth->realm.empty()) {
-                                    res_head += " realm=\"";
-                                    res_head += it_basicauth->realm;
-                                    res_head += "\"";
-                                }
-                                res_head += "\r\n";
-                                res_body = "Authorization Required";
-                                goto request_done;
-                            }
-                        }
-                        if (!vauth.empty()) {
-                            server::AcceptAuths::iterator it_accept;
-                            for(it_accept = httpd->accept_auths.begin(); it_accept != httpd->accept_auths.end(); it_accept++) {
-                                if (!strncmp(it_accept->first.c_str(), script_name.c_str(), it_accept->first.size())) {
-                                    if (std::find(
-                                                it_accept->second.accept_list.begin(),
-                                                it_accept->second.accept_list.end(), vauth[0])
-                                            == it_accept->second.accept_list.end()) {
-                                        res_code = "401";
-                                        res_msg = "Authorization Required";
-                                        res_head = "WWW-Authenticate: Basic";
-                                        if (!it_basicauth->realm.empty()) {
-                                            res_head += " realm=\"";
-                                            res_head += it_basicauth->realm;
-                                            res_head += "\"";
-                                        }
-                                        res_head += "\r\n";
-                                        res_body = "Authorization Required";
-                                        goto request_done;
-                                    }
-                                }
-                            }
-                        }
+    // responses to pipelined requests are collected while more requests
+    // are waiting in the read buffer, and go out with the next write.
+    static void flush_pending(int fd, std::string& pending) {
+        if (!pending.empty()) {
+            sock_send(fd, pending.data(), pending.size());
+            pending.clear();
+        }
+    }
 
-                        if (res_isdir(path) && vparam[1].size() && vparam[1][vparam[1].size()-1] != '/') {
-                            res_type = "text/plain";
-                            res_code = "301";
-                            res_msg = "Document Moved";
-                            res_body = "Document Moved\n";
-                            res_head = "Location: ";
-                            res_head += vparam[1];
-                            res_head += "/\n";
-                            goto request_done;
-                        }
+    // the whole response head (and a small body) in one sendmsg. flags
+    // may carry MSG_MORE when a sendfile follows, so the head and the
+    // first part of the file share segments.
+    static bool sock_sendv(int fd, struct iovec* iov, int iovcnt, int flags) {
+#ifdef _WIN32
+        for (int n = 0; n < iovcnt; n++)
+            if (!sock_send(fd, (const char*)iov[n].iov_base, iov[n].iov_len))
+                return false;
+        return true;
+#else
+        struct msghdr msg;
+        while (iovcnt > 0) {
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = iovcnt;
+            ssize_t r = sendmsg(fd, &msg, flags | MSG_NOSIGNAL);
+            if (r < 0) {
+                if (errno == EINTR)
+                    continue;
+                if ((errno == EAGAIN || errno == EWOULDBLOCK) && sock_wait(fd, true, SEND_TIMEOUT))
+                    continue;
+                return false;
+            }
+            while (iovcnt > 0 && (size_t)r >= iov->iov_len) {
+                r -= iov->iov_len;
+                iov++;
+                iovcnt--;
+            }
+            if (iovcnt > 0) {
+                iov->iov_base = (char*)iov->iov_base + r;
+                iov->iov_len -= r;
+            }
+        }
+        return true;
+#endif
+    }
 
-                        server::DefaultPages::iterator it_page;
-                        std::string try_path = path;
-                        if (try_path[try_path.size()-1] != '/')
-                            try_path += "/";
-                        for(it_page = httpd->default_pages.begin(); it_page != httpd->default_pages.end(); it_page++) {
-                            std::string check_path = try_path + *it_page;
-                            if (res_isfile(check_path)) {
-                                path = check_path;
-                                break;
-                            }
-                        }
+    // a piece of a body of unknown length. chunked, it goes out framed as
+    // one chunk, and an empty piece is the last chunk.
+    static bool sock_send_chunk(int fd, const std::string& data, bool chunked) {
+        if (!chunked)
+            return data.empty() || sock_send(fd, data.data(), data.size());
+        char size[32];
+        sprintf(size, "%lx\r\n", (unsigned long)data.size());
+        struct iovec iov[3];
+        iov[0].iov_base = (void*)size;
+        iov[0].iov_len = strlen(size);
+        iov[1].iov_base = (void*)data.data();
+        iov[1].iov_len = data.size();
+        iov[2].iov_base = (void*)"\r\n";
+        iov[2].iov_len = 2;
+        return sock_sendv(fd, iov, 3, 0);
+    }
 
-                        server::MimeTypes::iterator it_mime;
-                        std::string type;
-                        if (!res_isfile(path) && !httpd->default_cgi.empty()) {
-                            path = httpd->default_cgi;
-                            if (VERBOSE(2)) printf("* running default_cgi: %s\n", path.c_str());
-                        }
+#ifdef WITH_IO_URING
+    // pooled workers each own a ring and a pipe for static files; NULL when
+    // the kernel refused io_uring and send/sendfile are used instead. the
+    // ring may also have buffers to read request heads into, and the mem
+    // cache's arena registered as fixed buffer 0.
+    static __thread URING* worker_ring = NULL;
+    static __thread int worker_pipe[2];
+    static __thread unsigned int worker_pipe_size;
+    static __thread URING_BUFS* worker_bufs = NULL;
+    static __thread MemArena* worker_arena = NULL;
+
+    static void uring_worker_init(server* httpd) {
+        URING *ring = new URING;
+        if (!uring_init(ring, URING_ENTRIES)) {
+            if (VERBOSE(2)) printf("* io_uring unavailable: %s\n", strerror(errno));
+            delete ring;
+            return;
+        }
+        if (!uring_probe(ring, IORING_OP_SEND) || !uring_probe(ring, IORING_OP_SPLICE)
+                || pipe2(worker_pipe, O_CLOEXEC) != 0) {
+            if (VERBOSE(2)) printf("* io_uring lacks send/splice\n");
+            uring_exit(ring);
+            delete ring;
+            return;
+        }
+        int size = fcntl(worker_pipe[1], F_GETPIPE_SZ);
+        worker_pipe_size = size > 0 ? size : 65536;
+        worker_ring = ring;
+        URING_BUFS *bufs = new URING_BUFS;
+        if (uring_probe(ring, IORING_OP_RECV) && uring_probe(ring, IORING_OP_PROVIDE_BUFFERS)
+                && uring_bufs_init(ring, bufs, 0, URING_RECV_BUFFERS, MAX_HEADER_SIZE))
+            worker_bufs = bufs;
+        else {
+            if (VERBOSE(2)) printf("* io_uring lacks provided buffers\n");
+            delete bufs;
+        }
+        // every worker pins the same pages; past RLIMIT_MEMLOCK the rest
+        // send hits with sendmsg.
+        MemArena *arena = httpd->memcache ? httpd->memcache->arena : NULL;
+        if (arena && uring_probe(ring, IORING_OP_WRITE_FIXED)) {
+            struct iovec iov;
+            iov.iov_base = arena->base;
+            iov.iov_len = arena->size;
+            if (uring_register_buffers(ring, &iov, 1))
+                worker_arena = arena;
+            else if (VERBOSE(2))
+                printf("* io_uring cannot register the mem cache: %s\n", strerror(errno));
+        }
+    }
 
-                        if (httpd->spawn_executable && res_isexe(path, path_info, script_name)) {
-                            type = "@";
-                        } else {
-                            if (!res_iscgi(path, path_info, script_name, httpd->mime_types, type)) {
-                                for(it_mime = httpd->mime_types.begin(); it_mime != httpd->mime_types.end(); it_mime++) {
-                                    std::string match = ".";
-                                    match += it_mime->first;
-                                    if (!strcmp(path.c_str()+path.size()-match.size(), match.c_str())) {
-                                        type = it_mime->second;
-                                        res_type = type;
-                                    }
-                                    if (!type.empty()) break;
-                                }
-                            }
-                        }
+    // one read of a request head into a buffer the ring picks: the bytes
+    // read with *bid set, 0 at the end of the stream, or -1 with errno,
+    // where EAGAIN and ENOBUFS leave the read to the caller. the buffers
+    // recycled since the last read go back in the same submit, ahead of it.
+    static int uring_recv(int sock, unsigned int* bid) {
+        URING *ring = worker_ring;
+        struct io_uring_sqe *sqe;
+        struct io_uring_cqe *cqe;
+        unsigned int n = uring_bufs_queue(ring, worker_bufs, 1) + 1, reaped = 0;
+        int res = -EAGAIN;
+        unsigned int flags = 0;
+
+        sqe = uring_get_sqe(ring);
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = sock;
+        sqe->len = worker_bufs->size;
+        sqe->msg_flags = MSG_DONTWAIT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = worker_bufs->bgid;
+        sqe->user_data = 0;
+        int r = uring_submit(ring, n);
+        while (reaped < n) {
+            cqe = uring_peek_cqe(ring);
+            if (!cqe) {
+                if (r < 0 && r != -EINTR && r != -EAGAIN && r != -EBUSY)
+                    break;
+                r = uring_submit(ring, n - reaped);
+                continue;
+            }
+            if (cqe->user_data == 0) {
+                res = cqe->res;
+                flags = cqe->flags;
+            }
+            uring_cqe_seen(ring);
+            reaped++;
+        }
+        if (flags & IORING_CQE_F_BUFFER) {
+            *bid = flags >> IORING_CQE_BUFFER_SHIFT;
+            if (res > 0)
+                return res;
+            uring_bufs_recycle(worker_bufs, *bid);
+        }
+        if (res < 0) {
+            errno = -res;
+            return -1;
+        }
+        if (res > 0) {
+            // read, but into no buffer the kernel told of; the bytes are lost.
+            errno = EIO;
+            return -1;
+        }
+        return res;
+    }
 
-                        if (res_isdir(path)) {
-                            if (VERBOSE(2)) printf("  listing %s\n", path.c_str());
-                            res_type = "text/html";
-                            res_code = "200";
-                            res_msg = "OK";
-                            if (!httpd->fs_charset.empty()) {
-                                res_type += "; charset=";
-                                res_type += trim_string(httpd->fs_charset);
-                            }
-                            res_body = "<html><head><title>";
-                            res_body += script_name;
-                            res_body += "</title></head><body><h1>";
-                            res_body += script_name;
-                            res_body += "</h1><hr /><pre>";
-                            res_body += "<table border=0>";
-                            std::vector<server::ListInfo> flist = res_flist(path);
-                            std::vector<server::ListInfo>::iterator it;
+    // a cached file from the arena: the head as a send linked to a write
+    // from the registered buffer, so a hit costs a single io_uring_enter.
+    // a short send breaks the chain; what went out is reported and the
+    // caller goes on from there. false when the connection is no longer
+    // usable.
+    static bool uring_send_fixed(int sock, const std::string& head, size_t* head_sent,
+            const char* data, size_t length, size_t* sent) {
+        URING *ring = worker_ring;
+        struct io_uring_sqe *sqe;
+        struct io_uring_cqe *cqe;
+        unsigned int n = 0, reaped = 0;
+        bool ok = true;
+
+        *head_sent = *sent = 0;
+        if (!head.empty()) {
+            sqe = uring_get_sqe(ring);
+            sqe->opcode = IORING_OP_SEND;
+            sqe->fd = sock;
+            sqe->addr = (unsigned long)head.data();
+            sqe->len = head.size();
+            sqe->msg_flags = MSG_NOSIGNAL | MSG_MORE;
+            sqe->flags = IOSQE_IO_LINK;
+            sqe->user_data = 0;
+            n++;
+        }
+        sqe = uring_get_sqe(ring);
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->fd = sock;
+        sqe->addr = (unsigned long)data;
+        sqe->len = length;
+        sqe->buf_index = 0;
+        sqe->user_data = 1;
+        n++;
+
+        int r = uring_submit(ring, n);
+        while (reaped < n) {
+            while (reaped < n && (cqe = uring_peek_cqe(ring)) != NULL) {
+                int res = cqe->res;
+                if (res > 0)
+                    *(cqe->user_data ? sent : head_sent) = res;
+                else if (res < 0 && res != -EAGAIN && res != -ECANCELED)
+                    ok = false;
+                uring_cqe_seen(ring);
+                reaped++;
+            }
+            if (reaped < n) {
+                if (r < 0 && r != -EINTR && r != -EAGAIN && r != -EBUSY)
+                    return false;
+                r = uring_submit(ring, n - reaped);
+            }
+        }
+        return ok;
+    }
 
-                            // TODO: sort and reverse, sort key
-                            //std::map<std::string, std::string> params = tthttpd::parse_querystring(query_string);
+    // the head goes out as a send linked to file->pipe->socket splices, so
+    // a small file costs a single io_uring_enter. a short transfer breaks
+    // the chain; whatever was sent is reported and the caller goes on with
+    // sendfile. returns false when the connection is no longer usable.
+    static bool uring_sendfile(int sock, const std::string& head, size_t* head_sent,
+            int fd, unsigned long long offset, unsigned long long total, unsigned long long* sent) {
+        URING *ring = worker_ring;
+        struct io_uring_sqe *sqe = NULL;
+        struct io_uring_cqe *cqe;
+        unsigned long long queued = 0;
+        bool more = true;
+
+        *head_sent = 0;
+        *sent = 0;
+        while (more) {
+            unsigned int n = 0, reaped = 0;
+            if (queued == 0 && *head_sent == 0) {
+                sqe = uring_get_sqe(ring);
+                sqe->opcode = IORING_OP_SEND;
+                sqe->fd = sock;
+                sqe->addr = (unsigned long)head.data();
+                sqe->len = head.size();
+                sqe->msg_flags = MSG_NOSIGNAL | (total ? MSG_MORE : 0);
+                sqe->user_data = (unsigned long long)head.size() << 2;
+                n++;
+            }
+            for (unsigned long long off = queued; off < total && n + 2 <= ring->entries; ) {
+                unsigned int len = worker_pipe_size;
+                if (len > total - off)
+                    len = total - off;
+                if (n) sqe->flags |= IOSQE_IO_LINK;
+                sqe = uring_get_sqe(ring);
+                sqe->opcode = IORING_OP_SPLICE;
+                sqe->splice_fd_in = fd;
+                sqe->splice_off_in = offset + off;
+                off += len;
+                sqe->fd = worker_pipe[1];
+                sqe->off = (unsigned long long)-1;
+                sqe->len = len;
+                sqe->splice_flags = SPLICE_F_MOVE;
+                sqe->user_data = ((unsigned long long)len << 2) | 1;
+                sqe->flags |= IOSQE_IO_LINK;
+                sqe = uring_get_sqe(ring);
+                sqe->opcode = IORING_OP_SPLICE;
+                sqe->splice_fd_in = worker_pipe[0];
+                sqe->splice_off_in = (unsigned long long)-1;
+                sqe->fd = sock;
+                sqe->off = (unsigned long long)-1;
+                sqe->len = len;
+                sqe->splice_flags = SPLICE_F_MOVE | (off < total ? SPLICE_F_MORE : 0);
+                sqe->user_data = ((unsigned long long)len << 2) | 2;
+                n += 2;
+            }
+            if (n == 0)
+                break;
 
-                            for(it = flist.begin(); it != flist.end(); it++) {
-                                std::string name = it->name;
-                                res_body += "<tr><td><a href=\"";
-                                res_body += tthttpd::url_encode(name);
-                                res_body += "\">";
-                                res_body += tthttpd::html_encode(name);
-                                res_body += "</a></td>";
-                                res_body += "<td>";
-                                struct tm tm = it->date;
-                                sprintf(buf, "%02d-%s-%04d %02d:%02d",
-                                        tm.tm_mday,
-                                        months[tm.tm_mon],
-                                        tm.tm_year+1900,
-                                        tm.tm_hour,
-                                        tm.tm_min);
-                                res_body += buf;
-                                res_body += "</td>";
-                                res_body += "<td align=right>&nbsp;&nbsp;";
-                                if (!it->isdir) {
-                                    if (it->size < 1000)
-                                        sprintf(buf, "%d", (int)it->size);
-                                    else
-                                        if (it->size < 1000000)
-                                            sprintf(buf, "%dK", (int)it->size/1000);
-                                        else
-                                            sprintf(buf, "%.1dM", (int)it->size/1000000);
-                                    res_body += buf;
-                                } else
-                                    res_body += "[DIR]";
-                                res_body += "</td></tr>";
-                            }
-                            res_body += "</table></pre ><hr /></body></html>";
-                            goto request_done;
-                        }
+            int r = uring_submit(ring, n);
+            while (reaped < n) {
+                while (reaped < n && (cqe = uring_peek_cqe(ring)) != NULL) {
+                    unsigned long long want = cqe->user_data >> 2;
+                    int res = cqe->res;
+                    switch (cqe->user_data & 3) {
+                        case 0: if (res > 0) *head_sent += res; break;
+                        case 1: if (res > 0) queued += res; break;
+                        case 2: if (res > 0) *sent += res; break;
+                    }
+                    if (res < 0 || (unsigned long long)res != want)
+                        more = false;
+                    uring_cqe_seen(ring);
+                    reaped++;
+                }
+                if (reaped < n) {
+                    r = uring_submit(ring, n - reaped);
+                    if (r < 0 && r != -EINTR && r != -EAGAIN && r != -EBUSY)
+                        return false;
+                }
+            }
+            if (*head_sent < head.size() || *sent >= total)
+                more = false;
+        }
 
-                        res_info = res_fopen(path);
-                        if (!res_info) {
-                            res_type = "text/plain";
-                            res_code = "404";
-                            res_msg = "Not Found";
-                            res_body = "Not Found\n";
-                            goto request_done;
-                        }
+        // a broken chain may leave data in the pipe; it belongs to the
+        // socket before anything else does.
+        while (*sent < queued) {
+            ssize_t r = splice(worker_pipe[0], NULL, sock, NULL, queued - *sent, SPLICE_F_MOVE);
+            if (r > 0)
+                *sent += r;
+            else if (r < 0 && (errno == EAGAIN || errno == EINTR)
+                    && sock_wait(sock, true, SEND_TIMEOUT))
+                continue;
+            else
+                break;
+        }
+        if (*sent < queued) {
+            close(worker_pipe[0]);
+            close(worker_pipe[1]);
+            if (pipe2(worker_pipe, O_CLOEXEC) != 0) {
+                uring_exit(worker_ring);
+                delete worker_ring;
+                worker_ring = NULL;
+            }
+            return false;
+        }
+        return true;
+    }
+#endif
 
-                        res_code = "200";
-                        res_msg = "OK";
-                        if (type[0] != '@') {
-                            std::string file_time = res_ftime(path);
-                            res_info->size = res_fsize(res_info);
-                            sprintf(buf, "%d", (int)res_info->size);
-                            if (http_headers["IF_MODIFIED_SINCE"] == file_time) {
-                                res_close(res_info);
-                                res_info = NULL;
-                                res_type = "text/plain";
-                                res_code = "304";
-                                res_msg = "Not Modified";
-                                res_body.clear();
-                                goto request_done;
-                            }
-                            if (!type.empty()) {
-                                res_head += "Content-Type: ";
-                                res_head += type;
-                                res_head += ";\r\n";
-                            }
-                            res_head += "Content-Length: ";
-                            res_head += buf;
-                            res_head += "\r\n";
-                            res_head += "Last-Modified: ";
-                            res_head += file_time;
-                            res_head += "\r\n";
-                            res_head += "Date: ";
-                            res_head += res_curtime();
-                            res_head += "\r\n";
-                            if (http_headers.count("CONNECTION"))
-                                res_head += "Connection: " + http_headers["CONNECTION"] + "\r\n";
-                        } else {
-                            res_close(res_info);
-                            res_info = NULL;
+    // the rest of a static file, kept with the connection while it waits
+    // in the event loop for the socket to drain.
+    struct Transfer {
+        int fd;
+#ifndef _WIN32
+        FD_ENTRY* cache;
+        MEM_ENTRY* mem;
+#endif
+        unsigned long long offset;
+        unsigned long long end;
+        bool keep_alive;
+    };
 
-                            std::vector<std::string> envs;
-                            std::vector<std::string> args;
+    enum {
+        TRANSFER_DONE, TRANSFER_AGAIN, TRANSFER_ERROR
+    };
 
-                            if (type.size() == 1) {
-                                args.push_back(path);
-                            } else {
-                                args.push_back(type.substr(1));
-                                args.push_back(path);
-                            }
-                            if (query_string.size())
-                                args.push_back(query_string);
+    static void transfer_close(server::HttpdInfo* pHttpdInfo) {
+        if (pHttpdInfo->transfer) {
+#ifndef _WIN32
+            if (pHttpdInfo->transfer->mem)
+                mem_cache_release(pHttpdInfo->transfer->mem);
+            else if (pHttpdInfo->transfer->cache)
+                fd_cache_release(pHttpdInfo->transfer->cache);
+            else
+#endif
+            close(pHttpdInfo->transfer->fd);
+            delete pHttpdInfo->transfer;
+            pHttpdInfo->transfer = NULL;
+        }
+    }
 
-                            std::string env;
+#if defined LINUX_SENDFILE_API
+    // sends the file from *offset up to end with explicit offsets, so a
+    // partial write resumes where it stopped. when it may yield, under the
+    // event loop, a full socket or SENDFILE_CHUNK bytes sent returns
+    // TRANSFER_AGAIN and the connection goes back to the loop, so that one
+    // large download does not hold a worker. otherwise it waits for the
+    // socket.
+    static int transfer_file(server::HttpdInfo* pHttpdInfo, int fd,
+            unsigned long long* offset, unsigned long long end, bool yield) {
+        int msgsock = pHttpdInfo->msgsock;
+        bool evented = yield && pHttpdInfo->acceptor->epfd >= 0;
+        unsigned long long chunk = 0;
+        while (*offset < end) {
+            size_t count = SENDFILE_CHUNK;
+            if (end - *offset < count)
+                count = (size_t)(end - *offset);
+            off_t off = (off_t)*offset;
+            ssize_t r = sendfile(msgsock, fd, &off, count);
+            if (r > 0) {
+                *offset += r;
+                chunk += r;
+                if (evented && chunk >= SENDFILE_CHUNK && *offset < end)
+                    return TRANSFER_AGAIN;
+                continue;
+            }
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                if (evented)
+                    return TRANSFER_AGAIN;
+                if (sock_wait(msgsock, true, SEND_TIMEOUT))
+                    continue;
+            }
+            // r == 0: the file was truncated under us.
+            return TRANSFER_ERROR;
+        }
+        return TRANSFER_DONE;
+    }
+#endif
 
-                            if (http_headers.count("HTTP_HOST")) {
-                                sprintf(buf, "HTTP_HOST=%s:%s", http_headers["HTTP_HOST"].c_str(), httpd->port.c_str());
-                                env = buf;
-                                envs.push_back(env);
-                                http_headers.erase("HTTP_HOST");
-                            } else
-                                if (httpd->hostname.size()) {
-                                    sprintf(buf, "HTTP_HOST=%s:%s", httpd->hostname.c_str(), httpd->port.c_str());
-                                    env = buf;
-                                    envs.push_back(env);
-                                    http_headers.erase("HTTP_HOST");
-                                }
+#ifndef _WIN32
+    // the same for a file mapped by the map cache: it is written from the
+    // mapping, and yields to the event loop in the same way.
+    static int transfer_mem(server::HttpdInfo* pHttpdInfo, const MEM_ENTRY* mem,
+            unsigned long long* offset, unsigned long long end, bool yield) {
+        int msgsock = pHttpdInfo->msgsock;
+        bool evented = yield && pHttpdInfo->acceptor->epfd >= 0;
+        unsigned long long chunk = 0;
+        while (*offset < end) {
+            size_t count = SENDFILE_CHUNK;
+            if (end - *offset < count)
+                count = (size_t)(end - *offset);
+            ssize_t r = send(msgsock, mem->data + *offset, count, MSG_NOSIGNAL);
+            if (r > 0) {
+                *offset += r;
+                chunk += r;
+                if (evented && chunk >= SENDFILE_CHUNK && *offset < end)
+                    return TRANSFER_AGAIN;
+                continue;
+            }
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                if (evented)
+                    return TRANSFER_AGAIN;
+                if (sock_wait(msgsock, true, SEND_TIMEOUT))
+                    continue;
+            }
+            return TRANSFER_ERROR;
+        }
+        return TRANSFER_DONE;
+    }
+#endif
+
+    // a multipart/byteranges body, written in the worker: each part head
+    // goes out together with its piece of the file.
+    static bool send_parts(server::HttpdInfo* pHttpdInfo, RES_INFO* res_info, const std::string& head) {
+        int msgsock = pHttpdInfo->msgsock;
+        std::vector<RES_PART>::iterator it;
+        for (it = res_info->parts.begin(); it != res_info->parts.end(); it++) {
+            struct iovec iov[3];
+            int cnt = 0;
+            if (it == res_info->parts.begin()) {
+                iov[cnt].iov_base = (void*)head.data();
+                iov[cnt++].iov_len = head.size();
+            }
+            iov[cnt].iov_base = (void*)it->head.data();
+            iov[cnt++].iov_len = it->head.size();
+            if (res_info->mem && it->length) {
+                iov[cnt].iov_base = (void*)(res_info->mem->data + it->offset);
+                iov[cnt++].iov_len = (size_t)it->length;
+                if (!sock_sendv(msgsock, iov, cnt, 0))
+                    return false;
+                continue;
+            }
+            if (!sock_sendv(msgsock, iov, cnt, it->length ? MSG_MORE : 0))
+                return false;
+            if (!it->length)
+                continue;
+#if defined LINUX_SENDFILE_API
+            unsigned long long pos = it->offset;
+            if (transfer_file(pHttpdInfo, res_info->read, &pos, it->offset + it->length, false) != TRANSFER_DONE)
+                return false;
+#elif defined _WIN32
+            if (!res_fseek(res_info, it->offset) || !lpfnTransmitFile || !lpfnTransmitFile(
+                        msgsock, res_info->read, (DWORD)it->length, 0, NULL, NULL, 0))
+                return false;
+#else
+            char buf[BUFSIZ];
+            unsigned long long left = it->length;
+            if (!res_fseek(res_info, it->offset))
+                return false;
+            while (left > 0) {
+                long long r = res_read(res_info, buf, left < sizeof(buf) ? (size_t)left : sizeof(buf));
+                if (r <= 0 || !sock_send(msgsock, buf, r))
+                    return false;
+                left -= r;
+            }
+#endif
+        }
+        return true;
+    }
 
-                            http_headers.erase("SERVER_PROTOCOL");
-                            http_headers.erase("SERVER_ADDR");
-                            http_headers.erase("SERVER_NAME");
-                            http_headers.erase("REMOTE_ADDR");
-                            http_headers.erase("REMOTE_PORT");
-                            http_headers.erase("REMOTE_USER");
+    // every connection has at most one deadline at a time: the header, a
+    // read of the body, an idle keep-alive, or a socket which has to drain
+    // before a file transfer goes on. header and body deadlines are also
+    // capped by the deadline of the whole request. TIMER_REAP marks a
+    // parked connection evicted in the middle of an event batch.
+    enum {
+        TIMER_NONE, TIMER_HEADER, TIMER_BODY, TIMER_IDLE, TIMER_SEND, TIMER_REAP
+    };
 
-                            env = "SERVER_PROTOCOL=HTTP/1.1";
-                            envs.push_back(env);
+#ifndef _WIN32
+    // hierarchical timer wheel of an acceptor. adding, moving and removing
+    // a deadline is O(1); the acceptor advances the wheel every WHEEL_TICK
+    // and expires what is due. a connection parked in the event loop is
+    // closed right there, one held by a worker is shut down so that the
+    // worker's read fails. idle keep-alive connections are also listed
+    // oldest first, for max_connections to make room.
+    struct TimerWheel {
+        pthread_mutex_t lock;
+        unsigned long long start;
+        unsigned long now;
+        server::HttpdInfo* slots[WHEEL_LEVELS * WHEEL_SIZE];
+        server::HttpdInfo* idle_head;
+        server::HttpdInfo* idle_tail;
+        server::HttpdInfo* reap;
+        int connections;
+        int max_connections;
+        unsigned long expired;
+        unsigned long evicted;
+        unsigned long refused;
+    };
+
+    static unsigned long long now_msec() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
 
-                            env = "SERVER_ADDR=";
-                            env += httpd->hostaddr[servno];
-                            envs.push_back(env);
+    static void wheel_link(TimerWheel* wheel, server::HttpdInfo* info) {
+        unsigned long delta = info->expires - wheel->now;
+        int level = 0;
+        while (level < WHEEL_LEVELS - 1 && delta >= 1UL << (WHEEL_BITS * (level + 1)))
+            level++;
+        if (delta >= 1UL << (WHEEL_BITS * WHEEL_LEVELS))
+            info->expires = wheel->now + (1UL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+        int slot = level * WHEEL_SIZE + ((info->expires >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1));
+        info->timer_slot = slot;
+        info->timer_prev = NULL;
+        info->timer_next = wheel->slots[slot];
+        if (info->timer_next)
+            info->timer_next->timer_prev = info;
+        wheel->slots[slot] = info;
+    }
+
+    static void wheel_unlink(TimerWheel* wheel, server::HttpdInfo* info) {
+        if (info->timer_slot >= 0) {
+            if (info->timer_prev)
+                info->timer_prev->timer_next = info->timer_next;
+            else
+                wheel->slots[info->timer_slot] = info->timer_next;
+            if (info->timer_next)
+                info->timer_next->timer_prev = info->timer_prev;
+            info->timer_slot = -1;
+        }
+        if (info->timer_kind == TIMER_IDLE) {
+            if (info->idle_prev)
+                info->idle_prev->idle_next = info->idle_next;
+            else
+                wheel->idle_head = info->idle_next;
+            if (info->idle_next)
+                info->idle_next->idle_prev = info->idle_prev;
+            else
+                wheel->idle_tail = info->idle_prev;
+        }
+        info->timer_kind = TIMER_NONE;
+    }
+
+    // ticks from now, rounded up so that a deadline never fires early.
+    static unsigned long wheel_ticks(TimerWheel* wheel, int sec) {
+        unsigned long long msec = now_msec() - wheel->start + (unsigned long long)sec * 1000;
+        unsigned long expires = (unsigned long)((msec + WHEEL_TICK - 1) / WHEEL_TICK);
+        if ((long)(expires - wheel->now) <= 0)
+            expires = wheel->now + 1;
+        return expires;
+    }
+
+    // caller holds the lock.
+    static void wheel_schedule(TimerWheel* wheel, server::HttpdInfo* info, int kind) {
+        server *httpd = info->httpd;
+        int timeout = 0;
+
+        wheel_unlink(wheel, info);
+        info->timer_kind = kind;
+        switch (kind) {
+            case TIMER_NONE:
+                return;
+            case TIMER_HEADER:
+                timeout = httpd->header_timeout;
+                info->deadline = httpd->request_timeout > 0 ? wheel_ticks(wheel, httpd->request_timeout) : 0;
+                break;
+            case TIMER_BODY:
+                timeout = httpd->body_timeout;
+                break;
+            case TIMER_SEND:
+                timeout = SEND_TIMEOUT / 1000;
+                break;
+            case TIMER_IDLE:
+                timeout = httpd->keepalive_timeout;
+                info->idle_prev = wheel->idle_tail;
+                info->idle_next = NULL;
+                if (wheel->idle_tail)
+                    wheel->idle_tail->idle_next = info;
+                else
+                    wheel->idle_head = info;
+                wheel->idle_tail = info;
+                break;
+        }
+        if ((kind == TIMER_HEADER || kind == TIMER_BODY) && info->deadline) {
+            if (timeout <= 0 || (long)(info->deadline - wheel_ticks(wheel, timeout)) < 0) {
+                info->expires = info->deadline;
+                if ((long)(info->expires - wheel->now) <= 0)
+                    info->expires = wheel->now + 1;
+                wheel_link(wheel, info);
+                return;
+            }
+        }
+        if (timeout > 0) {
+            info->expires = wheel_ticks(wheel, timeout);
+            wheel_link(wheel, info);
+        }
+    }
+
+    // caller holds the lock.
+    static void wheel_expire(TimerWheel* wheel, server::HttpdInfo* info) {
+        server *httpd = info->httpd;
+        static const char* kinds[] = { "", "header", "body", "keep-alive", "send" };
+        if (VERBOSE(2)) printf("* %s timeout on socket %d\n", kinds[info->timer_kind], info->msgsock);
+        wheel_unlink(wheel, info);
+        if (info->parked) {
+            // waiting in the event loop; nobody else holds it.
+            shutdown(info->msgsock, SD_BOTH);
+            closesocket(info->msgsock);
+            transfer_close(info);
+            free(info->rbuf);
+            delete info;
+            wheel->connections--;
+        } else
+            shutdown(info->msgsock, SD_BOTH);
+    }
+
+    // caller holds the lock. the event loop may still have an event for an
+    // evicted connection later in the batch, so it is only shut down here
+    // and freed by wheel_reap once the batch is done; keeping the
+    // descriptor open until then also keeps accept from reusing it.
+    static void wheel_evict(TimerWheel* wheel, server::HttpdInfo* info) {
+        server *httpd = info->httpd;
+        if (VERBOSE(2)) printf("* too many connections, closing idle socket %d\n", info->msgsock);
+        wheel_unlink(wheel, info);
+        wheel->evicted++;
+        wheel->connections--;
+        shutdown(info->msgsock, SD_BOTH);
+        if (info->parked) {
+            info->timer_kind = TIMER_REAP;
+            info->timer_next = wheel->reap;
+            wheel->reap = info;
+        }
+    }
+
+    static void wheel_reap(TimerWheel* wheel) {
+        if (!wheel)
+            return;
+        pthread_mutex_lock(&wheel->lock);
+        server::HttpdInfo* info = wheel->reap;
+        wheel->reap = NULL;
+        pthread_mutex_unlock(&wheel->lock);
+        while (info) {
+            server::HttpdInfo* next = info->timer_next;
+            closesocket(info->msgsock);
+            transfer_close(info);
+            free(info->rbuf);
+            delete info;
+            info = next;
+        }
+    }
+
+    static void wheel_cascade(TimerWheel* wheel, int slot) {
+        server::HttpdInfo* info = wheel->slots[slot];
+        wheel->slots[slot] = NULL;
+        while (info) {
+            server::HttpdInfo* next = info->timer_next;
+            wheel_link(wheel, info);
+            info = next;
+        }
+    }
+
+    static void wheel_advance(TimerWheel* wheel) {
+        if (!wheel)
+            return;
+        unsigned long target = (unsigned long)((now_msec() - wheel->start) / WHEEL_TICK);
+        pthread_mutex_lock(&wheel->lock);
+        while ((long)(target - wheel->now) > 0) {
+            wheel->now++;
+            if ((wheel->now & (WHEEL_SIZE - 1)) == 0) {
+                for (int level = 1; level < WHEEL_LEVELS; level++) {
+                    unsigned long index = (wheel->now >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1);
+                    wheel_cascade(wheel, level * WHEEL_SIZE + index);
+                    if (index != 0)
+                        break;
+                }
+            }
+            server::HttpdInfo** slot = &wheel->slots[wheel->now & (WHEEL_SIZE - 1)];
+            while (*slot) {
+                wheel->expired++;
+                wheel_expire(wheel, *slot);
+            }
+        }
+        pthread_mutex_unlock(&wheel->lock);
+    }
+
+    static TimerWheel* wheel_create(server::Acceptor* acceptor) {
+        server *httpd = acceptor->httpd;
+        TimerWheel* wheel = new TimerWheel;
+        memset(wheel, 0, sizeof(TimerWheel));
+        pthread_mutex_init(&wheel->lock, NULL);
+        wheel->start = now_msec();
+        if (httpd->max_connections > 0) {
+            int nshard = (int)httpd->shards.size();
+            wheel->max_connections = httpd->max_connections / nshard;
+            if (wheel->max_connections <= 0)
+                wheel->max_connections = 1;
+        }
+        return wheel;
+    }
+
+    static void wheel_stats(TimerWheel* wheel) {
+        printf("* connections: %d/%d, expired: %lu, evicted: %lu, refused: %lu\n",
+                wheel->connections, wheel->max_connections,
+                wheel->expired, wheel->evicted, wheel->refused);
+    }
+#endif
+
+    // move the connection to another deadline; TIMER_NONE while the
+    // response is written.
+    static void conn_timer(server::HttpdInfo* pHttpdInfo, int kind) {
+#ifndef _WIN32
+        TimerWheel* wheel = pHttpdInfo->acceptor->timers;
+        if (!wheel)
+            return;
+        pthread_mutex_lock(&wheel->lock);
+        wheel_schedule(wheel, pHttpdInfo, kind);
+        pthread_mutex_unlock(&wheel->lock);
+#endif
+    }
+
+    // a new connection counts against max_connections. when the shard is
+    // full the oldest idle keep-alive connection makes room; if there is
+    // none the new one is refused.
+    static bool conn_admit(server::HttpdInfo* pHttpdInfo, bool parked) {
+#ifndef _WIN32
+        server *httpd = pHttpdInfo->httpd;
+        TimerWheel* wheel = pHttpdInfo->acceptor->timers;
+        if (!wheel)
+            return true;
+        pthread_mutex_lock(&wheel->lock);
+        if (wheel->max_connections > 0 && wheel->connections >= wheel->max_connections) {
+            if (!wheel->idle_head) {
+                wheel->refused++;
+                pthread_mutex_unlock(&wheel->lock);
+                if (VERBOSE(1)) printf("* too many connections, refusing socket %d\n", pHttpdInfo->msgsock);
+                return false;
+            }
+            wheel_evict(wheel, wheel->idle_head);
+        }
+        wheel->connections++;
+        pHttpdInfo->parked = parked;
+        wheel_schedule(wheel, pHttpdInfo, TIMER_HEADER);
+        pthread_mutex_unlock(&wheel->lock);
+#endif
+        return true;
+    }
+
+    // the event loop hands a parked connection to a worker, unless it was
+    // evicted earlier in the same batch.
+    static bool conn_wake(server::HttpdInfo* pHttpdInfo) {
+#ifndef _WIN32
+        TimerWheel* wheel = pHttpdInfo->acceptor->timers;
+        if (!wheel)
+            return true;
+        pthread_mutex_lock(&wheel->lock);
+        if (pHttpdInfo->timer_kind == TIMER_REAP) {
+            pthread_mutex_unlock(&wheel->lock);
+            return false;
+        }
+        pHttpdInfo->parked = false;
+        wheel_schedule(wheel, pHttpdInfo, pHttpdInfo->transfer ? TIMER_NONE : TIMER_HEADER);
+        pthread_mutex_unlock(&wheel->lock);
+#endif
+        return true;
+    }
+
+    // before the socket is closed, so that the wheel never shuts down a
+    // descriptor which was reused.
+    static void conn_release(server::HttpdInfo* pHttpdInfo) {
+#ifndef _WIN32
+        TimerWheel* wheel = pHttpdInfo->acceptor->timers;
+        if (!wheel)
+            return;
+        pthread_mutex_lock(&wheel->lock);
+        wheel_unlink(wheel, pHttpdInfo);
+        wheel->connections--;
+        pthread_mutex_unlock(&wheel->lock);
+#endif
+    }
+
+    // each connection reads into its own buffer in large chunks and the
+    // header is split into lines in place. whatever follows the header
+    // stays in the buffer for the body and for pipelined requests. the
+    // buffer is never larger than MAX_HEADER_SIZE. a worker with provided
+    // buffers reads a new request into one its ring picks.
+    static int conn_fill(server::HttpdInfo* pHttpdInfo) {
+#ifdef WITH_IO_URING
+        if (!pHttpdInfo->rbuf && worker_bufs) {
+            unsigned int bid = 0;
+            int r = uring_recv(pHttpdInfo->msgsock, &bid);
+            if (r > 0) {
+                pHttpdInfo->rbuf = uring_bufs_get(worker_bufs, bid);
+                pHttpdInfo->rbuf_id = bid;
+                pHttpdInfo->rpos = 0;
+                pHttpdInfo->rlen = r;
+            }
+            if (r >= 0 || (errno != EAGAIN && errno != ENOBUFS && errno != EINTR))
+                return r;
+        }
+#endif
+        if (!pHttpdInfo->rbuf) {
+            pHttpdInfo->rbuf = (char*)malloc(MAX_HEADER_SIZE);
+            pHttpdInfo->rpos = pHttpdInfo->rlen = 0;
+        }
+        if (pHttpdInfo->rpos > 0) {
+            memmove(pHttpdInfo->rbuf, pHttpdInfo->rbuf + pHttpdInfo->rpos,
+                    pHttpdInfo->rlen - pHttpdInfo->rpos);
+            pHttpdInfo->rlen -= pHttpdInfo->rpos;
+            pHttpdInfo->rpos = 0;
+        }
+        int r = sock_recv(pHttpdInfo->msgsock, pHttpdInfo->rbuf + pHttpdInfo->rlen,
+                MAX_HEADER_SIZE - pHttpdInfo->rlen);
+        if (r > 0)
+            pHttpdInfo->rlen += r;
+        return r;
+    }
+
+    static int conn_buffered(server::HttpdInfo* pHttpdInfo) {
+        return pHttpdInfo->rbuf ? pHttpdInfo->rlen - pHttpdInfo->rpos : 0;
+    }
+
+    // back to the heap, or to the ring of the worker it was read on.
+    static void conn_free_buffer(server::HttpdInfo* pHttpdInfo) {
+#ifdef WITH_IO_URING
+        if (pHttpdInfo->rbuf_id >= 0) {
+            uring_bufs_recycle(worker_bufs, pHttpdInfo->rbuf_id);
+            pHttpdInfo->rbuf_id = -1;
+        } else
+#endif
+        free(pHttpdInfo->rbuf);
+        pHttpdInfo->rbuf = NULL;
+    }
+
+    // a provided buffer never leaves its worker; what is left of a
+    // pipelined request moves to the heap before the connection is parked.
+    static void conn_unring(server::HttpdInfo* pHttpdInfo) {
+#ifdef WITH_IO_URING
+        if (pHttpdInfo->rbuf_id < 0)
+            return;
+        int n = conn_buffered(pHttpdInfo);
+        char* rbuf = NULL;
+        if (n > 0) {
+            rbuf = (char*)malloc(MAX_HEADER_SIZE);
+            memcpy(rbuf, pHttpdInfo->rbuf + pHttpdInfo->rpos, n);
+        }
+        conn_free_buffer(pHttpdInfo);
+        pHttpdInfo->rbuf = rbuf;
+        pHttpdInfo->rpos = 0;
+        pHttpdInfo->rlen = n;
+#endif
+    }
+
+    // body reads drain the buffer before touching the socket.
+    static int conn_read(server::HttpdInfo* pHttpdInfo, char* buf, int size) {
+        int n = conn_buffered(pHttpdInfo);
+        if (n > 0) {
+            if (n > size)
+                n = size;
+            memcpy(buf, pHttpdInfo->rbuf + pHttpdInfo->rpos, n);
+            pHttpdInfo->rpos += n;
+            return n;
+        }
+        // the body deadline is per read, so slow but steady uploads pass.
+        if (pHttpdInfo->timer_kind == TIMER_BODY)
+            conn_timer(pHttpdInfo, TIMER_BODY);
+        return sock_recv(pHttpdInfo->msgsock, buf, size);
+    }
+
+    // incremental request parser. the request line and headers are
+    // recorded as offsets from the start of the request in the connection
+    // buffer, nothing is copied. it keeps its place between calls, so it
+    // only looks at bytes that arrived since the last one.
+    enum {
+        PARSE_LINE,
+        PARSE_HEADER,
+        PARSE_DONE
+    };
+
+    enum {
+        HEADER_HOST,
+        HEADER_CONNECTION,
+        HEADER_CONTENT_LENGTH,
+        HEADER_CONTENT_TYPE,
+        HEADER_AUTHORIZATION,
+        HEADER_IF_MODIFIED_SINCE,
+        HEADER_IF_UNMODIFIED_SINCE,
+        HEADER_IF_NONE_MATCH,
+        HEADER_IF_RANGE,
+        HEADER_RANGE,
+        HEADER_ACCEPT_ENCODING,
+        HEADER_TRANSFER_ENCODING,
+        HEADER_MAX
+    };
+
+#define MAX_HEADERS 100
+
+    typedef struct {
+        int off;
+        int len;
+    } SPAN;
+
+    typedef struct {
+        int state;
+        int pos;
+        const char* base;
+        SPAN line;
+        SPAN method;
+        SPAN target;
+        SPAN version;
+        SPAN known[HEADER_MAX];
+        SPAN name[MAX_HEADERS];
+        SPAN value[MAX_HEADERS];
+        int nheaders;
+    } HTTP_REQUEST;
+
+    static void parse_init(HTTP_REQUEST* r) {
+        r->state = PARSE_LINE;
+        r->pos = 0;
+        r->base = NULL;
+        r->nheaders = 0;
+        r->method.len = r->target.len = r->version.len = 0;
+        for (int n = 0; n < HEADER_MAX; n++)
+            r->known[n].len = -1;
+    }
+
+    static int header_slot(const char* name, int len) {
+#define HEADER_IS(str) (len == sizeof(str) - 1 && !strnicmp(name, str, len))
+        switch (len) {
+            case 4: if (HEADER_IS("host")) return HEADER_HOST; break;
+            case 5: if (HEADER_IS("range")) return HEADER_RANGE; break;
+            case 8: if (HEADER_IS("if-range")) return HEADER_IF_RANGE; break;
+            case 10: if (HEADER_IS("connection")) return HEADER_CONNECTION; break;
+            case 12: if (HEADER_IS("content-type")) return HEADER_CONTENT_TYPE; break;
+            case 13:
+                if (HEADER_IS("authorization")) return HEADER_AUTHORIZATION;
+                if (HEADER_IS("if-none-match")) return HEADER_IF_NONE_MATCH;
+                break;
+            case 14: if (HEADER_IS("content-length")) return HEADER_CONTENT_LENGTH; break;
+            case 15: if (HEADER_IS("accept-encoding")) return HEADER_ACCEPT_ENCODING; break;
+            case 17:
+                if (HEADER_IS("if-modified-since")) return HEADER_IF_MODIFIED_SINCE;
+                if (HEADER_IS("transfer-encoding")) return HEADER_TRANSFER_ENCODING;
+                break;
+            case 19: if (HEADER_IS("if-unmodified-since")) return HEADER_IF_UNMODIFIED_SINCE; break;
+        }
+#undef HEADER_IS
+        return -1;
+    }
+
+    // 1: header complete, 0: need more data, -1: too many headers.
+    static int parse_request(HTTP_REQUEST* r, const char* base, int avail) {
+        while (r->state != PARSE_DONE) {
+            const char *eol = (const char*)memchr(base + r->pos, '\n', avail - r->pos);
+            if (!eol)
+                return 0;
+            int start = r->pos, end = eol - base;
+            r->pos = end + 1;
+            if (end > start && base[end - 1] == '\r')
+                end--;
+
+            if (r->state == PARSE_LINE) {
+                // stray empty lines before a request are skipped.
+                if (end == start)
+                    continue;
+                const char *sp1 = (const char*)memchr(base + start, ' ', end - start);
+                const char *sp2 = sp1 ? (const char*)memchr(sp1 + 1, ' ', base + end - sp1 - 1) : NULL;
+                r->line.off = start;
+                r->line.len = end - start;
+                r->method.off = start;
+                r->method.len = (sp1 ? sp1 - base : end) - start;
+                if (sp1) {
+                    r->target.off = sp1 + 1 - base;
+                    r->target.len = (sp2 ? sp2 - base : end) - r->target.off;
+                }
+                if (sp2) {
+                    r->version.off = sp2 + 1 - base;
+                    r->version.len = end - r->version.off;
+                }
+                r->state = PARSE_HEADER;
+                continue;
+            }
+
+            if (end == start) {
+                r->state = PARSE_DONE;
+                break;
+            }
+            const char *colon = (const char*)memchr(base + start, ':', end - start);
+            if (!colon)
+                continue;
+            if (r->nheaders == MAX_HEADERS)
+                return -1;
+            int value = colon + 1 - base;
+            while (value < end && (base[value] == ' ' || base[value] == '\t'))
+                value++;
+            while (end > value && (base[end - 1] == ' ' || base[end - 1] == '\t'))
+                end--;
+            SPAN *name_span = &r->name[r->nheaders];
+            SPAN *value_span = &r->value[r->nheaders];
+            name_span->off = start;
+            name_span->len = colon - base - start;
+            value_span->off = value;
+            value_span->len = end - value;
+            r->nheaders++;
+            int slot = header_slot(base + start, name_span->len);
+            if (slot >= 0)
+                r->known[slot] = *value_span;
+        }
+        return 1;
+    }
+
+    static std::string span_string(const HTTP_REQUEST* r, const SPAN& span) {
+        if (span.len <= 0)
+            return "";
+        return std::string(r->base + span.off, span.len);
+    }
+
+    static bool has_header(const HTTP_REQUEST* r, int slot) {
+        return r->known[slot].len >= 0;
+    }
+
+    static std::string header_value(const HTTP_REQUEST* r, int slot) {
+        return span_string(r, r->known[slot]);
+    }
+
+    static bool header_is(const HTTP_REQUEST* r, int slot, const char* value) {
+        const SPAN& span = r->known[slot];
+        return span.len == (int)strlen(value) && !strnicmp(r->base + span.off, value, span.len);
+    }
+
+    // whether an If-None-Match list is "*" or holds etag, by the weak
+    // comparison, which ignores W/.
+    static bool etag_match(const std::string& list, const std::string& etag) {
+        size_t tag = etag.compare(0, 2, "W/") ? 0 : 2;
+        size_t pos = 0;
+        while (pos < list.size()) {
+            pos = list.find_first_not_of(" \t,", pos);
+            if (pos == std::string::npos)
+                break;
+            if (list[pos] == '*')
+                return true;
+            if (!list.compare(pos, 2, "W/"))
+                pos += 2;
+            size_t end = pos;
+            if (end < list.size() && list[end] == '"')
+                end = list.find('"', end + 1);
+            if (end == std::string::npos)
+                break;
+            end = list.find_first_of(" \t,", end);
+            if (end == std::string::npos)
+                end = list.size();
+            if (!list.compare(pos, end - pos, etag, tag, std::string::npos))
+                return true;
+            pos = end;
+        }
+        return false;
+    }
+
+    // the status the conditional headers of a request for a file call
+    // for, or 0 to go on: 412 when it was modified after
+    // If-Unmodified-Since, or If-None-Match matches on other than GET or
+    // HEAD; 304 when If-None-Match matches, or, without it, the file was
+    // not modified after If-Modified-Since. the dates are ignored for an
+    // mtime of -1, for a resource without one.
+    static int res_condition(const HTTP_REQUEST* r, bool get, const std::string& etag, time_t mtime) {
+        if (mtime != -1 && has_header(r, HEADER_IF_UNMODIFIED_SINCE)) {
+            time_t since = parse_http_date(header_value(r, HEADER_IF_UNMODIFIED_SINCE));
+            if (since != -1 && mtime > since)
+                return 412;
+        }
+        if (has_header(r, HEADER_IF_NONE_MATCH)) {
+            if (etag_match(header_value(r, HEADER_IF_NONE_MATCH), etag))
+                return get ? 304 : 412;
+            return 0;
+        }
+        if (get && mtime != -1 && has_header(r, HEADER_IF_MODIFIED_SINCE)) {
+            time_t since = parse_http_date(header_value(r, HEADER_IF_MODIFIED_SINCE));
+            if (since != -1 && mtime <= since)
+                return 304;
+        }
+        return 0;
+    }
+
+    // a listing page: its head, a row per entry and the tail.
+    static void list_head(std::string& out, const std::string& title) {
+        out += "<html><head><title>";
+        out += title;
+        out += "</title></head><body><h1>";
+        out += title;
+        out += "</h1><hr /><pre>";
+        out += "<table border=0>";
+    }
+
+    static void list_row(std::string& out, const server::ListInfo& info) {
+        char buf[64];
+        struct tm tm;
+        out += "<tr><td><a href=\"";
+        out += tthttpd::url_encode(info.name);
+        out += "\">";
+        out += tthttpd::html_encode(info.name);
+        out += "</a></td>";
+        out += "<td>";
+        res_gmtime(info.date, &tm);
+        sprintf(buf, "%02d-%s-%04d %02d:%02d",
+                tm.tm_mday,
+                months[tm.tm_mon],
+                tm.tm_year+1900,
+                tm.tm_hour,
+                tm.tm_min);
+        out += buf;
+        out += "</td>";
+        out += "<td align=right>&nbsp;&nbsp;";
+        if (!info.isdir) {
+            if (info.size < 1000)
+                sprintf(buf, "%d", (int)info.size);
+            else
+                if (info.size < 1000000)
+                    sprintf(buf, "%dK", (int)(info.size/1000));
+                else
+                    sprintf(buf, "%.1dM", (int)(info.size/1000000));
+            out += buf;
+        } else
+            out += "[DIR]";
+        out += "</td></tr>";
+    }
+
+    static const char list_tail[] = "</table></pre ><hr /></body></html>";
+
+    // a weak validator of a listing: the directory, and a hash of the
+    // name, size and date of every entry, since a file changing in place
+    // leaves the directory as it was.
+    static std::string list_etag(const struct stat& st, const std::vector<server::ListInfo>& flist) {
+        unsigned long long h = 14695981039346656037ULL;
+        for (std::vector<server::ListInfo>::const_iterator it = flist.begin(); it != flist.end(); it++) {
+            unsigned long long fields[3] = { it->size, (unsigned long long)it->date, it->isdir };
+            const unsigned char* p = (const unsigned char*)it->name.c_str();
+            for (size_t n = 0; n <= it->name.size(); n++)
+                h = (h ^ p[n]) * 1099511628211ULL;
+            p = (const unsigned char*)fields;
+            for (size_t n = 0; n < sizeof(fields); n++)
+                h = (h ^ p[n]) * 1099511628211ULL;
+        }
+        char buf[64];
+        sprintf(buf, "W/\"%llx-%llx\"", (unsigned long long)st.st_ino, h);
+        return buf;
+    }
+
+    // whether If-Range still names the file: a date must be its mtime,
+    // and an entity tag must match strongly, which a weak one never does.
+    static bool range_current(const HTTP_REQUEST* r, const std::string& etag, time_t mtime) {
+        if (!has_header(r, HEADER_IF_RANGE))
+            return true;
+        std::string value = header_value(r, HEADER_IF_RANGE);
+        if (!value.compare(0, 1, "\"") || !value.compare(0, 2, "W/"))
+            return etag[0] == '"' && value == etag;
+        return parse_http_date(value) == mtime;
+    }
+
+    // the preferred coding, of those set in codings, that Accept-Encoding
+    // allows, or -1. a coding is allowed when listed, or matched by '*',
+    // with a q other than 0.
+    static int accept_coding(const HTTP_REQUEST* r, int codings) {
+        const SPAN& span = r->known[HEADER_ACCEPT_ENCODING];
+        if (span.len <= 0)
+            return -1;
+        int allowed = 0, refused = 0;
+        bool any = false;
+        const char* p = r->base + span.off;
+        const char* end = p + span.len;
+        while (p < end) {
+            while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+                p++;
+            const char* name = p;
+            while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t')
+                p++;
+            size_t len = p - name;
+            bool zero = false;
+            while (p < end && *p != ',') {
+                if (*p == '=' && p > name && (p[-1] == 'q' || p[-1] == 'Q')) {
+                    const char* q = p + 1;
+                    while (q < end && *q == ' ')
+                        q++;
+                    zero = q < end && *q == '0';
+                    for (q++; zero && q < end && *q != ',' && *q != ';' && *q != ' '; q++)
+                        zero = *q == '0' || *q == '.';
+                }
+                p++;
+            }
+            if (len == 1 && *name == '*') {
+                any = !zero;
+                continue;
+            }
+            for (int n = 0; n < CODING_MAX; n++) {
+                const char* coding = content_codings[n].name;
+                if ((len == strlen(coding) && !strnicmp(name, coding, len))
+                        || (n == CODING_GZIP && len == 6 && !strnicmp(name, "x-gzip", 6)))
+                    (zero ? refused : allowed) |= 1 << n;
+            }
+        }
+        if (any)
+            allowed |= ~refused;
+        allowed &= codings & ~refused;
+        for (int n = 0; n < CODING_MAX; n++)
+            if (allowed & (1 << n))
+                return n;
+        return -1;
+    }
+
+    // types worth compressing on the fly: text, and the usual text-based
+    // application formats.
+    static bool compressible_type(const std::string& type) {
+        static const char* types[] = {
+            "text/", "application/javascript", "application/x-javascript",
+            "application/json", "application/xml", "application/xhtml+xml",
+            "image/svg+xml", NULL
+        };
+        std::string mime = type.substr(0, type.find(';'));
+        for (const char** t = types; *t; t++)
+            if (!strnicmp(mime.c_str(), *t, strlen(*t)))
+                return true;
+        size_t plus = mime.rfind('+');
+        return plus != std::string::npos
+            && (!stricmp(mime.c_str() + plus, "+xml") || !stricmp(mime.c_str() + plus, "+json"));
+    }
+
+    enum {
+        ENCODE_MORE, ENCODE_FLUSH, ENCODE_FINISH
+    };
+
+    // a compressor of a worker thread. the streams are made on first use
+    // and reset for each response, so none is allocated per request.
+    typedef struct {
+        int coding;
+#ifdef HAVE_LIBZ
+        z_stream gzip;
+        z_stream deflate;
+        bool gzip_ready;
+        bool deflate_ready;
+#endif
+#ifdef HAVE_LIBZSTD
+        ZSTD_CCtx* zstd;
+#endif
+    } ENCODER;
+
+#if defined HAVE_LIBZ || defined HAVE_LIBZSTD
+    static __thread ENCODER* worker_encoder = NULL;
+#endif
+
+    // the codings this build can apply on the fly.
+    static int encoder_codings() {
+        int codings = 0;
+#ifdef HAVE_LIBZ
+        codings |= (1 << CODING_GZIP) | (1 << CODING_DEFLATE);
+#endif
+#ifdef HAVE_LIBZSTD
+        codings |= 1 << CODING_ZSTD;
+#endif
+        return codings;
+    }
+
+    // the thread's compressor, ready for a new body in coding, or NULL.
+    static ENCODER* encoder_begin(server* httpd, int coding) {
+#if defined HAVE_LIBZ || defined HAVE_LIBZSTD
+        ENCODER* enc = worker_encoder;
+        if (!enc) {
+            enc = worker_encoder = new ENCODER;
+#ifdef HAVE_LIBZ
+            enc->gzip_ready = enc->deflate_ready = false;
+#endif
+#ifdef HAVE_LIBZSTD
+            enc->zstd = NULL;
+#endif
+        }
+        enc->coding = coding;
+#ifdef HAVE_LIBZ
+        if (coding == CODING_GZIP || coding == CODING_DEFLATE) {
+            bool gzip = coding == CODING_GZIP;
+            z_stream* z = gzip ? &enc->gzip : &enc->deflate;
+            bool& ready = gzip ? enc->gzip_ready : enc->deflate_ready;
+            if (ready)
+                return deflateReset(z) == Z_OK ? enc : NULL;
+            memset(z, 0, sizeof(*z));
+            // 15 bits is a zlib stream, and 16 more a gzip one.
+            if (deflateInit2(z, httpd->compress_level, Z_DEFLATED, gzip ? 31 : 15,
+                        8, Z_DEFAULT_STRATEGY) != Z_OK)
+                return NULL;
+            ready = true;
+            return enc;
+        }
+#endif
+#ifdef HAVE_LIBZSTD
+        if (coding == CODING_ZSTD) {
+            if (enc->zstd)
+                return ZSTD_isError(ZSTD_CCtx_reset(enc->zstd, ZSTD_reset_session_only)) ? NULL : enc;
+            enc->zstd = ZSTD_createCCtx();
+            if (!enc->zstd)
+                return NULL;
+            ZSTD_CCtx_setParameter(enc->zstd, ZSTD_c_compressionLevel, httpd->zstd_level);
+            return enc;
+        }
+#endif
+#endif
+        return NULL;
+    }
+
+    // compresses size bytes of data onto the end of out. ENCODE_FLUSH
+    // pushes out all that was given so far, and ENCODE_FINISH ends the
+    // body.
+    static bool encoder_write(ENCODER* enc, const char* data, size_t size, int mode, std::string& out) {
+#ifdef HAVE_LIBZ
+        if (enc->coding == CODING_GZIP || enc->coding == CODING_DEFLATE) {
+            z_stream* z = enc->coding == CODING_GZIP ? &enc->gzip : &enc->deflate;
+            int flush = mode == ENCODE_FINISH ? Z_FINISH : mode == ENCODE_FLUSH ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+            z->next_in = (Bytef*)data;
+            z->avail_in = (uInt)size;
+            do {
+                size_t at = out.size();
+                out.resize(at + BUFSIZ);
+                z->next_out = (Bytef*)&out[at];
+                z->avail_out = BUFSIZ;
+                int r = deflate(z, flush);
+                out.resize(at + BUFSIZ - z->avail_out);
+                if (r == Z_STREAM_ERROR)
+                    return false;
+            } while (z->avail_out == 0);
+            return true;
+        }
+#endif
+#ifdef HAVE_LIBZSTD
+        if (enc->coding == CODING_ZSTD) {
+            ZSTD_EndDirective end = mode == ENCODE_FINISH ? ZSTD_e_end
+                : mode == ENCODE_FLUSH ? ZSTD_e_flush : ZSTD_e_continue;
+            ZSTD_inBuffer in = { data, size, 0 };
+            size_t left;
+            do {
+                size_t at = out.size();
+                out.resize(at + BUFSIZ);
+                ZSTD_outBuffer o = { &out[at], BUFSIZ, 0 };
+                left = ZSTD_compressStream2(enc->zstd, &o, &in, end);
+                out.resize(at + o.pos);
+                if (ZSTD_isError(left))
+                    return false;
+            } while (end == ZSTD_e_continue ? in.pos < in.size : left != 0);
+            return true;
+        }
+#endif
+        return false;
+    }
+
+#ifndef _WIN32
+    // compressed variants of static text files without sidecars. the
+    // first request for one queues it and goes out as is; a background
+    // thread compresses the file into a mem cache of its own, keyed by
+    // path and coding and checked against the stat of the file like any
+    // other entry, so the foreground never waits on compression. a
+    // variant that would not be smaller is kept empty, and the file keeps
+    // going out as is.
+    typedef struct {
+        std::string path;
+        std::string type;
+        int coding;
+        struct stat st;
+    } ZIP_JOB;
+
+    struct ZipCache {
+        server* httpd;
+        MemCache* cache;
+        pthread_mutex_t lock;
+        sem_t ready;
+        std::map<std::string, ZIP_JOB> jobs;
+        volatile unsigned long made;
+        volatile unsigned long dropped;
+    };
+
+    static std::string zip_cache_key(const std::string& path, int coding) {
+        return path + "\t" + content_codings[coding].name;
+    }
+
+    // the variant, made and inserted; false when the file has changed
+    // since it was queued.
+    static bool zip_cache_make(ZipCache* zc, const std::string& key, const ZIP_JOB& job) {
+        int fd = open(job.path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        std::string data;
+        size_t got = 0;
+        if (fstat(fd, &st) == 0 && mem_cache_same(st, job.st)) {
+            data.resize((size_t)st.st_size);
+            while (got < data.size()) {
+                ssize_t r = pread(fd, &data[got], data.size() - got, (off_t)got);
+                if (r < 0 && errno == EINTR)
+                    continue;
+                if (r <= 0)
+                    break;
+                got += r;
+            }
+        }
+        close(fd);
+        ENCODER* enc;
+        if (data.empty() || got != data.size() || !(enc = encoder_begin(zc->httpd, job.coding)))
+            return false;
+
+        MEM_ENTRY* entry = new MEM_ENTRY;
+        if (!encoder_write(enc, data.data(), data.size(), ENCODE_FINISH, entry->body)
+                || entry->body.size() >= data.size())
+            entry->body.clear();
+        entry->path = key;
+        entry->data = entry->body.data();
+        entry->length = entry->body.size();
+        entry->map = NULL;
+        entry->arena = NULL;
+        entry->file_time = res_ftime(st.st_mtime);
+        entry->etag = res_etag(st);
+        entry->etag.insert(entry->etag.size() - 1, std::string("-") + content_codings[job.coding].name);
+        res_entity_head(entry->head, job.type, entry->length, entry->file_time, entry->etag);
+        entry->st = st;
+        entry->refs = 0;
+        mem_cache_insert(zc->cache, entry);
+        return true;
+    }
+
+    static void* zip_cache_worker(void* param) {
+        ZipCache* zc = (ZipCache*)param;
+        for (;;) {
+            if (sem_wait(&zc->ready) != 0)
+                continue;
+            pthread_mutex_lock(&zc->lock);
+            std::map<std::string, ZIP_JOB>::iterator it = zc->jobs.begin();
+            if (it == zc->jobs.end()) {
+                pthread_mutex_unlock(&zc->lock);
+                continue;
+            }
+            std::string key = it->first;
+            ZIP_JOB job = it->second;
+            pthread_mutex_unlock(&zc->lock);
+
+            if (zip_cache_make(zc, key, job))
+                __sync_fetch_and_add(&zc->made, 1);
+            // done only now, so the same file is not queued again while
+            // it is being compressed.
+            pthread_mutex_lock(&zc->lock);
+            zc->jobs.erase(key);
+            pthread_mutex_unlock(&zc->lock);
+        }
+        return NULL;
+    }
+
+    static ZipCache* zip_cache_create(server* httpd) {
+        if (!httpd->compress || !encoder_codings())
+            return NULL;
+        MemCache* cache = mem_cache_create("zip", httpd->zip_cache_size, 0, httpd->zip_cache_file, false);
+        if (!cache)
+            return NULL;
+        ZipCache* zc = new ZipCache;
+        zc->httpd = httpd;
+        zc->cache = cache;
+        pthread_mutex_init(&zc->lock, NULL);
+        sem_init(&zc->ready, 0, 0);
+        zc->made = zc->dropped = 0;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        pthread_t pth;
+        int r = pthread_create(&pth, &attr, zip_cache_worker, (void*)zc);
+        pthread_attr_destroy(&attr);
+        if (r != 0) {
+            my_perror("pthread_create");
+            return NULL;
+        }
+        return zc;
+    }
+
+    // a response sending the variant of the file in coding, or NULL while
+    // there is none to send; a missing one is queued without waiting.
+    static RES_INFO* zip_cache_open(ZipCache* zc, const std::string& path, int coding,
+            const struct stat& st, const std::string& type) {
+        if (!mem_cache_fits(zc->cache, st))
+            return NULL;
+        std::string key = zip_cache_key(path, coding);
+        RES_INFO* res_info = mem_cache_open(zc->cache, key, st);
+        if (res_info && !res_info->mem->length) {
+            res_close(res_info);
+            return NULL;
+        }
+        if (res_info)
+            return res_info;
+        pthread_mutex_lock(&zc->lock);
+        bool queued = zc->jobs.find(key) != zc->jobs.end();
+        bool full = !queued && zc->jobs.size() >= ZIP_QUEUE;
+        bool queue = !queued && !full;
+        if (queue) {
+            ZIP_JOB& job = zc->jobs[key];
+            job.path = path;
+            job.type = type;
+            job.coding = coding;
+            job.st = st;
+        }
+        pthread_mutex_unlock(&zc->lock);
+        if (queue)
+            sem_post(&zc->ready);
+        else if (full)
+            __sync_fetch_and_add(&zc->dropped, 1);
+        return NULL;
+    }
+
+    static void zip_cache_stats(ZipCache* zc) {
+        mem_cache_stats(zc->cache);
+        printf("* zip queue: made: %lu, dropped: %lu\n", zc->made, zc->dropped);
+    }
+
+    // rendered directory listings, kept in a mem cache under the path of
+    // the directory. one stands while the directory keeps its inode and
+    // mtime, which change as entries come and go, and for list_cache_ttl
+    // seconds at most, since a file growing in place does not touch the
+    // directory. its ETag goes with it, so a fresh one answers a
+    // conditional request without reading the directory at all.
+    static MEM_ENTRY* list_cache_acquire(server* httpd, const std::string& path, const struct stat& st) {
+        if (!httpd->listcache)
+            return NULL;
+        MEM_ENTRY* entry = mem_cache_acquire(httpd->listcache, path, st);
+        if (entry && entry->made + httpd->list_cache_ttl < time(NULL)) {
+            mem_cache_release(entry);
+            entry = NULL;
+        }
+        return entry;
+    }
+
+    // a directory modified within the current second may change again
+    // with the same mtime, so its listing is not kept.
+    static void list_cache_insert(server* httpd, const std::string& path, const struct stat& st,
+            const std::string& etag, const std::string& body) {
+        time_t now = time(NULL);
+        if (!httpd->listcache || body.size() > httpd->listcache->max_file || st.st_mtime >= now)
+            return;
+        MEM_ENTRY* entry = new MEM_ENTRY;
+        entry->path = path;
+        entry->body = body;
+        entry->data = entry->body.data();
+        entry->length = entry->body.size();
+        entry->map = NULL;
+        entry->arena = NULL;
+        entry->etag = etag;
+        entry->st = st;
+        entry->made = now;
+        entry->refs = 0;
+        mem_cache_insert(httpd->listcache, entry);
+    }
+#endif
+
+    // HTTP_* variables for a cgi, built only when one runs. names are
+    // upper-cased with '-' turned into '_', and a repeated header keeps
+    // its last value.
+    static void header_envs(const HTTP_REQUEST* r, std::vector<std::string>& envs) {
+        server::HttpHeader headers;
+        for (int n = 0; n < r->nheaders; n++) {
+            const char *name = r->base + r->name[n].off;
+            int len = r->name[n].len;
+            if (!strnicmp(name, "SERVER_", 7) || !strnicmp(name, "REMOTE_", 7))
+                continue;
+            if (len == 4 && !strnicmp(name, "host", 4))
+                continue;
+            std::string key(name, len);
+            for (std::string::iterator it = key.begin(); it != key.end(); it++)
+                *it = *it == '-' ? '_' : toupper(*it);
+            headers[key] = span_string(r, r->value[n]);
+        }
+        server::HttpHeader::const_iterator it;
+        for (it = headers.begin(); it != headers.end(); it++)
+            envs.push_back("HTTP_" + it->first + "=" + it->second);
+    }
+
+    // "bytes=0-99,200-,-50" against a file of size bytes. returns 1 with
+    // the ranges to send in parts, -1 when none of them can be satisfied,
+    // and 0 when the header is to be ignored: another unit, bad syntax,
+    // or more (or more overlapping) ranges than is reasonable.
+    static int parse_ranges(const std::string& spec, unsigned long long size, std::vector<RES_PART>& parts) {
+        const char *ptr = spec.c_str();
+        unsigned long long total = 0;
+        int specs = 0;
+        char *end;
+
+        if (strnicmp(ptr, "bytes=", 6))
+            return 0;
+        ptr += 6;
+        while (*ptr) {
+            unsigned long long first, last;
+            bool satisfiable = true;
+            while (*ptr == ' ' || *ptr == '\t')
+                ptr++;
+            if (*ptr == '-' && isdigit((unsigned char)ptr[1])) {
+                // the last n bytes.
+                unsigned long long n = strtoull(ptr + 1, &end, 10);
+                ptr = end;
+                satisfiable = n > 0 && size > 0;
+                first = n >= size ? 0 : size - n;
+                last = size - 1;
+            } else if (isdigit((unsigned char)*ptr)) {
+                first = strtoull(ptr, &end, 10);
+                ptr = end;
+                if (*ptr++ != '-')
+                    return 0;
+                last = (unsigned long long)-1;
+                if (isdigit((unsigned char)*ptr)) {
+                    last = strtoull(ptr, &end, 10);
+                    ptr = end;
+                    if (last < first)
+                        return 0;
+                }
+                satisfiable = first < size;
+                if (last >= size)
+                    last = size - 1;
+            } else
+                return 0;
+            while (*ptr == ' ' || *ptr == '\t')
+                ptr++;
+            if (*ptr == ',')
+                ptr++;
+            else if (*ptr)
+                return 0;
+            if (++specs > MAX_RANGES)
+                return 0;
+            if (satisfiable) {
+                RES_PART part;
+                part.offset = first;
+                part.length = last - first + 1;
+                parts.push_back(part);
+                total += part.length;
+            }
+        }
+        if (specs == 0)
+            return 0;
+        if (parts.empty())
+            return -1;
+        if (parts.size() > 1 && total > size) {
+            parts.clear();
+            return 0;
+        }
+        return 1;
+    }
+
+#ifdef HAVE_SYS_EPOLL_H
+    static bool event_rearm(server::HttpdInfo* pHttpdInfo, bool writing) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = (writing ? EPOLLOUT : EPOLLIN) | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+        ev.data.ptr = pHttpdInfo;
+        return epoll_ctl(pHttpdInfo->acceptor->epfd, EPOLL_CTL_MOD, pHttpdInfo->msgsock, &ev) == 0;
+    }
+
+    // an idle keep-alive connection, or one with a file transfer waiting
+    // for the socket, goes back to the event loop. the deadline is set
+    // before re-arming and under the lock, so the wheel cannot close it in
+    // between, and the worker must not touch it after.
+    static bool conn_park(server::HttpdInfo* pHttpdInfo, int kind) {
+        TimerWheel* wheel = pHttpdInfo->acceptor->timers;
+        conn_unring(pHttpdInfo);
+        if (!wheel)
+            return event_rearm(pHttpdInfo, kind == TIMER_SEND);
+        pthread_mutex_lock(&wheel->lock);
+        wheel_schedule(wheel, pHttpdInfo, kind);
+        pHttpdInfo->parked = true;
+        bool rearmed = event_rearm(pHttpdInfo, kind == TIMER_SEND);
+        if (!rearmed) {
+            pHttpdInfo->parked = false;
+            wheel_schedule(wheel, pHttpdInfo, TIMER_NONE);
+        }
+        pthread_mutex_unlock(&wheel->lock);
+        return rearmed;
+    }
+#endif
+
+    // the peer is kept in binary by the acceptor; format it once per
+    // connection, in the worker.
+    static void peer_name(server::HttpdInfo* pHttpdInfo) {
+        server *httpd = pHttpdInfo->httpd;
+        char address[NI_MAXHOST] = {0}, port[NI_MAXSERV] = {0};
+        int numeric_host = NI_NUMERICHOST;
+
+        if (!pHttpdInfo->address.empty())
+            return;
+        if (pHttpdInfo->peer_len == 0) {
+            // accepted by the ring without an address.
+            pHttpdInfo->peer_len = sizeof(pHttpdInfo->peer);
+            getpeername(pHttpdInfo->msgsock, (struct sockaddr*)&pHttpdInfo->peer, &pHttpdInfo->peer_len);
+        }
+        // privsep?
+        if (httpd->chroot.empty() && httpd->family != AF_INET)
+            numeric_host = 0;
+        if (getnameinfo((struct sockaddr*)&pHttpdInfo->peer, pHttpdInfo->peer_len,
+                    address, sizeof(address), port, sizeof(port),
+                    numeric_host | NI_NUMERICSERV))
+            fprintf(stderr, "could not get peername\n");
+        pHttpdInfo->address = address;
+        pHttpdInfo->port = port;
+    }
+
+    static void response_handle(server::HttpdInfo* pHttpdInfo) {
+        server *httpd = pHttpdInfo->httpd;
+        int msgsock = (int)pHttpdInfo->msgsock;
+        peer_name(pHttpdInfo);
+        std::string address = pHttpdInfo->address;
+        std::string port = pHttpdInfo->port;
+        int servno = pHttpdInfo->servno;
+        std::string str, req, ret;
+        std::vector<std::string> vparam;
+        std::vector<std::string> vauth;
+        std::string res_code;
+        std::string res_proto;
+        std::string res_msg;
+        std::string res_type;
+        std::string res_body;
+        std::string res_head;
+        HTTP_REQUEST request;
+        unsigned long long content_length;
+        RES_INFO* res_info;
+        int resolved_fd;
+#ifndef _WIN32
+        MemCache* memcache;
+#endif
+        ENCODER* encoder;
+        bool chunked;
+        std::string coded;
+        // a listing that goes out in chunks as its rows are formatted,
+        // and the directory it is cached under.
+        std::vector<server::ListInfo> flist;
+        bool listing;
+        bool list_page;
+        std::string list_path;
+        std::string list_tag;
+        struct stat list_st;
+        char buf[BUFSIZ];
+        char length[256];
+        bool keep_alive;
+        int got;
+        bool lingering = false;
+        std::string pending;
+        int served = 0;
+
+#ifdef HAVE_SYS_EPOLL_H
+        if (pHttpdInfo->transfer) {
+            // the socket has drained; go on with the file.
+            Transfer *transfer = pHttpdInfo->transfer;
+#if defined LINUX_SENDFILE_API
+            int r = transfer->mem
+                ? transfer_mem(pHttpdInfo, transfer->mem, &transfer->offset, transfer->end, true)
+                : transfer_file(pHttpdInfo, transfer->fd, &transfer->offset, transfer->end, true);
+#else
+            int r = transfer_mem(pHttpdInfo, transfer->mem, &transfer->offset, transfer->end, true);
+#endif
+            if (r == TRANSFER_AGAIN && conn_park(pHttpdInfo, TIMER_SEND))
+                return;
+            keep_alive = r == TRANSFER_DONE && transfer->keep_alive;
+            transfer_close(pHttpdInfo);
+            goto request_next;
+        }
+#endif
+
+request_top:
+        keep_alive = false;
+        res_code.clear();
+        res_proto.clear();
+        res_msg.clear();
+        res_type.clear();
+        res_head.clear();
+        res_body.clear();
+        res_info = NULL;
+        resolved_fd = -1;
+        encoder = NULL;
+        chunked = false;
+        listing = false;
+        list_page = false;
+        flist.clear();
+        content_length = 0;
+        vauth.clear();
+        vparam.clear();
+        req.clear();
+
+        if (served > 0 && conn_buffered(pHttpdInfo) == 0)
+            conn_timer(pHttpdInfo, TIMER_IDLE);
+        else
+            conn_timer(pHttpdInfo, TIMER_HEADER);
+        parse_init(&request);
+        while (true) {
+            int avail = conn_buffered(pHttpdInfo);
+            got = avail > 0 ? parse_request(&request, pHttpdInfo->rbuf + pHttpdInfo->rpos, avail) : 0;
+            if (got != 0)
+                break;
+            if (avail >= MAX_HEADER_SIZE) {
+                got = -1;
+                break;
+            }
+            // the client may be waiting for held back responses before it
+            // sends the rest. conn_fill keeps the request at the start of
+            // the buffer.
+            flush_pending(msgsock, pending);
+            if (conn_fill(pHttpdInfo) <= 0)
+                goto request_end;
+            if (pHttpdInfo->timer_kind == TIMER_IDLE)
+                conn_timer(pHttpdInfo, TIMER_HEADER);
+        }
+        if (got > 0) {
+            request.base = pHttpdInfo->rbuf + pHttpdInfo->rpos;
+            pHttpdInfo->rpos += request.pos;
+            req = span_string(&request, request.line);
+            if (VERBOSE(1)) printf("* %s\n", req.c_str());
+        }
+        if (got < 0) {
+            if (VERBOSE(1)) printf("* request header too large\n");
+            res_proto = "HTTP/1.1";
+            res_type = "text/plain";
+            res_code = "431";
+            res_msg = "Request Header Fields Too Large";
+            res_body = "Request Header Fields Too Large\n";
+            lingering = true;
+            goto request_done;
+        }
+
+        if (VERBOSE(2)) {
+            for (int n = 0; n < request.nheaders; n++)
+                printf("  %.*s=%.*s\n",
+                        request.name[n].len, request.base + request.name[n].off,
+                        request.value[n].len, request.base + request.value[n].off);
+        }
+
+        // HTTP/1.1 connections persist unless the client asks to close.
+        if (request.version.len == 8 && !strncmp(request.base + request.version.off, "HTTP/1.1", 8))
+            keep_alive = !header_is(&request, HEADER_CONNECTION, "close");
+        else if (header_is(&request, HEADER_CONNECTION, "keep-alive"))
+            keep_alive = true;
+
+        // a body in a transfer coding is not decoded. left in the buffer it
+        // would be taken for the next request, so the connection ends here.
+        if (has_header(&request, HEADER_TRANSFER_ENCODING)) {
+            if (VERBOSE(1)) printf("* request body with a transfer coding\n");
+            res_proto = "HTTP/1.1";
+            res_type = "text/plain";
+            res_code = "501";
+            res_msg = "Not Implemented";
+            res_body = "Not Implemented\n";
+            keep_alive = false;
+            lingering = true;
+            goto request_done;
+        }
+        if (has_header(&request, HEADER_CONTENT_LENGTH))
+            content_length = strtoull(header_value(&request, HEADER_CONTENT_LENGTH).c_str(), NULL, 10);
+        if (content_length > 0)
+            conn_timer(pHttpdInfo, TIMER_BODY);
+
+        if (httpd->loggerfunc) {
+            httpd->loggerfunc(pHttpdInfo, req);
+        }
+
+        vparam.push_back(span_string(&request, request.method));
+        if (request.target.len > 0)
+            vparam.push_back(span_string(&request, request.target));
+        if (request.version.len > 0)
+            vparam.push_back(span_string(&request, request.version));
+        try {
+            if (httpd->accept_ips.size() > 0 &&
+                    std::find(httpd->accept_ips.begin(), httpd->accept_ips.end(), address)
+                    == httpd->accept_ips.end()) {
+                res_code = "403";
+                res_msg = "Forbidden";
+                res_body = "Forbidden";
+                goto request_done;
+            } else
+                if (vparam.size() < 2 || vparam[1][0] != '/') {
+                    res_code = "500";
+                    res_msg = "Bad Request";
+                    res_body = "Bad Request\n";
+                    goto request_done;
+                } else {
+                    if (vparam.size() == 2)
+                        res_proto = "HTTP/1.0";
+                    else
+                        res_proto = vparam[2];
+                    std::string auth = header_value(&request, HEADER_AUTHORIZATION);
+                    if (!auth.empty()) {
+                        if (!strnicmp(auth.c_str(), "basic ", 6))
+                            auth = base64_decode(auth.c_str()+6);
+                        split_string(auth, ":", vauth);
+                    }
+                    if (vparam[0] == "GET" || vparam[0] == "POST" || vparam[0] == "HEAD") {
+                        std::string root = httpd->root;
+                        std::string request_uri = vparam[1];
+                        std::string script_name = vparam[1];
+                        std::string query_string;
+                        std::string path_info = "/";
+                        size_t end_pos = vparam[1].find_first_of('?');
+                        if (end_pos != std::string::npos) {
+                            query_string = script_name.substr(end_pos+1);
+                            script_name = script_name.substr(0, end_pos);
+                            //request_uri = script_name;
+                            path_info = script_name;
+                        }
+
+                        server::RequestAliases::iterator it_alias;
+                        for(it_alias = httpd->request_aliases.begin();
+                                it_alias != httpd->request_aliases.end(); it_alias++) {
+                            if (path_info == it_alias->first) {
+                                vparam[1] = it_alias->second;
+                                break;
+                            }
+                        }
+
+                        std::string before = root;
+                        if (before[before.size()-1] == '/')
+                            before.resize(before.size() - 1);
+                        before += tthttpd::url_decode(script_name);
+                        RESOLVED resolved;
+                        resolve_request(httpd, before, resolved);
+                        resolved_fd = resolved.fd;
+                        std::string path = resolved.real;
+                        if (resolved.outside || (before != path && (path.size() < root.size() || path.substr(root.size()) == root))) {
+                            if (!resolved.outside && path.size() > root.size())
+                                path = path.c_str() + root.size();
+                            else
+                                path = "/";
+                            res_code = "301";
+                            res_msg = "Document Moved";
+                            res_body = "Document Moved\n";
+                            res_head = "Location: ";
+                            res_head += path;
+                            res_head += "\r\n";
+                            goto request_done;
+                        }
+                        /*
+                           if (strncmp(root.c_str(), path.c_str(), root.size())) {
+                           res_code = "500";
+                           res_msg = "Bad Request";
+                           res_body = "Bad Request\n";
+                           goto request_done;
+                           }
+                         */
+
+                        std::vector<server::BasicAuthInfo>::iterator it_basicauth;
+                        std::vector<std::string> methods;
+                        for (it_basicauth = httpd->basic_auths.begin(); it_basicauth != httpd->basic_auths.end(); it_basicauth++) {
+                            split_string(it_basicauth->method, "/", methods);
+                            if (!methods.empty() && std::find(methods.begin(), methods.end(), vparam[0]) == methods.end()) continue;
+                            if (!it_basicauth->target.empty() && strncmp(vparam[1].c_str(), it_basicauth->target.c_str(), it_basicauth->target.size())) continue;
+                            break;
+                        }
+                        if (it_basicauth != httpd->basic_auths.end()) {
+                            bool authorized = false;
+                            if (!vauth.empty()) {
+                                if (VERBOSE(2)) printf("  authorizing %s\n", vparam[1].c_str());
+                                std::vector<server::AuthInfo>::iterator it_auth;
+                                for (it_auth = it_basicauth->auths.begin(); it_auth != it_basicauth->auths.end(); it_auth++) {
+                                    if (it_auth->user != vauth[0]) continue;
+                                    /*
+                                       std::vector<std::string> pwd = split_string(it_auth->pass, "$");
+                                       std::string tmp = vauth[1];
+                                       tmp += "$apr1$";
+                                       tmp += pwd[2];
+                                       std::string pwd_md5 = string_to_hex(crypt(vauth[1].c_str(), pwd[2].c_str()));
+                                       printf("%s, %s\n", pwd_md5.c_str(), it_auth->pass.c_str());
+                                       if (it_auth->pass != pwd_md5) continue;
+                                     */
+                                    // TODO: only support plain-text password.
+                                    //  hope to access .htpasswd file.
+                                    if (it_auth->pass != vauth[1]) continue;
+                                    authorized = true;
+                                }
+                            }
+                            if (!authorized) {
+                                res_code = "401";
+                                res_msg = "Authorization Required";
+                                res_head = "WWW-Authenticate: Basic";
+                                if (!it_basicauth->realm.empty()) {
+                                    res_head += " realm=\"";
+                                    res_head += it_basicauth->realm;
+                                    res_head += "\"";
+                                }
+                                res_head += "\r\n";
+                                res_body = "Authorization Required";
+                                goto request_done;
+                            }
+                        }
+                        if (!vauth.empty()) {
+                            server::AcceptAuths::iterator it_accept;
+                            for(it_accept = httpd->accept_auths.begin(); it_accept != httpd->accept_auths.end(); it_accept++) {
+                                if (!strncmp(it_accept->first.c_str(), script_name.c_str(), it_accept->first.size())) {
+                                    if (std::find(
+                                                it_accept->second.accept_list.begin(),
+                                                it_accept->second.accept_list.end(), vauth[0])
+                                            == it_accept->second.accept_list.end()) {
+                                        res_code = "401";
+                                        res_msg = "Authorization Required";
+                                        res_head = "WWW-Authenticate: Basic";
+                                        if (!it_basicauth->realm.empty()) {
+                                            res_head += " realm=\"";
+                                            res_head += it_basicauth->realm;
+                                            res_head += "\"";
+                                        }
+                                        res_head += "\r\n";
+                                        res_body = "Authorization Required";
+                                        goto request_done;
+                                    }
+                                }
+                            }
+                        }
+
+                        if (resolved.isdir && vparam[1].size() && vparam[1][vparam[1].size()-1] != '/') {
+                            res_type = "text/plain";
+                            res_code = "301";
+                            res_msg = "Document Moved";
+                            res_body = "Document Moved\n";
+                            res_head = "Location: ";
+                            res_head += vparam[1];
+                            res_head += "/\r\n";
+                            goto request_done;
+                        }
+
+                        path = resolved.path;
+                        std::string type = resolved.type;
+                        int coding = -1;
+                        bool vary = resolved.codings != 0;
+                        const struct stat* file_st = &resolved.st;
+                        if (VERBOSE(2) && !httpd->default_cgi.empty() && path == httpd->default_cgi)
+                            printf("* running default_cgi: %s\n", path.c_str());
+                        if (resolved.handler != HANDLER_NONE) {
+                            path_info = resolved.path_info;
+                            script_name.resize(script_name.size() - path_info.size());
+                            if (resolved.handler == HANDLER_EXE ? path_info.empty() : script_name == "/")
+                                script_name += resolved.script;
+                        } else
+                            res_type = type;
+
+                        if (resolved.found && S_ISDIR(resolved.st.st_mode)) {
+                            if (VERBOSE(2)) printf("  listing %s\n", path.c_str());
+                            res_type = "text/html";
+                            res_code = "200";
+                            res_msg = "OK";
+                            if (!httpd->fs_charset.empty()) {
+                                res_type += "; charset=";
+                                res_type += trim_string(httpd->fs_charset);
+                            }
+                            // TODO: sort and reverse, sort key
+                            //std::map<std::string, std::string> params = tthttpd::parse_querystring(query_string);
+
+                            std::string etag;
+#ifndef _WIN32
+                            MEM_ENTRY* cached = list_cache_acquire(httpd, path, resolved.st);
+                            if (cached)
+                                etag = cached->etag;
+                            else
+#endif
+                            {
+                                flist = res_flist(httpd, path);
+                                etag = list_etag(resolved.st, flist);
+                            }
+                            // a compressed page is an entity of its own, as
+                            // are the variants of a static file.
+                            std::string tag = etag;
+                            coding = httpd->compress ? accept_coding(&request, encoder_codings()) : -1;
+                            if (coding >= 0)
+                                tag.insert(tag.size() - 1, std::string("-") + content_codings[coding].name);
+                            res_head = "ETag: " + tag + "\r\n";
+                            list_page = true;
+                            // rows change with the entries, not only with the
+                            // directory's mtime, so only the ETag counts.
+                            int status = res_condition(&request, vparam[0] == "GET" || vparam[0] == "HEAD",
+                                    tag, (time_t)-1);
+                            if (status && httpd->compress)
+                                res_head += "Vary: Accept-Encoding\r\n";
+                            if (status == 304) {
+                                res_code = "304";
+                                res_msg = "Not Modified";
+                            } else if (status) {
+                                res_type = "text/plain";
+                                res_code = "412";
+                                res_msg = "Precondition Failed";
+                                res_body = "Precondition Failed\n";
+                            }
+#ifndef _WIN32
+                            else if (cached)
+                                res_body.assign(cached->data, cached->length);
+                            if (cached) {
+                                mem_cache_release(cached);
+                                goto request_done;
+                            }
+#endif
+                            if (status) {
+                                flist.clear();
+                                goto request_done;
+                            }
+                            list_head(res_body, script_name);
+                            list_path = path;
+                            list_tag = etag;
+                            list_st = resolved.st;
+                            if (res_proto == "HTTP/1.1" && vparam[0] != "HEAD") {
+                                // rows are formatted as they go out.
+                                listing = true;
+                                goto request_done;
+                            }
+                            for(std::vector<server::ListInfo>::iterator it = flist.begin(); it != flist.end(); it++)
+                                list_row(res_body, *it);
+                            res_body += list_tail;
+#ifndef _WIN32
+                            list_cache_insert(httpd, list_path, list_st, etag, res_body);
+#endif
+                            flist.clear();
+                            goto request_done;
+                        }
+
+                        if (type[0] != '@') {
+                            // a sidecar the client accepts goes out in place
+                            // of the file, with the type of the file, or else
+                            // a variant compressed in the background.
+                            if (resolved.codings)
+                                coding = accept_coding(&request, resolved.codings);
+                            if (coding >= 0)
+                                file_st = &resolved.coded[coding];
+#ifndef _WIN32
+                            else if (httpd->zipcache && resolved.found && compressible_type(type)) {
+                                int live = accept_coding(&request, encoder_codings());
+                                if (live >= 0 && (res_info = zip_cache_open(httpd->zipcache, path, live, resolved.st, type)))
+                                    coding = live;
+                                vary = true;
+                            }
+#endif
+                            // the validators come from the stat the path
+                            // resolved to, so a 304 opens nothing.
+                            if (resolved.found) {
+                                std::string etag = res_info ? res_info->mem->etag : res_etag(*file_st);
+                                int status = res_condition(&request, vparam[0] == "GET" || vparam[0] == "HEAD",
+                                        etag, file_st->st_mtime);
+                                if (status) {
+                                    if (res_info) {
+                                        res_close(res_info);
+                                        res_info = NULL;
+                                    }
+                                    res_type = "text/plain";
+                                    res_head = "ETag: " + etag + "\r\n";
+                                    if (vary)
+                                        res_head += "Vary: Accept-Encoding\r\n";
+                                    if (status == 304) {
+                                        res_code = "304";
+                                        res_msg = "Not Modified";
+                                        res_body.clear();
+                                    } else {
+                                        res_code = "412";
+                                        res_msg = "Precondition Failed";
+                                        res_body = "Precondition Failed\n";
+                                    }
+                                    goto request_done;
+                                }
+                            }
+                            if (coding >= 0 && !res_info) {
+                                std::string coded = path + content_codings[coding].ext;
+#ifndef _WIN32
+                                if ((memcache = mem_cache_class(httpd, *file_st)))
+                                    res_info = mem_cache_open(memcache, coded, *file_st);
+#endif
+                                if (!res_info)
+                                    res_info = res_fopen(coded, httpd->fdcache);
+                                if (res_info)
+                                    path = coded;
+                                else {
+                                    coding = -1;
+                                    file_st = &resolved.st;
+                                }
+                            }
+#ifndef _WIN32
+                            if (!res_info && resolved.found && (memcache = mem_cache_class(httpd, resolved.st)))
+                                res_info = mem_cache_open(memcache, path, resolved.st);
+#endif
+                            if (!res_info) {
+                                res_info = res_fopen(path, httpd->fdcache, resolved_fd, &resolved.st);
+                                resolved_fd = -1;
+                            }
+                        }
+                        if (type[0] == '@' ? !resolved.found : !res_info) {
+                            res_type = "text/plain";
+                            res_code = "404";
+                            res_msg = "Not Found";
+                            res_body = "Not Found\n";
+                            goto request_done;
+                        }
+
+                        res_code = "200";
+                        res_msg = "OK";
+                        if (type[0] != '@') {
+                            std::string file_time = res_file_time(res_info, *file_st);
+                            std::string etag = res_info->mem ? res_info->mem->etag : res_etag(*file_st);
+                            res_info->size = res_fsize(res_info);
+#ifndef _WIN32
+                            if (!res_info->mem && (memcache = mem_cache_class(httpd, res_info->st))) {
+                                std::string head;
+                                res_entity_head(head, type, res_info->size, file_time, etag);
+                                res_info->mem = mem_cache_fill(memcache, path, res_info, head, file_time, etag);
+                            }
+#endif
+                            sprintf(buf, SIZE_FORMAT, res_info->size);
+                            // a stale If-Range asks for the whole file.
+                            int ranged = 0;
+                            if (vparam[0] == "GET" && has_header(&request, HEADER_RANGE)
+                                    && range_current(&request, etag, file_st->st_mtime))
+                                ranged = parse_ranges(header_value(&request, HEADER_RANGE),
+                                        res_info->size, res_info->parts);
+                            if (ranged < 0) {
+                                res_close(res_info);
+                                res_info = NULL;
+                                res_type = "text/plain";
+                                res_code = "416";
+                                res_msg = "Range Not Satisfiable";
+                                res_head = "Content-Range: bytes */";
+                                res_head += buf;
+                                res_head += "\r\n";
+                                res_body = "Range Not Satisfiable\n";
+                                goto request_done;
+                            }
+                            if (ranged > 0) {
+                                res_code = "206";
+                                res_msg = "Partial Content";
+                            }
+                            if (ranged > 0 && res_info->parts.size() == 1) {
+                                RES_PART& part = res_info->parts[0];
+                                sprintf(buf, "bytes " SIZE_FORMAT "-" SIZE_FORMAT "/" SIZE_FORMAT,
+                                        part.offset, part.offset + part.length - 1, res_info->size);
+                                res_head += "Content-Range: ";
+                                res_head += buf;
+                                res_head += "\r\n";
+                                res_info->offset = part.offset;
+                                res_info->size = part.length;
+                                res_info->parts.clear();
+                                res_fseek(res_info, res_info->offset);
+                            }
+                            if (ranged > 0 && res_info->parts.size() > 1) {
+                                char boundary[64];
+                                sprintf(boundary, "%08lx%08x", (unsigned long)time(NULL),
+                                        (unsigned int)msgsock * 2654435761U);
+                                unsigned long long body_size = 0;
+                                std::vector<RES_PART>::iterator it;
+                                for (it = res_info->parts.begin(); it != res_info->parts.end(); it++) {
+                                    sprintf(buf, "bytes " SIZE_FORMAT "-" SIZE_FORMAT "/" SIZE_FORMAT,
+                                            it->offset, it->offset + it->length - 1, res_info->size);
+                                    it->head = it == res_info->parts.begin() ? "--" : "\r\n--";
+                                    it->head += boundary;
+                                    it->head += "\r\n";
+                                    if (!type.empty())
+                                        it->head += "Content-Type: " + type + "\r\n";
+                                    it->head += "Content-Range: ";
+                                    it->head += buf;
+                                    it->head += "\r\n\r\n";
+                                    body_size += it->head.size() + it->length;
+                                }
+                                RES_PART tail;
+                                tail.head = "\r\n--";
+                                tail.head += boundary;
+                                tail.head += "--\r\n";
+                                tail.offset = tail.length = 0;
+                                res_info->parts.push_back(tail);
+                                body_size += tail.head.size();
+                                res_info->size = body_size;
+                                res_entity_head(res_head, std::string("multipart/byteranges; boundary=") + boundary,
+                                        res_info->size, file_time, etag);
+                            } else if (ranged > 0 || !res_info->mem)
+                                res_entity_head(res_head, type, res_info->size, file_time, etag);
+                            else
+                                res_head += res_info->mem->head;
+                            if (coding >= 0) {
+                                res_head += "Content-Encoding: ";
+                                res_head += content_codings[coding].name;
+                                res_head += "\r\n";
+                            }
+                            if (vary)
+                                res_head += "Vary: Accept-Encoding\r\n";
+                            res_head += "Date: ";
+                            res_head += res_curtime();
+                            res_head += "\r\n";
+                            if (has_header(&request, HEADER_CONNECTION))
+                                res_head += "Connection: " + header_value(&request, HEADER_CONNECTION) + "\r\n";
+                        } else {
+                            std::vector<std::string> envs;
+                            std::vector<std::string> args;
+
+                            if (type.size() == 1) {
+                                args.push_back(path);
+                            } else {
+                                args.push_back(type.substr(1));
+                                args.push_back(path);
+                            }
+                            if (query_string.size())
+                                args.push_back(query_string);
+
+                            std::string env;
+
+                            if (has_header(&request, HEADER_HOST)) {
+                                env = "HTTP_HOST=";
+                                env += header_value(&request, HEADER_HOST);
+                                envs.push_back(env);
+                            } else
+                                if (httpd->hostname.size()) {
+                                    sprintf(buf, "HTTP_HOST=%s:%s", httpd->hostname.c_str(), httpd->port.c_str());
+                                    env = buf;
+                                    envs.push_back(env);
+                                }
+
+                            env = "SERVER_PROTOCOL=HTTP/1.1";
+                            envs.push_back(env);
+
+                            env = "SERVER_ADDR=";
+                            env += httpd->hostaddr[servno];
+                            envs.push_back(env);
+
+                            env = "SERVER_NAME=";
+                            if (httpd->hostname.size()) {
+                                env += httpd->hostname;
+                            } else {
+                                env += header_value(&request, HEADER_HOST);
+                            }
+                            envs.push_back(env);
+
+                            sprintf(buf, "SERVER_PORT=%s", httpd->port.c_str());
+                            env = buf;
+                            envs.push_back(env);
+
+                            env = "REMOTE_ADDR=";
+                            env += address;
+                            envs.push_back(env);
+
+                            sprintf(buf, "REMOTE_PORT=%s", port.c_str());
+                            env = buf;
+                            envs.push_back(env);
+
+                            if (vauth.size() && !vauth[0].empty()) {
+                                env = "REMOTE_USER=";
+                                env += vauth[0];
+                                envs.push_back(env);
+                            }
+
+                            header_envs(&request, envs);
+
+                            env = "REQUEST_METHOD=";
+                            env += vparam[0];
+                            envs.push_back(env);
+
+                            env = "REQUEST_URI=";
+                            env += request_uri;
+                            envs.push_back(env);
+
+                            env = "SCRIPT_FILENAME=";
+                            env += path;
+                            envs.push_back(env);
+
+                            env = "SCRIPT_NAME=";
+                            env += script_name;
+                            envs.push_back(env);
+
+                            env = "QUERY_STRING=";
+                            env += query_string;
+                            envs.push_back(env);
+
+                            if (!path_info.empty()) {
+                                env = "PATH_INFO=";
+                                env += path_info;
+                                envs.push_back(env);
+                            } else {
+                                env = "PATH_INFO=";
+                                env += request_uri;
+                                envs.push_back(env);
+                            }
+
+                            env = "REDIRECT_STATUS=1";
+                            envs.push_back(env);
+
+                            env = "PATH=";
+                            env += getenv("PATH");
+                            envs.push_back(env);
+
+#ifdef _WIN32
+                            GetWindowsDirectoryA(buf, sizeof(buf));
+                            env = "SystemRoot=";
+                            env += buf;
+                            envs.push_back(env);
+#endif
+
+                            char* p = getenv("PERL5LIB");
+                            if (p) {
+                                env = "PERL5LIB=";
+                                env += p;
+                                envs.push_back(env);
+                            }
+
+                            env = "SERVER_SOFTWARE=tinytinyhttpd";
+                            envs.push_back(env);
+
+                            env = "SERVER_PROTOCOL=HTTP/1.1";
+                            envs.push_back(env);
+
+                            env = "GATEWAY_INTERFACE=CGI/1.1";
+                            envs.push_back(env);
+
+                            server::RequestEnvironments::iterator it_env;
+                            for(it_env = httpd->request_environments.begin(); it_env != httpd->request_environments.end(); it_env++) {
+                                env = it_env->first + "=";
+                                env += it_env->second;
+                                envs.push_back(env);
+                            }
+
+                            if (vparam[0] == "POST") {
+                                env = "CONTENT_TYPE=";
+                                env += header_value(&request, HEADER_CONTENT_TYPE);
+                                envs.push_back(env);
+
+                                sprintf(buf, SIZE_FORMAT, content_length);
+                                env = "CONTENT_LENGTH=";
+                                env += buf;
+                                envs.push_back(env);
+                            }
+
+                            if (VERBOSE(4)) {
+                                std::vector<std::string>::iterator it;
+                                printf("  --- ARGS ---\n");
+                                for(it = args.begin(); it != args.end(); it++)
+                                    printf("  %s\n", it->c_str());
+                                printf("  --- ENVS ---\n");
+                                for(it = envs.begin(); it != envs.end(); it++)
+                                    printf("  %s\n", it->c_str());
+                                printf("  ------------\n");
+                            }
+
+                            res_info = res_popen(args, envs);
+
+                            if (res_info && content_length > 0) {
+                                while (content_length) {
+                                    memset(buf, 0, sizeof(buf));
+                                    int read = conn_read(pHttpdInfo, buf,
+                                            content_length < sizeof(buf) ? (int)content_length : (int)sizeof(buf));
+                                    if (read <= 0) break;
+                                    int w = res_write(res_info, buf, read);
+                                    content_length -= w;
+                                }
+
+                                if (!header_is(&request, HEADER_CONNECTION, "upgrade"))
+                                    res_closewriter(res_info);
+                                if (content_length) {
+                                    res_type = "text/plain";
+                                    res_code = "500";
+                                    res_msg = "Bad Request";
+                                    res_body = "Bad Request\n";
+                                    goto request_done;
+                                }
+                            } else {
+                                if (!header_is(&request, HEADER_CONNECTION, "upgrade"))
+                                    res_closewriter(res_info);
+                            }
+                        }
+                    } else {
+                        res_type = "text/plain";
+                        res_code = "500";
+                        res_msg = "Bad Request";
+                        res_body = "Bad Request\n";
+                        goto request_done;
+                    }
+                }
+        }
+        catch(...) {
+            if (res_code.size() == 0) {
+                if (VERBOSE(1)) my_perror(" cached exception");
+                res_type = "text/plain";
+                res_code = "500";
+                res_msg = "Bad Request";
+                res_body = "Internal Server Error\n";
+            }
+        }
+request_done:
+        if (resolved_fd >= 0) {
+            // resolved, then answered without the file.
+            close(resolved_fd);
+            resolved_fd = -1;
+        }
+
+        if (content_length > 0) {
+            while(content_length > 0) {
+                int ret = conn_read(pHttpdInfo, buf,
+                        content_length < sizeof(buf) ? (int)content_length : (int)sizeof(buf));
+                if (ret <= 0) {
+                    res_type = "text/plain";
+                    res_code = "500";
+                    res_msg = "Bad Request";
+                    res_body = "Bad Request\n";
+                    keep_alive = false;
+                    break;
+                }
+                content_length -= ret;
+            }
+        }
+        conn_timer(pHttpdInfo, TIMER_NONE);
+
+        if (res_info && res_info->process) {
+            bool res_keep_alive = false;
+            bool encoded = false;
+            std::string cgi_type, cgi_length;
+            res_head.clear();
+            flush_pending(msgsock, pending);
+
+            do {
+                memset(buf, 0, sizeof(buf));
+                str = res_fgets(res_info);
+                if (str.empty()) break;
+                const char *key, *ptr = str.c_str();
+                size_t len;
+                if (str[0] == '<') {
+                    // workaround for broken non-header response.
+                    sock_send(msgsock, ptr, strlen(ptr));
+                    res_code.clear();
+                    break;
+                }
+                if (VERBOSE(2)) printf("  %s\n", ptr);
+                if (res_head.empty()) {
+                    if (!strnicmp(ptr, "HTTP/1.", 7)) {
+                        char* tmp1;
+                        char* tmp2;
+
+                        tmp1 = (char*) strchr(ptr, ' ');
+                        if (tmp1) {
+                            *tmp1 = 0;
+                            res_proto = ptr;
+                            tmp2 = strchr(tmp1 + 1, ' ');
+                            if (tmp2) {
+                                *tmp2 = 0;
+                                res_code = tmp1 + 1;
+                                res_msg = tmp2 + 1;
+                            } else {
+                                res_code = tmp1 + 1;
+                            }
+                        }
+                        continue;
+                    }
+                }
+                key = "connection:";
+                len = strlen(key);
+                if (!strnicmp(ptr, key, len)) {
+                    if (!stricmp(trim_string(ptr + len).c_str(), "keep-alive"))
+                        res_keep_alive = true;
+                }
+                key = "WWW-Authenticate: Basic ";
+                len = strlen(key);
+                if (!strnicmp(ptr, key, len)) {
+                    res_code = "401";
+                    res_msg = "Unauthorized";
+                }
+                key = "Status:";
+                len = strlen(key);
+                if (!strnicmp(ptr, key, len)) {
+                    std::vector<std::string> codes;
+                    split_string(trim_string(str.substr(len)), " ", codes);
+                    if (codes.size())
+                        res_code = codes[0];
+                    else
+                        res_code = "";
+                }
+                key = "Content-Length:";
+                len = strlen(key);
+                if (!strnicmp(ptr, key, len)) {
+                    res_info->size = strtoull(str.substr(len).c_str(), NULL, 10);
+                    cgi_length = ptr;
+                    continue;
+                }
+                key = "Content-Type:";
+                len = strlen(key);
+                if (!strnicmp(ptr, key, len))
+                    cgi_type = trim_string(ptr + len);
+                if (!strnicmp(ptr, "Content-Encoding:", 17) || !strnicmp(ptr, "Transfer-Encoding:", 18))
+                    encoded = true;
+                res_head += ptr;
+                res_head += "\r\n";
+            } while (true);
+            // a compressible body is compressed as it is relayed, so its
+            // length is not known; HTTP/1.1 gets it in chunks.
+            if (httpd->compress && !res_code.empty() && res_code != "204" && res_code != "304"
+                    && vparam[0] != "HEAD" && !encoded && compressible_type(cgi_type)) {
+                int coding = accept_coding(&request, encoder_codings());
+                if (coding >= 0)
+                    encoder = encoder_begin(httpd, coding);
+                if (encoder) {
+                    res_info->size = (unsigned long long)-1;
+                    res_head += "Content-Encoding: ";
+                    res_head += content_codings[coding].name;
+                    res_head += "\r\n";
+                    if (res_proto == "HTTP/1.1") {
+                        res_head += "Transfer-Encoding: chunked\r\n";
+                        chunked = true;
+                    } else
+                        res_keep_alive = false;
+                }
+                res_head += "Vary: Accept-Encoding\r\n";
+            }
+            if (!encoder && !cgi_length.empty()) {
+                res_head += cgi_length;
+                res_head += "\r\n";
+            }
+            if (!res_keep_alive) {
+                keep_alive = false;
+                res_head += "Connection: close\r\n";
+            }
+        }
+
+        ret.clear();
+        if (!res_code.empty()) {
+            ret = res_proto;
+            ret += " ";
+            ret += res_code;
+            ret += " ";
+            ret += res_msg;
+            ret += "\r\n";
+        }
+        ret += res_head;
+
+        if (res_info) {
+            ret += "\r\n";
+            unsigned long long total = res_info->size;
+            unsigned long long sent = 0;
+            if (!res_info->process && !vparam.empty() && vparam[0] == "HEAD")
+                total = 0;
+            if (!res_info->parts.empty() && total != 0) {
+                ret.insert(0, pending);
+                pending.clear();
+                if (!send_parts(pHttpdInfo, res_info, ret))
+                    keep_alive = false;
+                ret.clear();
+                total = 0;
+            }
+            if (!res_info->process && total != (unsigned long long)-1 && keep_alive
+                    && conn_buffered(pHttpdInfo) > 0
+                    && pending.size() + ret.size() + total <= PIPELINE_BATCH) {
+                // another request is waiting; answer them in one write.
+                size_t at = pending.size() + ret.size();
+                pending += ret;
+                pending.resize(at + total);
+                while (sent < total) {
+                    long long r = res_read(res_info, &pending[at + sent], total - sent);
+                    if (r <= 0)
+                        break;
+                    sent += r;
+                }
+                if (sent < total) {
+                    // the file shrank under us; the length is already out.
+                    pending.resize(at + sent);
+                    keep_alive = false;
+                }
+                ret.clear();
+                total = sent = 0;
+            }
+            if (!ret.empty() && !pending.empty()) {
+                ret.insert(0, pending);
+                pending.clear();
+            }
+#ifdef WITH_IO_URING
+            if (res_info->mem && total > 0 && worker_arena && res_info->mem->arena == worker_arena) {
+                size_t head_sent, body_sent;
+                if (uring_send_fixed(msgsock, ret, &head_sent, res_info->mem->data + res_info->offset,
+                            total < SENDFILE_CHUNK ? (size_t)total : SENDFILE_CHUNK, &body_sent)
+                        && (head_sent == ret.size()
+                            || sock_send(msgsock, ret.data() + head_sent, ret.size() - head_sent)))
+                    sent = body_sent;
+                else {
+                    keep_alive = false;
+                    total = 0;
+                }
+                ret.clear();
+            } else
+#endif
+            if (res_info->mem && total > 0) {
+                // the head and the cached body in one write; the rest of
+                // a large mapped file goes on as a transfer below.
+                struct iovec iov[2];
+                iov[0].iov_base = (void*)ret.data();
+                iov[0].iov_len = ret.size();
+                iov[1].iov_base = (void*)(res_info->mem->data + res_info->offset);
+                iov[1].iov_len = total < SENDFILE_CHUNK ? (size_t)total : SENDFILE_CHUNK;
+                if (sock_sendv(msgsock, iov, 2, 0))
+                    sent = iov[1].iov_len;
+                else {
+                    keep_alive = false;
+                    total = 0;
+                }
+                ret.clear();
+            }
+#ifdef WITH_IO_URING
+            if (worker_ring && !res_info->process && !res_info->mem && total != (unsigned long long)-1 && !ret.empty()) {
+                size_t head_sent;
+                if (!uring_sendfile(msgsock, ret, &head_sent, res_info->read, res_info->offset,
+                            total < SENDFILE_CHUNK ? total : SENDFILE_CHUNK, &sent)) {
+                    keep_alive = false;
+                    total = sent;
+                } else if (head_sent < ret.size())
+                    sock_send(msgsock, ret.data() + head_sent, ret.size() - head_sent);
+                ret.clear();
+            }
+#endif
+            if (!ret.empty()) {
+                struct iovec iov[1];
+                iov[0].iov_base = (void*)ret.data();
+                iov[0].iov_len = ret.size();
+                sock_sendv(msgsock, iov, 1,
+                        !res_info->process && total != (unsigned long long)-1 && total > 0 ? MSG_MORE : 0);
+            }
+            if (total != (unsigned long long)-1 && sent < total) {
+#ifndef _WIN32
+                unsigned long long pos = res_info->offset + sent;
+                int r = TRANSFER_ERROR;
+                if (res_info->mem)
+                    r = transfer_mem(pHttpdInfo, res_info->mem, &pos, res_info->offset + total, true);
+#if defined LINUX_SENDFILE_API
+                else if (!res_info->process)
+                    r = transfer_file(pHttpdInfo, res_info->read, &pos, res_info->offset + total, true);
+#elif defined FREEBSD_SENDFILE_API
+                else if (sendfile(res_info->read, msgsock, (off_t)res_info->offset, total, NULL, NULL, 0) == 0) {
+                    pos = res_info->offset + total;
+                    r = TRANSFER_DONE;
+                }
+#endif
+                sent = pos - res_info->offset;
+#ifdef HAVE_SYS_EPOLL_H
+                if (r == TRANSFER_AGAIN) {
+                    Transfer *transfer = new Transfer;
+                    transfer->fd = res_info->read;
+                    transfer->cache = res_info->cache;
+                    transfer->mem = res_info->mem;
+                    transfer->offset = pos;
+                    transfer->end = res_info->offset + total;
+                    transfer->keep_alive = keep_alive;
+                    res_info->read = 0;
+                    res_info->cache = NULL;
+                    res_info->mem = NULL;
+                    res_close(res_info);
+                    pHttpdInfo->transfer = transfer;
+                    if (conn_park(pHttpdInfo, TIMER_SEND))
+                        return;
+                    transfer_close(pHttpdInfo);
+                    goto request_end;
+                }
+#endif
+                if (r == TRANSFER_ERROR && sent > 0)
+                    keep_alive = false;
+#else
+                if (!res_info->process && lpfnTransmitFile && lpfnTransmitFile(
+                            msgsock,
+                            res_info->read,
+                            total,
+                            0,
+                            NULL,
+                            NULL,
+                            TF_WRITE_BEHIND)) sent = total;
+#endif
+            }
+            if (sent == 0 && total != 0) {
+                if (VERBOSE(1)) printf("* transfer file using default function\n");
+                unsigned int fd = (unsigned int) msgsock;
+                fd_set fdset;
+                FD_ZERO(&fdset);
+                struct timeval tv;
+                tv.tv_sec = 0;
+                tv.tv_usec = 0;
+                bool unflushed = false, failed = false;
+                if (res_info->write && conn_buffered(pHttpdInfo) > 0) {
+                    // an upgraded connection may already have sent data.
+                    int read = conn_read(pHttpdInfo, buf, sizeof(buf));
+                    res_write(res_info, buf, read);
+                }
+                while(total != 0) {
+                    if (res_info->write) {
+                        FD_SET(fd, &fdset);
+                        int r = select(FD_SETSIZE, &fdset, NULL, NULL, &tv);
+                        if (r < 0) break;
+                        if (r > 0 && FD_ISSET(msgsock, &fdset)) {
+                            memset(buf, 0, sizeof(buf));
+                            int read = recv(msgsock, buf, sizeof(buf), 0);
+                            if (read > 0) {
+                                res_write(res_info, buf, read);
+                            }
+                        }
+                    }
+                    memset(buf, 0, sizeof(buf));
+                    long long res = res_read(res_info, buf, sizeof(buf));
+                    if (res < 0) break;
+                    if (res > 0) {
+                        if (VERBOSE(3))
+#ifdef _WIN32
+                            printf("  reading part %I64d bytes\n", res);
+#else
+                        printf("  reading part %lld bytes\n", res);
+#endif
+                        if (encoder) {
+                            coded.clear();
+                            failed = !encoder_write(encoder, buf, (size_t)res, ENCODE_MORE, coded)
+                                || (!coded.empty() && !sock_send_chunk(msgsock, coded, chunked));
+                            if (failed)
+                                break;
+                            unflushed = true;
+                        } else
+                            sock_send(msgsock, buf, (size_t)res);
+                        if (total > 0) {
+                            total -= res;
+                        }
+                    } else {
+                        if (unflushed) {
+                            // the cgi is quiet; what it wrote so far goes
+                            // out now, not with the next full block.
+                            coded.clear();
+                            failed = !encoder_write(encoder, NULL, 0, ENCODE_FLUSH, coded)
+                                || (!coded.empty() && !sock_send_chunk(msgsock, coded, chunked));
+                            if (failed)
+                                break;
+                            unflushed = false;
+                        }
+#ifdef _WIN32
+                        Sleep(1);
+#else
+                        usleep(10);
+#endif
+                    }
+                }
+                if (encoder) {
+                    // a body cut short must not look complete.
+                    coded.clear();
+                    if (failed || !encoder_write(encoder, NULL, 0, ENCODE_FINISH, coded)
+                            || (!coded.empty() && !sock_send_chunk(msgsock, coded, chunked))
+                            || (chunked && !sock_send_chunk(msgsock, std::string(), true)))
+                        keep_alive = false;
+                }
+            }
+            res_close(res_info);
+            res_info = NULL;
+        } else if (listing) {
+            // rows go out in chunks as they are formatted, compressed on
+            // the way when the client takes it. the page is kept whole
+            // only while it may still fit the listing cache.
+            ret += keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+            ret += "Content-Type: ";
+            ret += res_type + "\r\n";
+            if (httpd->compress) {
+                int coding = accept_coding(&request, encoder_codings());
+                encoder = coding >= 0 ? encoder_begin(httpd, coding) : NULL;
+                if (encoder) {
+                    ret += "Content-Encoding: ";
+                    ret += content_codings[coding].name;
+                    ret += "\r\n";
+                }
+                ret += "Vary: Accept-Encoding\r\n";
+            }
+            ret += "Transfer-Encoding: chunked\r\n\r\n";
+            ret.insert(0, pending);
+            pending.clear();
+#ifndef _WIN32
+            size_t keep = httpd->listcache ? (size_t)httpd->listcache->max_file : 0;
+#else
+            size_t keep = 0;
+#endif
+            bool whole = true, failed = !sock_send(msgsock, ret.data(), ret.size());
+            size_t at = 0;
+            std::vector<server::ListInfo>::iterator it = flist.begin();
+            while (!failed) {
+                bool last = it == flist.end();
+                if (last)
+                    res_body += list_tail;
+                else {
+                    list_row(res_body, *it++);
+                    if (res_body.size() - at < LIST_CHUNK)
+                        continue;
+                }
+                coded.clear();
+                if (encoder)
+                    failed = !encoder_write(encoder, res_body.data() + at, res_body.size() - at,
+                            last ? ENCODE_FINISH : ENCODE_MORE, coded);
+                else
+                    coded.assign(res_body, at, std::string::npos);
+                failed = failed || (!coded.empty() && !sock_send_chunk(msgsock, coded, true));
+                if (whole && res_body.size() <= keep)
+                    at = res_body.size();
+                else {
+                    whole = false;
+                    res_body.clear();
+                    at = 0;
+                }
+                if (last)
+                    break;
+            }
+            if (failed || !sock_send_chunk(msgsock, std::string(), true))
+                keep_alive = false;
+#ifndef _WIN32
+            else if (whole)
+                list_cache_insert(httpd, list_path, list_st, list_tag, res_body);
+#endif
+            flist.clear();
+        } else {
+            if (!res_body.empty()) {
+                if (keep_alive)
+                    ret += "Connection: keep-alive\r\n";
+                else
+                    ret += "Connection: close\r\n";
+
+                ret += "Content-Type: ";
+                ret += res_type + "\r\n";
+
+                if (httpd->compress && res_code == "200" && (list_page || res_body.size() >= COMPRESS_MIN)
+                        && compressible_type(res_type)) {
+                    // a generated page, such as a listing, whole. a listing
+                    // is compressed whatever its size, as its ETag says.
+                    int coding = accept_coding(&request, encoder_codings());
+                    encoder = coding >= 0 ? encoder_begin(httpd, coding) : NULL;
+                    coded.clear();
+                    if (encoder && encoder_write(encoder, res_body.data(), res_body.size(), ENCODE_FINISH, coded)) {
+                        res_body.swap(coded);
+                        ret += "Content-Encoding: ";
+                        ret += content_codings[coding].name;
+                        ret += "\r\n";
+                    }
+                    ret += "Vary: Accept-Encoding\r\n";
+                }
+
+                sprintf(length, "%lu", (unsigned long)res_body.size());
+                ret += "Content-Length: ";
+                ret += length;
+                ret += "\r\n";
+            }
+            ret += "\r\n";
+            size_t body_size = 0;
+            if (vparam.empty() || vparam[0] != "HEAD")
+                body_size = res_body.size();
+            if (keep_alive && conn_buffered(pHttpdInfo) > 0
+                    && pending.size() + ret.size() + body_size <= PIPELINE_BATCH) {
+                pending += ret;
+                pending.append(res_body, 0, body_size);
+            } else {
+                struct iovec iov[3];
+                iov[0].iov_base = (void*)pending.data();
+                iov[0].iov_len = pending.size();
+                iov[1].iov_base = (void*)ret.data();
+                iov[1].iov_len = ret.size();
+                iov[2].iov_base = (void*)res_body.data();
+                iov[2].iov_len = body_size;
+                sock_sendv(msgsock, iov, 3, 0);
+                pending.clear();
+            }
+        }
+
+request_next:
+        if (keep_alive) {
+#ifdef HAVE_SYS_EPOLL_H
+            if (pHttpdInfo->acceptor->epfd >= 0 && conn_buffered(pHttpdInfo) == 0) {
+                // idle keep-alive connections wait on the event loop, not
+                // on this thread, and hold no read buffer.
+                conn_free_buffer(pHttpdInfo);
+                if (conn_park(pHttpdInfo, TIMER_IDLE))
+                    return;
+                goto request_end;
+            }
+#endif
+            served++;
+            goto request_top;
+        }
+
+request_end:
+        flush_pending(msgsock, pending);
+        if (lingering) {
+            // the rest of the request is still unread; closing now would
+            // reset the connection before the client saw the response.
+            shutdown(msgsock, SD_SEND);
+            for (int drained = 0; drained < 1024 * 1024; ) {
+                if (!sock_wait(msgsock, false, 2000))
+                    break;
+                int r = recv(msgsock, buf, sizeof(buf), 0);
+                if (r <= 0)
+                    break;
+                drained += r;
+            }
+        }
+        conn_release(pHttpdInfo);
+        shutdown(msgsock, SD_BOTH);
+        closesocket(msgsock);
+        conn_free_buffer(pHttpdInfo);
+        delete pHttpdInfo;
+    }
 
-                            env = "SERVER_NAME=";
-                            if (httpd->hostname.size()) {
-                                env += httpd->hostname;
-                            } else {
-                                env += http_headers["HTTP_HOST"];
-                            }
-                            envs.push_back(env);
+    void* response_thread(void* param) {
+        response_handle((server::HttpdInfo*)param);
+#if defined(_WIN32) && !defined(USE_PTHREAD)
+        _endthread();
+#else
+        pthread_exit(NULL);
+#endif
 
-                            sprintf(buf, "SERVER_PORT=%s", httpd->port.c_str());
-                            env = buf;
-                            envs.push_back(env);
+        return NULL;
+    }
 
-                            env = "REMOTE_ADDR=";
-                            env += address;
-                            envs.push_back(env);
+    static server::HttpdInfo* client_info(server::Acceptor* acceptor, int msgsock, int servno) {
+        server::HttpdInfo *pHttpdInfo = new server::HttpdInfo;
+        pHttpdInfo->msgsock = msgsock;
+        pHttpdInfo->httpd = acceptor->httpd;
+        pHttpdInfo->acceptor = acceptor;
+        pHttpdInfo->peer_len = 0;
+        pHttpdInfo->rbuf = NULL;
+        pHttpdInfo->rpos = pHttpdInfo->rlen = 0;
+        pHttpdInfo->rbuf_id = -1;
+        pHttpdInfo->servno = servno;
+        pHttpdInfo->transfer = NULL;
+        pHttpdInfo->timer_prev = pHttpdInfo->timer_next = NULL;
+        pHttpdInfo->idle_prev = pHttpdInfo->idle_next = NULL;
+        pHttpdInfo->timer_slot = -1;
+        pHttpdInfo->timer_kind = TIMER_NONE;
+        pHttpdInfo->expires = pHttpdInfo->deadline = 0;
+        pHttpdInfo->parked = false;
+        return pHttpdInfo;
+    }
 
-                            sprintf(buf, "REMOTE_PORT=%s", port.c_str());
-                            env = buf;
-                            envs.push_back(env);
+    static server::HttpdInfo* accept_client(server::Acceptor* acceptor, int sock, int servno) {
+        server *httpd = acceptor->httpd;
+        struct sockaddr_storage client;
+        socklen_t client_len = sizeof(client);
+#ifdef _WIN32
+        char on;
+#else
+        int on;
+#endif
+        struct timeval timeout;
 
-                            if (vauth.size() && !vauth[0].empty()) {
-                                env = "REMOTE_USER=";
-                                env += vauth[0];
-                                envs.push_back(env);
-                            }
+#ifdef HAVE_ACCEPT4
+        int flags = SOCK_CLOEXEC;
+        if (acceptor->epfd >= 0)
+            flags |= SOCK_NONBLOCK;
+        int msgsock = accept4(sock, (struct sockaddr *)&client, &client_len, flags);
+#else
+        int msgsock = accept(sock, (struct sockaddr *)&client, &client_len);
+#endif
+        if (VERBOSE(3)) printf("* accepted socket %d\n", msgsock);
+        if (msgsock == -1) {
+            if (errno != EINTR && errno != EWOULDBLOCK && errno != EAGAIN)
+                if (VERBOSE(1)) my_perror("accept");
+            return NULL;
+        }
 
-                            server::HttpHeader::const_iterator it_head;
-                            for (it_head = http_headers.begin(); it_head != http_headers.end(); it_head++) {
-                                env = "HTTP_";
-                                env += it_head->first;
-                                env += "=";
-                                env += it_head->second;
-                                envs.push_back(env);
-                            }
+        server::HttpdInfo *pHttpdInfo = client_info(acceptor, msgsock, servno);
+        memcpy(&pHttpdInfo->peer, &client, client_len);
+        pHttpdInfo->peer_len = client_len;
+
+#ifdef __linux__
+        // TCP_NODELAY and the timeouts are inherited from the listener.
+        (void)on;
+        (void)timeout;
+#ifndef HAVE_ACCEPT4
+        if (acceptor->epfd >= 0)
+            fcntl(msgsock, F_SETFL, fcntl(msgsock, F_GETFL, 0) | O_NONBLOCK);
+        fcntl(msgsock, F_SETFD, FD_CLOEXEC);
+#endif
+#else
+        on = 1;
+        if (setsockopt(msgsock, IPPROTO_TCP, TCP_NODELAY,
+                    &on, sizeof(on)) == -1)
+            fprintf(stderr, "setsockopt TCP_NODELAY: %s\n", strerror(errno));
+#ifndef _WIN32
+        // BSD hands out the listener's O_NONBLOCK with the socket.
+        fcntl(msgsock, F_SETFL, fcntl(msgsock, F_GETFL, 0) & ~O_NONBLOCK);
+#endif
 
-                            env = "REQUEST_METHOD=";
-                            env += vparam[0];
-                            envs.push_back(env);
+#ifdef HAVE_SYS_EPOLL_H
+        if (acceptor->epfd >= 0) {
+            // the event loop owns the socket; blocking is done by sock_wait.
+#ifndef HAVE_ACCEPT4
+            fcntl(msgsock, F_SETFL, fcntl(msgsock, F_GETFL, 0) | O_NONBLOCK);
+#endif
+            return pHttpdInfo;
+        }
+#endif
+        timeout.tv_sec = SEND_TIMEOUT / 1000;
+        timeout.tv_usec = 0;
+        if (setsockopt(msgsock, SOL_SOCKET, SO_SNDTIMEO,
+                    (char*)&timeout, sizeof(timeout)) == -1)
+            fprintf(stderr, "setsockopt SO_SNDTIMEO: %s\n", strerror(errno));
+        if (acceptor->pool && !acceptor->timers) {
+            // a pooled worker must not be held forever by an idle client.
+            timeout.tv_sec = RECV_TIMEOUT / 1000;
+            if (setsockopt(msgsock, SOL_SOCKET, SO_RCVTIMEO,
+                        (char*)&timeout, sizeof(timeout)) == -1)
+                fprintf(stderr, "setsockopt SO_RCVTIMEO: %s\n", strerror(errno));
+        }
+#endif
+        return pHttpdInfo;
+    }
 
-                            env = "REQUEST_URI=";
-                            env += request_uri;
-                            envs.push_back(env);
+#ifndef _WIN32
+    // bounded lock-free MPMC queue of connections ready to be served
+    // (Dmitry Vyukov's algorithm). the semaphore counts published cells so
+    // idle workers sleep instead of spinning.
+    typedef struct {
+        volatile unsigned long seq;
+        server::HttpdInfo* info;
+        unsigned long long queued_at;
+    } QUEUE_CELL;
+
+    struct WorkerPool {
+        server* httpd;
+        QUEUE_CELL* cells;
+        unsigned long mask;
+        char pad0[64];
+        volatile unsigned long head;
+        char pad1[64];
+        volatile unsigned long tail;
+        char pad2[64];
+        sem_t ready;
+        int workers;
+        volatile unsigned long queued;
+        volatile unsigned long rejected;
+        volatile unsigned long max_depth;
+        volatile unsigned long long wait_usec;
+        volatile unsigned long long max_wait_usec;
+    };
+
+    static unsigned long long now_usec() {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+    }
 
-                            env = "SCRIPT_FILENAME=";
-                            env += path;
-                            envs.push_back(env);
+    static bool pool_push(WorkerPool* pool, server::HttpdInfo* info) {
+        QUEUE_CELL* cell;
+        unsigned long pos = pool->head;
+        for (;;) {
+            cell = &pool->cells[pos & pool->mask];
+            unsigned long seq = cell->seq;
+            __sync_synchronize();
+            long dif = (long)seq - (long)pos;
+            if (dif == 0) {
+                if (__sync_bool_compare_and_swap(&pool->head, pos, pos + 1))
+                    break;
+            } else if (dif < 0)
+                return false;
+            pos = pool->head;
+        }
+        cell->info = info;
+        cell->queued_at = now_usec();
+        __sync_synchronize();
+        cell->seq = pos + 1;
+        sem_post(&pool->ready);
+
+        unsigned long depth = pos + 1 - pool->tail;
+        unsigned long max_depth = pool->max_depth;
+        while (depth > max_depth && (long)depth > 0
+                && !__sync_bool_compare_and_swap(&pool->max_depth, max_depth, depth))
+            max_depth = pool->max_depth;
+        __sync_fetch_and_add(&pool->queued, 1);
+        return true;
+    }
 
-                            env = "SCRIPT_NAME=";
-                            env += script_name;
-                            envs.push_back(env);
+    static server::HttpdInfo* pool_pop(WorkerPool* pool, unsigned long long* queued_at) {
+        QUEUE_CELL* cell;
+        unsigned long pos = pool->tail;
+        for (;;) {
+            cell = &pool->cells[pos & pool->mask];
+            unsigned long seq = cell->seq;
+            __sync_synchronize();
+            long dif = (long)seq - (long)(pos + 1);
+            if (dif == 0) {
+                if (__sync_bool_compare_and_swap(&pool->tail, pos, pos + 1))
+                    break;
+            } else if (dif < 0)
+                return NULL;
+            pos = pool->tail;
+        }
+        server::HttpdInfo* info = cell->info;
+        *queued_at = cell->queued_at;
+        __sync_synchronize();
+        cell->seq = pos + pool->mask + 1;
+        return info;
+    }
 
-                            env = "QUERY_STRING=";
-                            env += query_string;
-                            envs.push_back(env);
+    static void* pool_worker(void* param) {
+        WorkerPool* pool = (WorkerPool*)param;
+#ifdef WITH_IO_URING
+        if (pool->httpd->io_uring)
+            uring_worker_init(pool->httpd);
+#endif
+        for (;;) {
+            if (sem_wait(&pool->ready) != 0)
+                continue;
+            unsigned long long queued_at;
+            server::HttpdInfo* info;
+            // a cell counted by the semaphore may still be in the middle
+            // of being published by another producer.
+            while (!(info = pool_pop(pool, &queued_at)))
+                sched_yield();
+            unsigned long long wait = now_usec() - queued_at;
+            __sync_fetch_and_add(&pool->wait_usec, wait);
+            unsigned long long max_wait = pool->max_wait_usec;
+            while (wait > max_wait
+                    && !__sync_bool_compare_and_swap(&pool->max_wait_usec, max_wait, wait))
+                max_wait = pool->max_wait_usec;
+            response_handle(info);
+        }
+        return NULL;
+    }
 
-                            if (!path_info.empty()) {
-                                env = "PATH_INFO=";
-                                env += path_info;
-                                envs.push_back(env);
-                            } else {
-                                env = "PATH_INFO=";
-                                env += request_uri;
-                                envs.push_back(env);
-                            }
+    static WorkerPool* pool_create(server::Acceptor* acceptor, int workers, int queue_depth) {
+        server *httpd = acceptor->httpd;
+        unsigned long size = 1;
+        while (size < (unsigned long)queue_depth)
+            size <<= 1;
+
+        WorkerPool* pool = new WorkerPool;
+        memset(pool, 0, sizeof(WorkerPool));
+        pool->httpd = httpd;
+        pool->cells = new QUEUE_CELL[size];
+        pool->mask = size - 1;
+        for (unsigned long n = 0; n < size; n++)
+            pool->cells[n].seq = n;
+        sem_init(&pool->ready, 0, 0);
+
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+#ifdef __linux__
+        if (acceptor->cpu >= 0) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(acceptor->cpu, &cpus);
+            pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+        }
+#endif
+        for (int n = 0; n < workers; n++) {
+            pthread_t pth;
+            if (pthread_create(&pth, &attr, pool_worker, (void*)pool) != 0) {
+                my_perror("pthread_create");
+                break;
+            }
+            pool->workers++;
+        }
+        pthread_attr_destroy(&attr);
+        if (pool->workers == 0) {
+            sem_destroy(&pool->ready);
+            delete[] pool->cells;
+            delete pool;
+            return NULL;
+        }
+        if (VERBOSE(1))
+            printf("* %d workers, queue depth %lu, cpu %d\n", pool->workers, size, acceptor->cpu);
+        return pool;
+    }
 
-                            env = "REDIRECT_STATUS=1";
-                            envs.push_back(env);
+    static void pool_stats(WorkerPool* pool) {
+        unsigned long served = pool->queued;
+        printf("* workers: %d, queued: %lu, rejected: %lu, max depth: %lu/%lu, "
+                "avg wait: %llu usec, max wait: %llu usec\n",
+                pool->workers, served, pool->rejected,
+                pool->max_depth, pool->mask + 1,
+                served ? pool->wait_usec / served : 0,
+                pool->max_wait_usec);
+    }
 
-                            env = "PATH=";
-                            env += getenv("PATH");
-                            envs.push_back(env);
+    static void reject_response(server::HttpdInfo* pHttpdInfo) {
+        static const char busy[] =
+            "HTTP/1.1 503 Service Unavailable\r\n"
+            "Connection: close\r\n"
+            "Content-Type: text/plain\r\n"
+            "Content-Length: 20\r\n"
+            "\r\n"
+            "Service Unavailable\n";
+        send(pHttpdInfo->msgsock, busy, sizeof(busy) - 1, 0);
+        conn_release(pHttpdInfo);
+        shutdown(pHttpdInfo->msgsock, SD_BOTH);
+        closesocket(pHttpdInfo->msgsock);
+        // a parked keep-alive connection may hold buffered input, and a
+        // parked download its file.
+        transfer_close(pHttpdInfo);
+        free(pHttpdInfo->rbuf);
+        delete pHttpdInfo;
+    }
+#endif
 
-#ifdef _WIN32
-                            GetWindowsDirectoryA(buf, sizeof(buf));
-                            env = "SystemRoot=";
-                            env += buf;
-                            envs.push_back(env);
+    static void dispatch_response(server::HttpdInfo* pHttpdInfo) {
+        server *httpd = pHttpdInfo->httpd;
+#ifndef _WIN32
+        WorkerPool *pool = pHttpdInfo->acceptor->pool;
+        if (pool) {
+            if (!pool_push(pool, pHttpdInfo)) {
+                unsigned long rejected = __sync_add_and_fetch(&pool->rejected, 1);
+                if (VERBOSE(1)) {
+                    printf("* worker queue full, rejecting socket %d (%lu rejected)\n",
+                            pHttpdInfo->msgsock, rejected);
+                    pool_stats(pool);
+                }
+                reject_response(pHttpdInfo);
+            }
+            return;
+        }
 #endif
+#if defined(_WIN32) && !defined(USE_PTHREAD)
+        uintptr_t th;
+        while ((int)(th = _beginthread((void (*)(void*))response_thread, 0, (void*)pHttpdInfo)) == -1) {
+            Sleep(1);
+        }
+#else
+        pthread_t pth;
+        while (pthread_create(&pth, NULL, response_thread, (void*)pHttpdInfo) != 0) {
+            usleep(100);
+        }
+        pthread_detach(pth);
+#endif
+    }
 
-                            char* p = getenv("PERL5LIB");
-                            if (p) {
-                                env = "PERL5LIB=";
-                                env += p;
-                                envs.push_back(env);
-                            }
+#ifdef HAVE_SYS_EPOLL_H
+    // edge-triggered reactor: connections are registered one-shot, so an
+    // idle keep-alive connection costs only its HttpdInfo. a worker is
+    // handed the connection when a request becomes readable, and
+    // response_handle re-arms it once the response has been sent.
+    static bool event_loop(server::Acceptor* acceptor) {
+        server *httpd = acceptor->httpd;
+        struct epoll_event ev, events[64];
+        int nserver = (int)acceptor->socks.size();
+        int fds, nfds, n;
+        sigset_t sigmask;
+
+        acceptor->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (acceptor->epfd < 0) {
+            my_perror("epoll_create");
+            return false;
+        }
+        for(fds = 0; fds < nserver; fds++) {
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLIN;
+            // listeners are tagged by index, connections by HttpdInfo.
+            ev.data.u64 = fds;
+            if (epoll_ctl(acceptor->epfd, EPOLL_CTL_ADD, acceptor->socks[fds], &ev) == -1) {
+                my_perror("epoll_ctl");
+                close(acceptor->epfd);
+                acceptor->epfd = -1;
+                return false;
+            }
+        }
 
-                            env = "SERVER_SOFTWARE=tinytinyhttpd";
-                            envs.push_back(env);
+        // only server::stop() may interrupt epoll_wait, not exiting cgi.
+        sigemptyset(&sigmask);
+        sigaddset(&sigmask, SIGCHLD);
+        pthread_sigmask(SIG_BLOCK, &sigmask, NULL);
 
-                            env = "SERVER_PROTOCOL=HTTP/1.1";
-                            envs.push_back(env);
+        if (VERBOSE(1)) printf("* using epoll event loop\n");
 
-                            env = "GATEWAY_INTERFACE=CGI/1.1";
-                            envs.push_back(env);
+        for(;;) {
+            nfds = epoll_wait(acceptor->epfd, events, sizeof(events)/sizeof(events[0]), WHEEL_TICK);
+            if (nfds == -1) {
+                if (errno == EBADF || errno == EINTR)
+                    break;
+                my_perror("epoll_wait");
+                continue;
+            }
+            for(n = 0; n < nfds; n++) {
+                if (events[n].data.u64 < (unsigned int)nserver) {
+                    fds = (int)events[n].data.u64;
+                    // drain the backlog; the listener is level-triggered, so
+                    // whatever is left over after a batch is reported again.
+                    for (int batch = 0; batch < ACCEPT_BATCH; batch++) {
+                        server::HttpdInfo *pHttpdInfo = accept_client(acceptor, acceptor->socks[fds], fds);
+                        if (!pHttpdInfo)
+                            break;
+                        if (!conn_admit(pHttpdInfo, true)) {
+                            closesocket(pHttpdInfo->msgsock);
+                            delete pHttpdInfo;
+                            continue;
+                        }
+                        memset(&ev, 0, sizeof(ev));
+                        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+                        ev.data.ptr = pHttpdInfo;
+                        if (epoll_ctl(acceptor->epfd, EPOLL_CTL_ADD, pHttpdInfo->msgsock, &ev) == -1) {
+                            my_perror("epoll_ctl");
+                            conn_release(pHttpdInfo);
+                            closesocket(pHttpdInfo->msgsock);
+                            delete pHttpdInfo;
+                        }
+                    }
+                } else if (conn_wake((server::HttpdInfo*)events[n].data.ptr))
+                    dispatch_response((server::HttpdInfo*)events[n].data.ptr);
+            }
+            wheel_reap(acceptor->timers);
+            wheel_advance(acceptor->timers);
+            clock_tick();
+            fd_cache_poll(acceptor->httpd->fdcache);
+            path_cache_poll(acceptor->httpd->pathcache);
+        }
 
-                            server::RequestEnvironments::iterator it_env;
-                            for(it_env = httpd->request_environments.begin(); it_env != httpd->request_environments.end(); it_env++) {
-                                env = it_env->first + "=";
-                                env += it_env->second;
-                                envs.push_back(env);
-                            }
+        close(acceptor->epfd);
+        acceptor->epfd = -1;
+        return true;
+    }
+#endif
 
-                            if (vparam[0] == "POST") {
-                                env = "CONTENT_TYPE=";
-                                env += http_headers["CONTENT_TYPE"];
-                                envs.push_back(env);
+#ifdef WITH_IO_URING
+    static bool uring_arm_accept(URING* ring, server::Acceptor* acceptor, int fds) {
+        struct io_uring_sqe *sqe = uring_get_sqe(ring);
+        if (!sqe)
+            return false;
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = acceptor->socks[fds];
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe->user_data = fds;
+        return true;
+    }
 
-                                sprintf(buf, "%d", (int)content_length);
-                                env = "CONTENT_LENGTH=";
-                                env += buf;
-                                envs.push_back(env);
-                            }
+    // wakes the ring every WHEEL_TICK to advance the timer wheel.
+    static bool uring_arm_timeout(URING* ring, server::Acceptor* acceptor, struct __kernel_timespec* ts) {
+        struct io_uring_sqe *sqe = uring_get_sqe(ring);
+        if (!sqe)
+            return false;
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->fd = -1;
+        sqe->addr = (unsigned long)ts;
+        sqe->len = 1;
+        sqe->user_data = acceptor->socks.size() + 1;
+        return true;
+    }
 
-                            if (VERBOSE(4)) {
-                                std::vector<std::string>::iterator it;
-                                printf("  --- ARGS ---\n");
-                                for(it = args.begin(); it != args.end(); it++)
-                                    printf("  %s\n", it->c_str());
-                                printf("  --- ENVS ---\n");
-                                for(it = envs.begin(); it != envs.end(); it++)
-                                    printf("  %s\n", it->c_str());
-                                printf("  ------------\n");
-                            }
+    static bool uring_arm_poll(URING* ring, server::Acceptor* acceptor) {
+        struct io_uring_sqe *sqe = uring_get_sqe(ring);
+        if (!sqe)
+            return false;
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = acceptor->epfd;
+        sqe->poll32_events = POLLIN;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->user_data = acceptor->socks.size();
+        return true;
+    }
 
-                            res_info = res_popen(args, envs);
+    // the same reactor on top of io_uring: each listener has one multishot
+    // accept, so new connections arrive as completions without an accept
+    // call apiece. connections still live in the epoll set (workers re-arm
+    // them there), and the epoll fd itself is watched by a multishot poll.
+    static bool uring_loop(server::Acceptor* acceptor) {
+        server *httpd = acceptor->httpd;
+        struct epoll_event ev, events[64];
+        struct io_uring_cqe *cqe;
+        unsigned int nserver = acceptor->socks.size();
+        unsigned int fds;
+        int nfds, n, r;
+        sigset_t sigmask;
+        struct __kernel_timespec tick;
+        URING ring;
+
+        if (!uring_init(&ring, URING_ENTRIES)) {
+            if (VERBOSE(1)) printf("* io_uring unavailable: %s\n", strerror(errno));
+            return false;
+        }
+        if (nserver + 2 > ring.entries || !uring_probe(&ring, IORING_OP_ACCEPT)
+                || !uring_probe(&ring, IORING_OP_POLL_ADD) || !uring_probe(&ring, IORING_OP_TIMEOUT)) {
+            uring_exit(&ring);
+            return false;
+        }
+        acceptor->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (acceptor->epfd < 0) {
+            my_perror("epoll_create");
+            uring_exit(&ring);
+            return false;
+        }
+        for(fds = 0; fds < nserver; fds++)
+            uring_arm_accept(&ring, acceptor, fds);
+        uring_arm_poll(&ring, acceptor);
+        tick.tv_sec = 0;
+        tick.tv_nsec = WHEEL_TICK * 1000000LL;
+        uring_arm_timeout(&ring, acceptor, &tick);
+        r = uring_submit(&ring, 0);
+
+        // multishot accept needs linux 5.19; older kernels fail it at once.
+        cqe = uring_peek_cqe(&ring);
+        if (r < 0 || (cqe && cqe->res == -EINVAL)) {
+            if (VERBOSE(1)) printf("* io_uring lacks multishot accept\n");
+            close(acceptor->epfd);
+            acceptor->epfd = -1;
+            uring_exit(&ring);
+            return false;
+        }
 
-                            if (res_info && content_length > 0) {
-                                while (content_length) {
-                                    memset(buf, 0, sizeof(buf));
-                                    unsigned long read = recv(msgsock, buf, sizeof(buf), 0);
-                                    if (read <= 0) break;
-                                    int w = res_write(res_info, buf, read);
-                                    content_length -= w;
-                                }
+        sigemptyset(&sigmask);
+        sigaddset(&sigmask, SIGCHLD);
+        pthread_sigmask(SIG_BLOCK, &sigmask, NULL);
 
-                                if (stricmp(http_headers["CONNECTION"].c_str(), "upgrade"))
-                                    res_closewriter(res_info);
-                                if (content_length) {
-                                    res_type = "text/plain";
-                                    res_code = "500";
-                                    res_msg = "Bad Request";
-                                    res_body = "Bad Request\n";
-                                    goto request_done;
-                                }
-                            } else {
-                                if (stricmp(http_headers["CONNECTION"].c_str(), "upgrade"))
-                                    res_closewriter(res_info);
-                            }
+        if (VERBOSE(1)) printf("* using io_uring event loop\n");
+
+        for(;;) {
+            while ((cqe = uring_peek_cqe(&ring)) != NULL) {
+                unsigned long long tag = cqe->user_data;
+                bool more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+                int res = cqe->res;
+                uring_cqe_seen(&ring);
+
+                if (tag < nserver) {
+                    fds = (unsigned int)tag;
+                    if (res >= 0) {
+                        if (VERBOSE(3)) printf("* accepted socket %d\n", res);
+                        server::HttpdInfo *pHttpdInfo = client_info(acceptor, res, fds);
+                        memset(&ev, 0, sizeof(ev));
+                        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+                        ev.data.ptr = pHttpdInfo;
+                        if (!conn_admit(pHttpdInfo, true)) {
+                            closesocket(res);
+                            delete pHttpdInfo;
+                        } else if (epoll_ctl(acceptor->epfd, EPOLL_CTL_ADD, res, &ev) == -1) {
+                            my_perror("epoll_ctl");
+                            conn_release(pHttpdInfo);
+                            closesocket(res);
+                            delete pHttpdInfo;
                         }
-                    } else {
-                        res_type = "text/plain";
-                        res_code = "500";
-                        res_msg = "Bad Request";
-                        res_body = "Bad Request\n";
-                        goto request_done;
+                    } else if (res != -EINTR && res != -EAGAIN && VERBOSE(1))
+                        fprintf(stderr, "accept: %s\n", strerror(-res));
+                    // the listener was closed by server::stop().
+                    if (!more && res != -EBADF && res != -EINVAL)
+                        uring_arm_accept(&ring, acceptor, fds);
+                } else if (tag == nserver + 1) {
+                    uring_arm_timeout(&ring, acceptor, &tick);
+                } else {
+                    nfds = epoll_wait(acceptor->epfd, events, sizeof(events)/sizeof(events[0]), 0);
+                    for(n = 0; n < nfds; n++) {
+                        if (conn_wake((server::HttpdInfo*)events[n].data.ptr))
+                            dispatch_response((server::HttpdInfo*)events[n].data.ptr);
                     }
+                    if (!more)
+                        uring_arm_poll(&ring, acceptor);
                 }
-        }
-        catch(...) {
-            if (res_code.size() == 0) {
-                if (VERBOSE(1)) my_perror(" cached exception");
-                res_type = "text/plain";
-                res_code = "500";
-                res_msg = "Bad Request";
-                res_body = "Internal Server Error\n";
             }
+            wheel_reap(acceptor->timers);
+            wheel_advance(acceptor->timers);
+            clock_tick();
+            fd_cache_poll(acceptor->httpd->fdcache);
+            path_cache_poll(acceptor->httpd->pathcache);
+            r = uring_submit(&ring, 1);
+            if (r == -EINTR || r == -EBADF)
+                break;
+            if (r < 0 && r != -EAGAIN && r != -EBUSY) {
+                fprintf(stderr, "io_uring_enter: %s\n", strerror(-r));
+                break;
+            }
+        }
+
+        uring_exit(&ring);
+        close(acceptor->epfd);
+        acceptor->epfd = -1;
+        return true;
+    }
+#endif
+
+    static void accept_loop(server::Acceptor* acceptor) {
+        server *httpd = acceptor->httpd;
+        int nserver = (int)acceptor->socks.size();
+        int fds, nfds;
+
+#ifndef _WIN32
+        if (httpd->workers > 0 && !acceptor->pool) {
+            int nshard = (int)httpd->shards.size();
+            int workers = httpd->workers / nshard;
+            acceptor->pool = pool_create(acceptor,
+                    workers > 0 ? workers : 1, httpd->queue_depth / nshard);
+        }
+        if (!acceptor->timers)
+            acceptor->timers = wheel_create(acceptor);
+#endif
+
+#ifdef WITH_IO_URING
+        if (httpd->event_loop && httpd->io_uring && uring_loop(acceptor))
+            return;
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+        if (httpd->event_loop && event_loop(acceptor))
+            return;
+#endif
+
+#ifdef __linux__
+        // accepted sockets inherit these from the listener.
+        struct timeval timeout;
+        timeout.tv_sec = SEND_TIMEOUT / 1000;
+        timeout.tv_usec = 0;
+        for(fds = 0; fds < nserver; fds++) {
+            if (setsockopt(acceptor->socks[fds], SOL_SOCKET, SO_SNDTIMEO,
+                        (char*)&timeout, sizeof(timeout)) == -1)
+                fprintf(stderr, "setsockopt SO_SNDTIMEO: %s\n", strerror(errno));
         }
-request_done:
+#endif
 
-        if (content_length > 0) {
-            while(content_length > 0) {
-                int ret = recv(msgsock, buf, sizeof(buf), 0);
-                if (ret < 0) {
-                    res_type = "text/plain";
-                    res_code = "500";
-                    res_msg = "Bad Request";
-                    res_body = "Bad Request\n";
-                }
-                content_length -= ret;
-            }
+        unsigned int maxfd = 0;
+        for(fds = 0; fds < nserver; fds++) {
+            if (acceptor->socks[fds] > maxfd)
+                maxfd = acceptor->socks[fds];
         }
+        int fdsetsz = howmany(maxfd + 1, NFDBITS) * sizeof(fd_mask);
+        fd_set *fdset = (fd_set *)malloc(fdsetsz);
 
-        if (res_info && res_info->process) {
-            bool res_keep_alive = false;
-            res_head.clear();
+        while (nserver > 0) {
+            memset(fdset, 0, fdsetsz);
 
-            do {
-                memset(buf, 0, sizeof(buf));
-                str = res_fgets(res_info);
-                if (str.empty()) break;
-                const char *key, *ptr = str.c_str();
-                size_t len;
-                if (str[0] == '<') {
-                    // workaround for broken non-header response.
-                    send(msgsock, ptr, strlen(ptr), 0);
-                    res_code.clear();
+            for(fds = 0; fds < nserver; fds++)
+                FD_SET(acceptor->socks[fds], fdset);
+#ifdef _WIN32
+            nfds = select(maxfd + 1, fdset, NULL, NULL, NULL);
+#else
+            struct timeval tick;
+            tick.tv_sec = 0;
+            tick.tv_usec = WHEEL_TICK * 1000;
+            nfds = select(maxfd + 1, fdset, NULL, NULL, &tick);
+            wheel_advance(acceptor->timers);
+            clock_tick();
+            fd_cache_poll(acceptor->httpd->fdcache);
+            path_cache_poll(acceptor->httpd->pathcache);
+#endif
+            if (nfds == -1) {
+                if (errno == EBADF || errno == EINTR)
                     break;
-                }
-                if (VERBOSE(2)) printf("  %s\n", ptr);
-                if (res_head.empty()) {
-                    if (!strnicmp(ptr, "HTTP/1.", 7)) {
-                        char* tmp1;
-                        char* tmp2;
+                my_perror("select");
+                continue;
+            }
+            for(fds = 0; fds < nserver; fds++) {
+                int sock = acceptor->socks[fds];
 
-                        tmp1 = (char*) strchr(ptr, ' ');
-                        if (tmp1) {
-                            *tmp1 = 0;
-                            res_proto = ptr;
-                            tmp2 = strchr(tmp1 + 1, ' ');
-                            if (tmp2) {
-                                *tmp2 = 0;
-                                res_code = tmp1 + 1;
-                                res_msg = tmp2 + 1;
-                            } else {
-                                res_code = tmp1 + 1;
-                            }
-                        }
+                if (!FD_ISSET(sock, fdset))
+                    continue;
+
+                for (int batch = 0; batch < ACCEPT_BATCH; batch++) {
+                    server::HttpdInfo *pHttpdInfo = accept_client(acceptor, sock, fds);
+                    if (!pHttpdInfo)
+                        break;
+                    if (!conn_admit(pHttpdInfo, false)) {
+                        closesocket(pHttpdInfo->msgsock);
+                        delete pHttpdInfo;
                         continue;
                     }
+                    dispatch_response(pHttpdInfo);
+#ifdef _WIN32
+                    // blocking listener: one accept per wakeup.
+                    break;
+#endif
                 }
-                key = "connection:";
-                len = strlen(key);
-                if (!strnicmp(ptr, key, len)) {
-                    if (!stricmp(trim_string(ptr + len).c_str(), "keep-alive"))
-                        res_keep_alive = true;
-                }
-                key = "WWW-Authenticate: Basic ";
-                len = strlen(key);
-                if (!strnicmp(ptr, key, len)) {
-                    res_code = "401";
-                    res_msg = "Unauthorized";
-                }
-                key = "Status:";
-                len = strlen(key);
-                if (!strnicmp(ptr, key, len)) {
-                    std::vector<std::string> codes;
-                    split_string(trim_string(str.substr(len)), " ", codes);
-                    if (codes.size())
-                        res_code = codes[0];
-                    else
-                        res_code = "";
-                }
-                key = "Content-Length:";
-                len = strlen(key);
-                if (!strnicmp(ptr, key, len)) {
-                    res_info->size = (unsigned long)atol(str.substr(len).c_str());
-                }
-                res_head += ptr;
-                res_head += "\r\n";
-            } while (true);
-            if (!res_keep_alive) {
-                keep_alive = false;
-                res_head += "Connection: close\r\n";
             }
         }
 
-        if (!res_code.empty()) {
-            send(msgsock, res_proto.c_str(), (int)res_proto.size(), 0);
-            send(msgsock, " ", 1, 0);
-            send(msgsock, res_code.c_str(), (int)res_code.size(), 0);
-            send(msgsock, " ", 1, 0);
-            send(msgsock, res_msg.c_str(), (int)res_msg.size(), 0);
-            send(msgsock, "\r\n", 2, 0);
-        }
+        free(fdset);
+    }
 
-        if (!res_head.empty()) {
-            send(msgsock, res_head.c_str(), (int)res_head.size(), 0);
+#ifndef _WIN32
+    static void* acceptor_thread(void* param) {
+        server::Acceptor *acceptor = (server::Acceptor*)param;
+#ifdef __linux__
+        if (acceptor->cpu >= 0) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(acceptor->cpu, &cpus);
+            pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
         }
-
-        if (res_info) {
-            send(msgsock, "\r\n", 2, 0);
-            unsigned long total = res_info->size;
-            int sent = 0;
-            if (total != (unsigned long) -1) {
-#if defined LINUX_SENDFILE_API
-                sent = sendfile(msgsock, res_info->read, NULL, total);
-#elif defined FREEBSD_SENDFILE_API
-                if (sendfile(msgsock, res_info->read, NULL, total, NULL, NULL, 0) == 0) sent = total;
-#elif defined _WIN32
-                if (!res_info->process && lpfnTransmitFile && lpfnTransmitFile(
-                            msgsock,
-                            res_info->read,
-                            total,
-                            0,
-                            NULL,
-                            NULL,
-                            TF_WRITE_BEHIND)) sent = total;
 #endif
-            }
-            if (sent <= 0) {
-                if (VERBOSE(1)) printf("* transfer file using default function\n");
-                unsigned int fd = (unsigned int) msgsock;
-                fd_set fdset;
-                FD_ZERO(&fdset);
-                struct timeval tv;
-                tv.tv_sec = 0;
-                tv.tv_usec = 0;
-                while(total != 0) {
-                    if (res_info->write) {
-                        FD_SET(fd, &fdset);
-                        int r = select(FD_SETSIZE, &fdset, NULL, NULL, &tv);
-                        if (r < 0) break;
-                        if (r > 0 && FD_ISSET(msgsock, &fdset)) {
-                            memset(buf, 0, sizeof(buf));
-                            int read = recv(msgsock, buf, sizeof(buf), 0);
-                            if (read > 0) {
-                                res_write(res_info, buf, read);
-                            }
-                        }
-                    }
-                    memset(buf, 0, sizeof(buf));
-                    long long res = res_read(res_info, buf, sizeof(buf));
-                    if (res < 0) break;
-                    if (res > 0) {
-                        if (VERBOSE(3))
-#ifdef _WIN32
-                            printf("  reading part %I64d bytes\n", res);
-#else
-                        printf("  reading part %lld bytes\n", res);
+        accept_loop(acceptor);
+        return NULL;
+    }
 #endif
-                        send(msgsock, buf, res, 0);
-                        if (total > 0) {
-                            total -= res;
-                        }
-                    } else {
+
+    static int listen_socket(struct addrinfo* res, bool reuseport,
+            const char* ntop, const char* strport) {
 #ifdef _WIN32
-                        Sleep(1);
+        char on;
 #else
-                        usleep(10);
+        int on;
 #endif
-                    }
-                }
-            }
-            res_close(res_info);
-            res_info = NULL;
-        } else
-            if (!res_body.empty()) {
-                if (keep_alive)
-                    ret = "Connection: keep-alive\r\n";
-                else
-                    ret = "Connection: close\r\n";
-                send(msgsock, ret.c_str(), (int)ret.size(), 0);
-
-                ret = "Content-Type: ";
-                ret += res_type + "\r\n";
-                send(msgsock, ret.c_str(), (int)ret.size(), 0);
+        int listen_sock = socket(res->ai_family, res->ai_socktype,
+                res->ai_protocol);
+        if (listen_sock < 0) {
+            fprintf(stderr, "socket: %.100s\n", strerror(errno));
+            return -1;
+        }
 
-                ret = res_body;
-                sprintf(length, "%u", ret.size());
-                ret = "Content-Length: ";
-                ret += length;
-                ret += "\r\n";
-                send(msgsock, ret.c_str(), (int)ret.size(), 0);
+        on = 1;
+        if (setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR,
+                    &on, sizeof(on)) == -1)
+            fprintf(stderr, "setsockopt SO_REUSEADDR: %s\n", strerror(errno));
 
-                send(msgsock, "\r\n", 2, 0);
+#ifdef SO_REUSEPORT
+        on = 1;
+        if (reuseport && setsockopt(listen_sock, SOL_SOCKET, SO_REUSEPORT,
+                    &on, sizeof(on)) == -1)
+            fprintf(stderr, "setsockopt SO_REUSEPORT: %s\n", strerror(errno));
+#endif
 
-                if (vparam.size() > 0 && vparam[0] != "HEAD") {
-                    ret = res_body;
-                    send(msgsock, ret.c_str(), (int)ret.size(), 0);
-                }
-            }
-            else
-                send(msgsock, "\r\n", (int)2, 0);
+        on = 1;
+        if (setsockopt(listen_sock, IPPROTO_TCP, TCP_NODELAY,
+                    &on, sizeof(on)) == -1)
+            fprintf(stderr, "setsockopt TCP_NODELAY: %s\n", strerror(errno));
 
-        if (keep_alive)
-            goto request_top;
+        if (bind(listen_sock, res->ai_addr, res->ai_addrlen) < 0) {
+            fprintf(stderr, "bind to port %s on %s failed: %.200s.\n",
+                    strport, ntop, strerror(errno));
+            close(listen_sock);
+            return -1;
+        }
 
-request_end:
-        shutdown(msgsock, SD_BOTH);
-        closesocket(msgsock);
-        delete pHttpdInfo;
-#if defined(_WIN32) && !defined(USE_PTHREAD)
-        _endthread();
-#else
-        pthread_exit(NULL);
+        if (listen(listen_sock, SOMAXCONN) < 0) {
+            fprintf(stderr, "listen: %.100s\n", strerror(errno));
+            exit(1);
+        }
+#ifndef _WIN32
+        // acceptors drain the backlog until EAGAIN.
+        fcntl(listen_sock, F_SETFL, fcntl(listen_sock, F_GETFL, 0) | O_NONBLOCK);
+        fcntl(listen_sock, F_SETFD, FD_CLOEXEC);
 #endif
-
-        return NULL;
+        return listen_sock;
     }
 
     void* watch_thread(void* param)
     {
         server *httpd = (server*)param;
-        int msgsock;
 
         int numeric_host = 0;
 
@@ -1856,12 +6313,33 @@ request_end:
         struct addrinfo *res, *res0;
         int error;
         const char *hostname;
-#ifdef _WIN32
-        char on;
+        int nshard = 1, n;
+#ifndef _WIN32
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+#if defined(SO_REUSEPORT) && !defined(_WIN32)
+        if (httpd->acceptors > 1)
+            nshard = httpd->acceptors;
 #else
-        int on;
+        if (httpd->acceptors > 1)
+            fprintf(stderr, "SO_REUSEPORT is not supported, using one acceptor\n");
 #endif
-        struct timeval timeout;
+        for (n = 0; n < nshard; n++) {
+            server::Acceptor *acceptor = new server::Acceptor;
+            acceptor->httpd = httpd;
+            acceptor->epfd = -1;
+            acceptor->cpu = -1;
+            acceptor->pool = NULL;
+            acceptor->timers = NULL;
+            acceptor->thread = 0;
+#ifndef _WIN32
+            // with several acceptors each one, and its workers, owns a core.
+            if (nshard > 1 && ncpu > 0)
+                acceptor->cpu = n % ncpu;
+#endif
+            httpd->shards.push_back(acceptor);
+        }
 
         memset(&hints, 0, sizeof(hints));
         hints.ai_family = httpd->family;
@@ -1885,7 +6363,7 @@ request_end:
         res0 = res;
 
         for ( ; res; res = res->ai_next) {
-            int listen_sock;
+            std::vector<int> listen_socks;
             unsigned int salen;
             char ntop[NI_MAXHOST], strport[NI_MAXSERV];
 
@@ -1898,37 +6376,25 @@ request_end:
                 fprintf(stderr, "getnameinfo failed\n");
                 continue;
             }
-            listen_sock = socket(res->ai_family, res->ai_socktype,
-                    res->ai_protocol);
-            if (listen_sock < 0) {
-                fprintf(stderr, "socket: %.100s\n", strerror(errno));
-                continue;
-            }
-
-            on = 1;
-            if (setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR,
-                        &on, sizeof(on)) == -1)
-                fprintf(stderr, "setsockopt SO_REUSEADDR: %s\n", strerror(errno));
 
-            on = 1;
-            if (setsockopt(listen_sock, IPPROTO_TCP, TCP_NODELAY,
-                        &on, sizeof(on)) == -1)
-                fprintf(stderr, "setsockopt TCP_NODELAY: %s\n", strerror(errno));
-
-            if (bind(listen_sock, sa, salen) < 0) {
-                fprintf(stderr, "bind to port %s on %s failed: %.200s.\n",
-                        strport, ntop, strerror(errno));
-                close(listen_sock);
+            // one listen socket per acceptor; the kernel balances
+            // connections between them when SO_REUSEPORT is set.
+            for (n = 0; n < nshard; n++) {
+                int listen_sock = listen_socket(res, nshard > 1, ntop, strport);
+                if (listen_sock < 0)
+                    break;
+                listen_socks.push_back(listen_sock);
+            }
+            if ((int)listen_socks.size() != nshard) {
+                for (n = 0; n < (int)listen_socks.size(); n++)
+                    close(listen_socks[n]);
                 continue;
             }
-
-            if (listen(listen_sock, SOMAXCONN) < 0) {
-                fprintf(stderr, "listen: %.100s\n", strerror(errno));
-                exit(1);
+            for (n = 0; n < nshard; n++) {
+                httpd->socks.push_back(listen_socks[n]);
+                httpd->shards[n]->socks.push_back(listen_socks[n]);
             }
 
-            httpd->socks.push_back(listen_sock);
-
             if (!(numeric_host == 0)) {
                 char address[NI_MAXHOST], port[NI_MAXSERV];
                 if (getnameinfo((struct sockaddr*)sa, sizeof(struct sockaddr_storage), address, sizeof(address), port,
@@ -1949,7 +6415,7 @@ request_end:
                 GUID  guidTransmitFile = WSAID_TRANSMITFILE;
                 DWORD dwBytes = 0;
                 lpfnTransmitFile = NULL;
-                WSAIoctl(listen_sock, SIO_GET_EXTENSION_FUNCTION_POINTER, &guidTransmitFile, sizeof(GUID), &lpfnTransmitFile, sizeof(LPVOID), &dwBytes, NULL, NULL);
+                WSAIoctl(listen_socks[0], SIO_GET_EXTENSION_FUNCTION_POINTER, &guidTransmitFile, sizeof(GUID), &lpfnTransmitFile, sizeof(LPVOID), &dwBytes, NULL, NULL);
                 if (lpfnTransmitFile == NULL)
                     fprintf(stderr, "could not get winsock extension\n");
             }
@@ -1958,94 +6424,46 @@ request_end:
 
         freeaddrinfo(res0);
 
-        int nserver = (int)httpd->socks.size();
-        unsigned int maxfd = 0;
-        for(int fds = 0; fds < nserver; fds++) {
-            if (httpd->socks[fds] > maxfd)
-                maxfd = httpd->socks[fds];
-        }
-        int fdsetsz = howmany(maxfd + 1, NFDBITS) * sizeof(fd_mask);
-        fd_set *fdset = (fd_set *)malloc(fdsetsz);
-
-#if HAVE_INET6
-        struct sockaddr_storage client;
-#else
-        char client[sizeof(sockaddr_in)];
+        if (!httpd->mimetable)
+            httpd->mimetable = mime_table_create(httpd);
+#ifndef _WIN32
+        // requests resolve below the root with openat.
+        httpd->root = server::get_realpath(httpd->root + "/");
+        if (httpd->root_fd < 0)
+            httpd->root_fd = open(httpd->root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (!httpd->fdcache)
+            httpd->fdcache = fd_cache_create(httpd);
+        if (!httpd->pathcache)
+            httpd->pathcache = path_cache_create(httpd);
+        if (!httpd->memcache)
+            httpd->memcache = mem_cache_create("mem",
+                    httpd->mem_cache_size, 0, httpd->mem_cache_file, false);
+#ifdef WITH_IO_URING
+        // pooled workers send hits from it as a fixed buffer.
+        if (httpd->memcache && !httpd->memcache->arena && httpd->io_uring && httpd->workers > 0)
+            httpd->memcache->arena = mem_arena_create(httpd->memcache->max_bytes * MEM_CACHE_SHARDS);
 #endif
-        int client_len = sizeof(client);
-        int fds, nfds;
-        char address[NI_MAXHOST], port[NI_MAXSERV];
-
-        for(;;) {
-            memset(fdset, 0, fdsetsz);
-
-            for(fds = 0; fds < nserver; fds++)
-                FD_SET(httpd->socks[fds], fdset);
-            nfds = select(maxfd + 1, fdset, NULL, NULL, NULL);
-            if (nfds == -1) {
-                if (errno == EBADF || errno == EINTR)
-                    break;
-                my_perror("select");
-                continue;
-            }
-            for(fds = 0; fds < nserver; fds++) {
-                int sock = httpd->socks[fds];
-
-                if (!FD_ISSET(sock, &fdset[fds]))
-                    continue;
-
-                memset(&client, 0, sizeof(client));
-                msgsock = accept(sock, (struct sockaddr *)&client, (socklen_t *)&client_len);
-                if (VERBOSE(3)) printf("* accepted socket %d\n", msgsock);
-                if (msgsock == -1) {
-                    if (errno != EINTR && errno != EWOULDBLOCK)
-                        if (VERBOSE(1)) my_perror("accept");
-                    closesocket(msgsock);
-                    break;
-                } else {
-                    if (httpd->family == AF_INET) {
-                        strcpy(address, inet_ntoa(((struct sockaddr_in *)(void*)&client)->sin_addr));
-                    } else {
-                        if (getnameinfo((struct sockaddr*)&client, client_len, address, sizeof(address), port,
-                                    sizeof(port), numeric_host | NI_NUMERICSERV))
-                            fprintf(stderr, "could not get peername\n");
-                    }
-
-                    server::HttpdInfo *pHttpdInfo = new server::HttpdInfo;
-                    pHttpdInfo->msgsock = msgsock;
-                    pHttpdInfo->httpd = httpd;
-                    pHttpdInfo->address = address;
-                    pHttpdInfo->port = port;
-                    pHttpdInfo->servno = fds;
-
-                    on = 1;
-                    if (setsockopt(msgsock, IPPROTO_TCP, TCP_NODELAY,
-                                &on, sizeof(on)) == -1)
-                        fprintf(stderr, "setsockopt TCP_NODELAY: %s\n", strerror(errno));
-
-                    timeout.tv_sec = 3;
-                    timeout.tv_usec = 0;
-                    if (setsockopt(msgsock, SOL_SOCKET, SO_SNDTIMEO,
-                                (char*)&timeout, sizeof(timeout)) == -1)
-                        fprintf(stderr, "setsockopt SO_SNDTIMEO: %s\n", strerror(errno));
-
-#if defined(_WIN32) && !defined(USE_PTHREAD)
-                    uintptr_t th;
-                    while ((int)(th = _beginthread((void (*)(void*))response_thread, 0, (void*)pHttpdInfo)) == -1) {
-                        Sleep(1);
-                    }
+        if (!httpd->mapcache)
+            httpd->mapcache = mem_cache_create("map",
+                    httpd->map_cache_size, httpd->mem_cache_file, httpd->map_cache_file, true);
+        if (!httpd->zipcache)
+            httpd->zipcache = zip_cache_create(httpd);
+        if (!httpd->listcache)
+            httpd->listcache = mem_cache_create("list", httpd->list_cache_size, 0, httpd->list_cache_size, false);
+        httpd->shards[0]->thread = pthread_self();
+        for (n = 1; n < nshard; n++) {
+            if (pthread_create(&httpd->shards[n]->thread, NULL,
+                        acceptor_thread, (void*)httpd->shards[n]) != 0)
+                my_perror("pthread_create");
+        }
+        acceptor_thread((void*)httpd->shards[0]);
+        for (n = 1; n < nshard; n++) {
+            if (httpd->shards[n]->thread)
+                pthread_join(httpd->shards[n]->thread, NULL);
+        }
 #else
-                    pthread_t pth;
-                    while (pthread_create(&pth, NULL, response_thread, (void*)pHttpdInfo) != 0) {
-                        usleep(100);
-                    }
-                    pthread_detach(pth);
+        accept_loop(httpd->shards[0]);
 #endif
-                }
-            }
-        }
-
-        delete[] fdset;
 
 #if defined(_WIN32) && !defined(USE_PTHREAD)
         _endthread();
@@ -2073,8 +6491,22 @@ request_end:
     bool server::stop() {
         if (!thread)
             return false;
-        if (verbose_mode >= 1)
+        if (verbose_mode >= 1) {
+#ifndef _WIN32
+            for(std::vector<Acceptor*>::iterator shard = shards.begin(); shard != shards.end(); shard++)
+            {
+                if ((*shard)->pool) pool_stats((*shard)->pool);
+                if ((*shard)->timers) wheel_stats((*shard)->timers);
+            }
+            if (fdcache) fd_cache_stats(fdcache);
+            if (pathcache) path_cache_stats(pathcache);
+            if (memcache) mem_cache_stats(memcache);
+            if (mapcache) mem_cache_stats(mapcache);
+            if (zipcache) zip_cache_stats(zipcache);
+            if (listcache) mem_cache_stats(listcache);
+#endif
             printf("exiting...\n");
+        }
         for(std::vector<unsigned int>::iterator sock = socks.begin(); sock != socks.end(); sock++){
             shutdown(*sock, SD_BOTH);
             closesocket(*sock);
@@ -2082,6 +6514,9 @@ request_end:
 #if defined(_WIN32) && !defined(USE_PTHREAD)
         TerminateThread(thread, 0);
 #else
+        for(std::vector<Acceptor*>::iterator shard = shards.begin(); shard != shards.end(); shard++)
+            if ((*shard)->thread && !pthread_equal((*shard)->thread, thread))
+                pthread_kill((*shard)->thread, SIGINT);
         pthread_kill(thread, SIGINT);
 #endif
         wait();
@@ -58,20 +58,63 @@
 
 namespace tthttpd {
 
+    struct WorkerPool;
+    struct TimerWheel;
+    struct Transfer;
+    struct FdCache;
+    struct PathCache;
+    struct MemCache;
+    struct ZipCache;
+    struct MimeTable;
+
     class server {
         public:
             typedef struct {
                 std::string name;
-                unsigned long size;
+                unsigned long long size;
+                time_t date;
                 bool isdir;
-                struct tm date;
             } ListInfo;
             typedef struct {
+                server *httpd;
+                std::vector<unsigned int> socks;
+                int epfd;
+                int cpu;
+                WorkerPool* pool;
+                TimerWheel* timers;
+#ifdef _WIN32
+                HANDLE thread;
+#else
+                pthread_t thread;
+#endif
+            } Acceptor;
+            typedef struct HttpdInfo {
                 int msgsock;
                 server *httpd;
+                Acceptor *acceptor;
+                struct sockaddr_storage peer;
+                socklen_t peer_len;
+                char *rbuf;
+                int rpos;
+                int rlen;
+                // the provided buffer rbuf was read into, or -1 when it
+                // is on the heap.
+                int rbuf_id;
                 std::string address;
                 std::string port;
                 int servno;
+                Transfer *transfer;
+                // deadline in the acceptor's timer wheel, and the list
+                // of idle keep-alive connections.
+                struct HttpdInfo *timer_prev;
+                struct HttpdInfo *timer_next;
+                struct HttpdInfo *idle_prev;
+                struct HttpdInfo *idle_next;
+                int timer_slot;
+                int timer_kind;
+                unsigned long expires;
+                unsigned long deadline;
+                bool parked;
             } HttpdInfo;
             typedef struct {
                 std::string user;
@@ -119,12 +162,48 @@ namespace tthttpd {
             AcceptAuths accept_auths;
             AcceptIPs accept_ips;
             MimeTypes mime_types;
+            MimeTable* mimetable;
             DefaultPages default_pages;
             RequestAliases request_aliases;
             RequestEnvironments request_environments;
             LoggerFunc loggerfunc;
             bool spawn_executable;
             int verbose_mode;
+            bool event_loop;
+            bool io_uring;
+            int workers;
+            int queue_depth;
+            int acceptors;
+            int header_timeout;
+            int body_timeout;
+            int keepalive_timeout;
+            int request_timeout;
+            int max_connections;
+            int fd_cache_size;
+            int fd_cache_check;
+            FdCache* fdcache;
+            int path_cache_size;
+            int path_cache_ttl;
+            PathCache* pathcache;
+            int root_fd;
+            long mem_cache_size;
+            long mem_cache_file;
+            MemCache* memcache;
+            long map_cache_size;
+            long map_cache_file;
+            MemCache* mapcache;
+            bool precompressed;
+            bool compress;
+            int compress_level;
+            int zstd_level;
+            long zip_cache_size;
+            long zip_cache_file;
+            ZipCache* zipcache;
+            int list_threads;
+            long list_cache_size;
+            int list_cache_ttl;
+            MemCache* listcache;
+            std::vector<Acceptor*> shards;
 
             void initialize() {
                 port = "www";
@@ -140,12 +219,47 @@ namespace tthttpd {
                 mime_types["xml"] = "text/xml";
                 mime_types["js"] = "application/x-javascript";
                 mime_types["css"] = "text/css";
+                mimetable = NULL;
                 default_pages.push_back("index.html");
                 default_pages.push_back("index.php");
                 default_pages.push_back("index.rb");
                 default_pages.push_back("index.cgi");
                 spawn_executable = false;
                 verbose_mode = 0;
+                event_loop = true;
+                io_uring = true;
+                workers = 32;
+                queue_depth = 1024;
+                acceptors = 1;
+                header_timeout = 10;
+                body_timeout = 30;
+                keepalive_timeout = 15;
+                request_timeout = 60;
+                max_connections = 0;
+                fd_cache_size = 256;
+                fd_cache_check = 5;
+                fdcache = NULL;
+                path_cache_size = 4096;
+                path_cache_ttl = 5;
+                pathcache = NULL;
+                root_fd = -1;
+                mem_cache_size = 16 * 1024 * 1024;
+                mem_cache_file = 64 * 1024;
+                memcache = NULL;
+                map_cache_size = 0;
+                map_cache_file = 8 * 1024 * 1024;
+                mapcache = NULL;
+                precompressed = false;
+                compress = false;
+                compress_level = 6;
+                zstd_level = 3;
+                zip_cache_size = 16 * 1024 * 1024;
+                zip_cache_file = 1024 * 1024;
+                zipcache = NULL;
+                list_threads = 4;
+                list_cache_size = 4 * 1024 * 1024;
+                list_cache_ttl = 5;
+                listcache = NULL;
             };
 
             server() {
@@ -187,6 +301,14 @@ namespace tthttpd {
                     path = fullpath;
                 }
 #endif
+                if (abspath[abspath.size()-1] == '/' && path[path.size()-1] != '/')
+                    path += "/";
+                return normalize_path(path);
+            }
+            // drops '..' with the component before it, without looking at
+            // the file system.
+            static std::string normalize_path(std::string abspath) {
+                std::string path = abspath;
                 std::replace(path.begin(), path.end(), '\\', '/');
                 size_t end_pos = path.find_last_of('?');
                 if (end_pos != std::string::npos) path.resize(end_pos);
@@ -198,6 +320,7 @@ namespace tthttpd {
                     it = std::find(path_sep.begin(), path_sep.end(), "..");
                     if (it == path_sep.end()) break;
                     if (it == path_sep.begin()) {
+                        path_sep.erase(it);
                         continue;
                     }
                     path_sep.erase(it-1);
@@ -0,0 +1,37 @@
+AC_DEFUN([AC_WITH_IO_URING],
+[
+AC_MSG_CHECKING(whether to check to support io_uring)
+AC_ARG_WITH(io-uring-support,
+[  --with-io-uring-support Check for io_uring support (default=yes)],
+[ with_io_uring_support="$withval" ],
+[ with_io_uring_support=yes ])
+AC_MSG_RESULT($with_io_uring_support)
+
+if test x"$with_io_uring_support" = x"yes"; then
+	case "$host_os" in
+	*linux*)
+		AC_CACHE_CHECK([for linux io_uring support],tthttpd_cv_HAVE_IO_URING,[
+		AC_TRY_COMPILE([\
+#include <sys/syscall.h>
+#include <linux/io_uring.h>],
+[\
+	struct io_uring_params p;
+	struct io_uring_sqe sqe;
+	int setup = __NR_io_uring_setup, enter = __NR_io_uring_enter;
+	sqe.opcode = IORING_OP_SPLICE;
+	sqe.ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe.len = IORING_POLL_ADD_MULTI;
+	p.features = IORING_FEAT_SINGLE_MMAP;
+],
+tthttpd_cv_HAVE_IO_URING=yes,tthttpd_cv_HAVE_IO_URING=no)])
+
+		if test x"$tthttpd_cv_HAVE_IO_URING" = x"yes"; then
+			AC_DEFINE(HAVE_IO_URING,1,[Whether the linux io_uring interface is available])
+			AC_DEFINE(WITH_IO_URING,1,[Whether io_uring support should be included])
+		fi
+	;;
+	*)
+	;;
+	esac
+fi
+])
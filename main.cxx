@@ -227,6 +227,60 @@ int main(int argc, char* argv[]) {
         else if (val.size()) httpd.verbose_mode = atol(val.c_str());
         val = configs["global"]["spawnexec"];
         if (val == "on") httpd.spawn_executable = true;
+        val = configs["global"]["eventloop"];
+        if (val == "off") httpd.event_loop = false;
+        val = configs["global"]["io_uring"];
+        if (val == "off") httpd.io_uring = false;
+        val = configs["global"]["precompressed"];
+        if (val == "on") httpd.precompressed = true;
+        val = configs["global"]["compress"];
+        if (val == "on") httpd.compress = true;
+        val = configs["global"]["compress_level"];
+        if (val.size()) httpd.compress_level = atol(val.c_str());
+        val = configs["global"]["zstd_level"];
+        if (val.size()) httpd.zstd_level = atol(val.c_str());
+        val = configs["global"]["zip_cache"];
+        if (val.size()) httpd.zip_cache_size = atol(val.c_str());
+        val = configs["global"]["zip_cache_file"];
+        if (val.size()) httpd.zip_cache_file = atol(val.c_str());
+        val = configs["global"]["list_threads"];
+        if (val.size()) httpd.list_threads = atol(val.c_str());
+        val = configs["global"]["list_cache"];
+        if (val.size()) httpd.list_cache_size = atol(val.c_str());
+        val = configs["global"]["list_cache_ttl"];
+        if (val.size()) httpd.list_cache_ttl = atol(val.c_str());
+        val = configs["global"]["workers"];
+        if (val.size()) httpd.workers = atol(val.c_str());
+        val = configs["global"]["queue_depth"];
+        if (val.size()) httpd.queue_depth = atol(val.c_str());
+        val = configs["global"]["acceptors"];
+        if (val.size()) httpd.acceptors = atol(val.c_str());
+        val = configs["global"]["header_timeout"];
+        if (val.size()) httpd.header_timeout = atol(val.c_str());
+        val = configs["global"]["body_timeout"];
+        if (val.size()) httpd.body_timeout = atol(val.c_str());
+        val = configs["global"]["keepalive_timeout"];
+        if (val.size()) httpd.keepalive_timeout = atol(val.c_str());
+        val = configs["global"]["request_timeout"];
+        if (val.size()) httpd.request_timeout = atol(val.c_str());
+        val = configs["global"]["max_connections"];
+        if (val.size()) httpd.max_connections = atol(val.c_str());
+        val = configs["global"]["fd_cache"];
+        if (val.size()) httpd.fd_cache_size = atol(val.c_str());
+        val = configs["global"]["fd_cache_check"];
+        if (val.size()) httpd.fd_cache_check = atol(val.c_str());
+        val = configs["global"]["path_cache"];
+        if (val.size()) httpd.path_cache_size = atol(val.c_str());
+        val = configs["global"]["path_cache_ttl"];
+        if (val.size()) httpd.path_cache_ttl = atol(val.c_str());
+        val = configs["global"]["mem_cache"];
+        if (val.size()) httpd.mem_cache_size = atol(val.c_str());
+        val = configs["global"]["mem_cache_file"];
+        if (val.size()) httpd.mem_cache_file = atol(val.c_str());
+        val = configs["global"]["map_cache"];
+        if (val.size()) httpd.map_cache_size = atol(val.c_str());
+        val = configs["global"]["map_cache_file"];
+        if (val.size()) httpd.map_cache_file = atol(val.c_str());
 
         config = configs["request/aliases"];
         for (it = config.begin(); it != config.end(); it++)
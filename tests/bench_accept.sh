@@ -0,0 +1,21 @@
+#!/bin/sh
+# accepts/sec with one acceptor against ACCEPTORS of them (the number of
+# cores by default), each connection carrying one HTTP/1.0 request for a
+# small file. run by "make bench".
+
+. "${srcdir:-.}/tests/server.sh"
+
+ACCEPTORS=${ACCEPTORS:-`getconf _NPROCESSORS_ONLN`}
+CLIENTS=${CLIENTS:-64}
+SECONDS_RUN=${SECONDS_RUN:-5}
+
+runs=1
+if [ "$ACCEPTORS" -gt 1 ]; then
+    runs="1 $ACCEPTORS"
+fi
+for acceptors in $runs; do
+    start_server "acceptors=$acceptors" || exit 1
+    printf "acceptors=%-3s " $acceptors
+    "$LOADGEN" -c $CLIENTS -t $SECONDS_RUN 127.0.0.1 $TEST_PORT /index.html
+    stop_server
+done
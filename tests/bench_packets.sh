@@ -0,0 +1,43 @@
+#!/bin/sh
+# TCP segments sent over loopback per response, from the OutSegs counter
+# of /proc/net/snmp before and after a fixed run. the counter is system
+# wide and takes in the client's requests and ACKs as well, so compare
+# runs on the same machine, not the numbers on their own. run by
+# "make bench".
+
+. "${srcdir:-.}/tests/server.sh"
+
+REQUESTS=${REQUESTS:-10000}
+
+if [ ! -r /proc/net/snmp ]; then
+    echo "bench_packets: /proc/net/snmp is not available" >&2
+    exit 77
+fi
+
+out_segs() {
+    awk '$1 == "Tcp:" && $2 != "RtoAlgorithm" { print $12 }' /proc/net/snmp
+}
+
+# a file for the memory cache, one going out by sendfile, and a
+# generated page.
+dd if=/dev/zero of="$TEST_DIR/root/small.bin" bs=1024 count=4 2> /dev/null
+dd if=/dev/zero of="$TEST_DIR/root/large.bin" bs=1024 count=256 2> /dev/null
+mkdir "$TEST_DIR/root/dir"
+for name in a b c d e f g h; do
+    echo $name > "$TEST_DIR/root/dir/$name.txt"
+done
+
+for config in io_uring=on io_uring=off; do
+    start_server $config || exit 1
+    for file in /small.bin /large.bin /dir/; do
+        for mode in "" -k; do
+            before=`out_segs`
+            "$LOADGEN" -n $REQUESTS $mode 127.0.0.1 $TEST_PORT $file > /dev/null || exit 1
+            after=`out_segs`
+            printf "%-13s %-11s %-11s segments/request: %s\n" $config $file \
+                `[ -n "$mode" ] && echo keep-alive || echo close` \
+                `awk "BEGIN { printf \"%.2f\", ($after - $before) / $REQUESTS }"`
+        done
+    done
+    stop_server
+done
@@ -0,0 +1,193 @@
+/*
+ * loadgen: a small HTTP load generator for the benchmarks in tests/.
+ *
+ *   loadgen [-c clients] [-n requests | -t seconds] [-k] host port path
+ *
+ * each client sends GET requests for path, on a new connection per
+ * request (HTTP/1.0), or with -k on one keep-alive connection
+ * (HTTP/1.1), and the totals are printed on one line. the exit status
+ * is 1 when any request failed or had other than a 2xx status.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+static struct addrinfo* target;
+static char request[1024];
+static int keep_alive;
+static long limit;
+static double deadline;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static long issued, requests, connections, errors;
+
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// the next request to make, or 0 when the run is over.
+static int next_request() {
+    int more;
+    pthread_mutex_lock(&lock);
+    more = limit > 0 ? issued < limit : now() < deadline;
+    if (more)
+        issued++;
+    pthread_mutex_unlock(&lock);
+    return more;
+}
+
+static int client_connect() {
+    int on = 1;
+    int sock = socket(target->ai_family, target->ai_socktype, target->ai_protocol);
+    if (sock < 0)
+        return -1;
+    if (connect(sock, target->ai_addr, target->ai_addrlen) < 0) {
+        close(sock);
+        return -1;
+    }
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return sock;
+}
+
+// reads one response; 1 when it was a 2xx, 0 otherwise, -1 when the
+// connection failed. without keep-alive the response ends with the
+// connection, with it at Content-Length; *closing is set when the server
+// is going to close a keep-alive connection after it.
+static int client_response(int sock, int* closing) {
+    static const char length_name[] = "\r\nContent-Length:";
+    char head[8192], buf[65536];
+    size_t len = 0;
+    long long body = -1, got = 0;
+    int status = 0;
+
+    for (;;) {
+        ssize_t r;
+        if (body < 0)
+            r = recv(sock, head + len, sizeof(head) - 1 - len, 0);
+        else
+            r = recv(sock, buf, sizeof(buf), 0);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return body >= 0 && !keep_alive ? status / 100 == 2 : -1;
+        if (body >= 0)
+            got += r;
+        else {
+            len += r;
+            head[len] = 0;
+            char* end = strstr(head, "\r\n\r\n");
+            if (!end) {
+                if (len == sizeof(head) - 1)
+                    return -1;
+                continue;
+            }
+            *end = 0;
+            status = len > 12 ? atoi(head + 9) : 0;
+            char* field = strcasestr(head, length_name);
+            body = field ? atoll(field + sizeof(length_name) - 1) : 0;
+            *closing = strcasestr(head, "\r\nConnection: close") != NULL;
+            got = (long long)(head + len - (end + 4));
+        }
+        if (keep_alive && got >= body)
+            return status / 100 == 2;
+    }
+}
+
+static void* client_thread(void* param) {
+    long done = 0, failed = 0, opened = 0;
+    int sock = -1;
+    (void)param;
+
+    while (next_request()) {
+        if (sock < 0) {
+            sock = client_connect();
+            if (sock < 0) {
+                failed++;
+                continue;
+            }
+            opened++;
+        }
+        int r = -1, closing = 0;
+        if (send(sock, request, strlen(request), 0) == (ssize_t)strlen(request))
+            r = client_response(sock, &closing);
+        if (r > 0)
+            done++;
+        else
+            failed++;
+        if (!keep_alive || r < 0 || closing) {
+            close(sock);
+            sock = -1;
+        }
+    }
+    if (sock >= 0)
+        close(sock);
+
+    pthread_mutex_lock(&lock);
+    requests += done;
+    errors += failed;
+    connections += opened;
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+static void usage() {
+    fprintf(stderr, "usage: loadgen [-c clients] [-n requests | -t seconds] [-k] host port path\n");
+    exit(2);
+}
+
+int main(int argc, char* argv[]) {
+    struct addrinfo hints;
+    int clients = 1, seconds = 0, c, n;
+
+    while ((c = getopt(argc, argv, "c:n:t:k")) != -1) {
+        switch (c) {
+            case 'c': clients = atoi(optarg); break;
+            case 'n': limit = atol(optarg); break;
+            case 't': seconds = atoi(optarg); break;
+            case 'k': keep_alive = 1; break;
+            default: usage();
+        }
+    }
+    if (argc - optind != 3 || clients <= 0 || (limit <= 0 && seconds <= 0))
+        usage();
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(argv[optind], argv[optind + 1], &hints, &target) != 0) {
+        fprintf(stderr, "loadgen: cannot resolve %s\n", argv[optind]);
+        return 2;
+    }
+    snprintf(request, sizeof(request),
+            keep_alive ? "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: keep-alive\r\n\r\n" : "GET %s HTTP/1.0\r\nHost: %s\r\n\r\n",
+            argv[optind + 2], argv[optind]);
+
+    pthread_t* threads = (pthread_t*)calloc(clients, sizeof(pthread_t));
+    double start = now();
+    deadline = start + seconds;
+    for (n = 0; n < clients; n++)
+        pthread_create(&threads[n], NULL, client_thread, NULL);
+    for (n = 0; n < clients; n++)
+        pthread_join(threads[n], NULL);
+    double elapsed = now() - start;
+
+    printf("requests: %ld, connections: %ld, errors: %ld, seconds: %.2f, "
+            "requests/sec: %.0f, accepts/sec: %.0f\n",
+            requests, connections, errors, elapsed,
+            requests / elapsed, connections / elapsed);
+    freeaddrinfo(target);
+    free(threads);
+    return errors ? 1 : 0;
+}
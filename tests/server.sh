@@ -0,0 +1,50 @@
+# helpers for the scripts in tests/: a scratch document root and a
+# tthttpd started on a config of its own. sourced, not run.
+
+TTHTTPD=${TTHTTPD:-./tthttpd}
+LOADGEN=${LOADGEN:-./tests/loadgen}
+TEST_PORT=${TEST_PORT:-18000}
+TEST_DIR=`mktemp -d ${TMPDIR:-/tmp}/tthttpd.XXXXXX` || exit 99
+SERVER_PID=
+
+mkdir "$TEST_DIR/root"
+echo "hello, world" > "$TEST_DIR/root/index.html"
+
+# start_server [config lines...]: runs tthttpd on TEST_PORT with the
+# scratch root and the given [global] keys, and waits until it answers.
+start_server() {
+    {
+        echo "[global]"
+        echo "port=$TEST_PORT"
+        echo "root=$TEST_DIR/root"
+        for line in "$@"; do
+            echo "$line"
+        done
+    } > "$TEST_DIR/tthttpd.conf"
+    $SERVER_ENV "$TTHTTPD" -c "$TEST_DIR/tthttpd.conf" > "$TEST_DIR/tthttpd.log" 2>&1 &
+    SERVER_PID=$!
+    tries=0
+    until "$LOADGEN" -n 1 127.0.0.1 $TEST_PORT /index.html > /dev/null 2>&1; do
+        tries=`expr $tries + 1`
+        if [ $tries -gt 50 ] || ! kill -0 $SERVER_PID 2> /dev/null; then
+            echo "tthttpd did not start:" >&2
+            cat "$TEST_DIR/tthttpd.log" >&2
+            return 1
+        fi
+        sleep 0.1
+    done
+}
+
+# tthttpd does not always exit on SIGTERM with connections parked, so
+# it is killed when it has not after a moment.
+stop_server() {
+    if [ -n "$SERVER_PID" ]; then
+        kill $SERVER_PID 2> /dev/null
+        sleep 0.2
+        kill -9 $SERVER_PID 2> /dev/null
+        wait $SERVER_PID 2> /dev/null
+        SERVER_PID=
+    fi
+}
+
+trap 'stop_server; rm -rf "$TEST_DIR"' EXIT
@@ -0,0 +1,42 @@
+#!/bin/sh
+# symlinks in the root may not lead out of it: a file and a directory
+# linked from outside are refused, with the caches on and off, while a
+# link that stays inside is served.
+
+TEST_PORT=${TEST_PORT:-18001}
+. "${srcdir:-.}/tests/server.sh"
+
+echo "secret" > "$TEST_DIR/secret.txt"
+mkdir "$TEST_DIR/outside"
+echo "secret" > "$TEST_DIR/outside/index.html"
+ln -s "$TEST_DIR/secret.txt" "$TEST_DIR/root/file"
+ln -s ../secret.txt "$TEST_DIR/root/relative"
+ln -s "$TEST_DIR/outside" "$TEST_DIR/root/outdir"
+ln -s index.html "$TEST_DIR/root/inside"
+failed=0
+
+# get PATH: whether two GETs of PATH, the second from whatever the first
+# cached, both had a 2xx status.
+get() {
+    "$LOADGEN" -n 2 127.0.0.1 $TEST_PORT "$1" > /dev/null 2>&1
+}
+
+check() {
+    start_server "$@" || exit 1
+    for path in /file /relative /outdir/index.html /outdir/; do
+        if get $path; then
+            echo "FAIL: $path was served with ${*:-the defaults}" >&2
+            failed=1
+        fi
+    done
+    if ! get /inside; then
+        echo "FAIL: /inside was not served with ${*:-the defaults}" >&2
+        failed=1
+    fi
+    stop_server
+}
+
+check
+check fd_cache=0 path_cache=0 mem_cache=0 map_cache=0
+
+exit $failed
@@ -0,0 +1,163 @@
+/*
+ * syscount: an LD_PRELOAD shim logging the calls that open or stat a
+ * path, for tests/warm_syscalls.sh. each call appends one line, the name
+ * of the call and its path, to the file named by SYSCOUNT_LOG. fstat is
+ * logged too, without a path, since the static path is meant to stat
+ * only what it has just opened. openat2 is made through syscall, which
+ * is wrapped to log it.
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int log_fd = -2;
+
+static void syscount(const char* call, const char* path) {
+    char line[4096];
+    int len;
+    if (log_fd == -2) {
+        const char* name = getenv("SYSCOUNT_LOG");
+        // the raw call, so as not to log the log.
+        log_fd = name ? (int)syscall(SYS_openat, AT_FDCWD, name,
+                O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644) : -1;
+    }
+    if (log_fd < 0)
+        return;
+    len = snprintf(line, sizeof(line), "%s %s\n", call, path ? path : "-");
+    if (len > (int)sizeof(line) - 1)
+        len = sizeof(line) - 1;
+    if (write(log_fd, line, len) < 0)
+        return;
+}
+
+#define NEXT(name) \
+    static __typeof__(name)* next; \
+    if (!next) \
+        next = (__typeof__(name)*)dlsym(RTLD_NEXT, #name)
+
+// open and openat take a mode only when they create.
+#define OPEN_MODE(flags, mode) \
+    do { \
+        if ((flags) & (O_CREAT | O_TMPFILE)) { \
+            va_list ap; \
+            va_start(ap, flags); \
+            mode = va_arg(ap, int); \
+            va_end(ap); \
+        } \
+    } while (0)
+
+int open(const char* path, int flags, ...) {
+    int mode = 0;
+    NEXT(open);
+    OPEN_MODE(flags, mode);
+    syscount("open", path);
+    return next(path, flags, mode);
+}
+
+int open64(const char* path, int flags, ...) {
+    int mode = 0;
+    NEXT(open64);
+    OPEN_MODE(flags, mode);
+    syscount("open", path);
+    return next(path, flags, mode);
+}
+
+int openat(int dirfd, const char* path, int flags, ...) {
+    int mode = 0;
+    NEXT(openat);
+    OPEN_MODE(flags, mode);
+    syscount("openat", path);
+    return next(dirfd, path, flags, mode);
+}
+
+int openat64(int dirfd, const char* path, int flags, ...) {
+    int mode = 0;
+    NEXT(openat64);
+    OPEN_MODE(flags, mode);
+    syscount("openat", path);
+    return next(dirfd, path, flags, mode);
+}
+
+int stat(const char* path, struct stat* st) {
+    NEXT(stat);
+    syscount("stat", path);
+    return next(path, st);
+}
+
+int stat64(const char* path, struct stat64* st) {
+    NEXT(stat64);
+    syscount("stat", path);
+    return next(path, st);
+}
+
+int lstat(const char* path, struct stat* st) {
+    NEXT(lstat);
+    syscount("lstat", path);
+    return next(path, st);
+}
+
+int lstat64(const char* path, struct stat64* st) {
+    NEXT(lstat64);
+    syscount("lstat", path);
+    return next(path, st);
+}
+
+int fstatat(int dirfd, const char* path, struct stat* st, int flags) {
+    NEXT(fstatat);
+    syscount("fstatat", path);
+    return next(dirfd, path, st, flags);
+}
+
+int fstatat64(int dirfd, const char* path, struct stat64* st, int flags) {
+    NEXT(fstatat64);
+    syscount("fstatat", path);
+    return next(dirfd, path, st, flags);
+}
+
+int fstat(int fd, struct stat* st) {
+    NEXT(fstat);
+    syscount("fstat", NULL);
+    return next(fd, st);
+}
+
+int fstat64(int fd, struct stat64* st) {
+    NEXT(fstat64);
+    syscount("fstat", NULL);
+    return next(fd, st);
+}
+
+int statx(int dirfd, const char* path, int flags, unsigned int mask, struct statx* st) {
+    NEXT(statx);
+    syscount("statx", path);
+    return next(dirfd, path, flags, mask, st);
+}
+
+int access(const char* path, int mode) {
+    NEXT(access);
+    syscount("access", path);
+    return next(path, mode);
+}
+
+long syscall(long number, ...) {
+    long arg[6];
+    va_list ap;
+    int n;
+    NEXT(syscall);
+    va_start(ap, number);
+    for (n = 0; n < 6; n++)
+        arg[n] = va_arg(ap, long);
+    va_end(ap);
+#ifdef SYS_openat2
+    if (number == SYS_openat2)
+        syscount("openat2", (const char*)(intptr_t)arg[1]);
+#endif
+    return next(number, arg[0], arg[1], arg[2], arg[3], arg[4], arg[5]);
+}
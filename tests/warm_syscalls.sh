@@ -0,0 +1,46 @@
+#!/bin/sh
+# the syscalls behind a plain GET of a static file, counted by the
+# tests/syscount.so shim: with the caches warm it opens and stats
+# nothing, and without caches it takes one openat and one fstat.
+
+. "${srcdir:-.}/tests/server.sh"
+
+SYSCOUNT=${SYSCOUNT:-`pwd`/tests/syscount.so}
+LOG="$TEST_DIR/calls.log"
+SERVER_ENV="env LD_PRELOAD=$SYSCOUNT SYSCOUNT_LOG=$LOG"
+REQUESTS=5
+failed=0
+
+# count CONFIG...: the calls logged over REQUESTS requests for
+# /index.html, once an earlier one has warmed up whatever it caches.
+count() {
+    start_server "$@" || exit 1
+    "$LOADGEN" -n 2 127.0.0.1 $TEST_PORT /index.html > /dev/null || exit 1
+    sleep 0.2
+    : > "$LOG"
+    "$LOADGEN" -n $REQUESTS 127.0.0.1 $TEST_PORT /index.html > /dev/null || exit 1
+    sleep 0.2
+    stop_server
+}
+
+# expect CALLS N: fails unless the log has N calls matching the pattern
+# CALLS. the uncached counts also show that the shim was loaded.
+expect() {
+    n=`grep -c -E "^($1) " "$LOG"`
+    if [ $n -ne $2 ]; then
+        echo "FAIL: $n calls of $1 over $REQUESTS requests, expected $2:" >&2
+        grep -E "^($1) " "$LOG" >&2
+        failed=1
+    fi
+}
+
+count
+expect "open|openat|openat2|stat|lstat|fstatat|statx|access" 0
+expect "fstat" 0
+
+count fd_cache=0 path_cache=0 mem_cache=0 map_cache=0
+expect "open|openat|openat2" $REQUESTS
+expect "stat|lstat|fstatat|statx|access" 0
+expect "fstat" $REQUESTS
+
+exit $failed
@@ -0,0 +1,243 @@
+/* Copyright 2009 by Yasuhiro Matsumoto
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "uring.h"
+
+#ifdef WITH_IO_URING
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+namespace tthttpd {
+
+    static int sys_io_uring_setup(unsigned entries, struct io_uring_params* p) {
+        return (int)syscall(__NR_io_uring_setup, entries, p);
+    }
+
+    static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+        return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+    }
+
+    static int sys_io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+        return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+    }
+
+    bool uring_init(URING* ring, unsigned entries) {
+        struct io_uring_params p;
+
+        memset(ring, 0, sizeof(URING));
+        memset(&p, 0, sizeof(p));
+        ring->fd = sys_io_uring_setup(entries, &p);
+        if (ring->fd < 0)
+            return false;
+
+        ring->entries = p.sq_entries;
+        ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+            if (ring->cq_ring_size > ring->sq_ring_size)
+                ring->sq_ring_size = ring->cq_ring_size;
+            ring->cq_ring_size = ring->sq_ring_size;
+        }
+
+        ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+        if (ring->sq_ring == MAP_FAILED)
+            goto fail;
+        if (p.features & IORING_FEAT_SINGLE_MMAP)
+            ring->cq_ring = ring->sq_ring;
+        else {
+            ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+            if (ring->cq_ring == MAP_FAILED) {
+                ring->cq_ring = NULL;
+                goto fail;
+            }
+        }
+        ring->sqes = (struct io_uring_sqe*)mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+        if (ring->sqes == MAP_FAILED) {
+            ring->sqes = NULL;
+            goto fail;
+        }
+
+        ring->sq_head = (unsigned*)((char*)ring->sq_ring + p.sq_off.head);
+        ring->sq_tail = (unsigned*)((char*)ring->sq_ring + p.sq_off.tail);
+        ring->sq_mask = (unsigned*)((char*)ring->sq_ring + p.sq_off.ring_mask);
+        ring->sq_array = (unsigned*)((char*)ring->sq_ring + p.sq_off.array);
+        ring->cq_head = (unsigned*)((char*)ring->cq_ring + p.cq_off.head);
+        ring->cq_tail = (unsigned*)((char*)ring->cq_ring + p.cq_off.tail);
+        ring->cq_mask = (unsigned*)((char*)ring->cq_ring + p.cq_off.ring_mask);
+        ring->cqes = (struct io_uring_cqe*)((char*)ring->cq_ring + p.cq_off.cqes);
+        return true;
+
+    fail:
+        uring_exit(ring);
+        return false;
+    }
+
+    void uring_exit(URING* ring) {
+        if (ring->sqes)
+            munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+        if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+            munmap(ring->sq_ring, ring->sq_ring_size);
+        if (ring->fd >= 0)
+            close(ring->fd);
+        memset(ring, 0, sizeof(URING));
+        ring->fd = -1;
+    }
+
+    bool uring_probe(URING* ring, int op) {
+        char buf[sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op)];
+        struct io_uring_probe *probe = (struct io_uring_probe*)buf;
+
+        memset(buf, 0, sizeof(buf));
+        if (sys_io_uring_register(ring->fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+            return false;
+        if (op > probe->last_op)
+            return false;
+        return (probe->ops[op].flags & IO_URING_OP_SUPPORTED) != 0;
+    }
+
+    struct io_uring_sqe* uring_get_sqe(URING* ring) {
+        unsigned tail = *ring->sq_tail + ring->sq_pending;
+        unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head >= ring->entries)
+            return NULL;
+        unsigned index = tail & *ring->sq_mask;
+        ring->sq_array[index] = index;
+        ring->sq_pending++;
+        memset(&ring->sqes[index], 0, sizeof(struct io_uring_sqe));
+        return &ring->sqes[index];
+    }
+
+    // publish the pending entries and optionally wait for completions.
+    // returns the number of entries consumed, or -errno.
+    int uring_submit(URING* ring, unsigned wait_nr) {
+        unsigned submit = ring->sq_pending;
+        if (submit)
+            __atomic_store_n(ring->sq_tail, *ring->sq_tail + submit, __ATOMIC_RELEASE);
+        ring->sq_pending = 0;
+        if (!submit && !wait_nr)
+            return 0;
+        int ret = sys_io_uring_enter(ring->fd, submit, wait_nr,
+                wait_nr ? IORING_ENTER_GETEVENTS : 0);
+        return ret < 0 ? -errno : ret;
+    }
+
+    struct io_uring_cqe* uring_peek_cqe(URING* ring) {
+        unsigned head = *ring->cq_head;
+        if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+            return NULL;
+        return &ring->cqes[head & *ring->cq_mask];
+    }
+
+    void uring_cqe_seen(URING* ring) {
+        __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+    }
+
+    // fixed buffers for the *_FIXED opcodes; the pages stay pinned while
+    // the ring lives.
+    bool uring_register_buffers(URING* ring, const struct iovec* iov, unsigned nr) {
+        return sys_io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, (void*)iov, nr) == 0;
+    }
+
+    // entries is at most 64, one bit of recycled each.
+    bool uring_bufs_init(URING* ring, URING_BUFS* bufs, unsigned short bgid,
+            unsigned entries, unsigned size) {
+        struct io_uring_sqe *sqe;
+        struct io_uring_cqe *cqe;
+
+        memset(bufs, 0, sizeof(URING_BUFS));
+        if (entries > 64)
+            return false;
+        void* base = mmap(NULL, (size_t)entries * size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED)
+            return false;
+        if ((sqe = uring_get_sqe(ring)) == NULL) {
+            munmap(base, (size_t)entries * size);
+            return false;
+        }
+        sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe->fd = entries;
+        sqe->addr = (unsigned long)base;
+        sqe->len = size;
+        sqe->off = 0;
+        sqe->buf_group = bgid;
+        int r;
+        while ((r = uring_submit(ring, 1)) == -EINTR)
+            ;
+        cqe = uring_peek_cqe(ring);
+        if (r < 0 || !cqe || cqe->res < 0) {
+            if (cqe)
+                uring_cqe_seen(ring);
+            munmap(base, (size_t)entries * size);
+            return false;
+        }
+        uring_cqe_seen(ring);
+        bufs->base = (char*)base;
+        bufs->entries = entries;
+        bufs->size = size;
+        bufs->bgid = bgid;
+        return true;
+    }
+
+    char* uring_bufs_get(URING_BUFS* bufs, unsigned bid) {
+        return bufs->base + (size_t)bid * bufs->size;
+    }
+
+    void uring_bufs_recycle(URING_BUFS* bufs, unsigned bid) {
+        bufs->recycled |= 1ULL << bid;
+    }
+
+    // the recycled buffers, handed back to the kernel ahead of whatever
+    // is queued next. returns the number of entries queued; each
+    // completes with user_data.
+    unsigned uring_bufs_queue(URING* ring, URING_BUFS* bufs, unsigned long long user_data) {
+        struct io_uring_sqe *sqe;
+        unsigned n = 0;
+
+        while (bufs->recycled && (sqe = uring_get_sqe(ring)) != NULL) {
+            unsigned bid = __builtin_ctzll(bufs->recycled);
+            sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+            sqe->fd = 1;
+            sqe->addr = (unsigned long)uring_bufs_get(bufs, bid);
+            sqe->len = bufs->size;
+            sqe->off = bid;
+            sqe->buf_group = bufs->bgid;
+            sqe->user_data = user_data;
+            bufs->recycled &= ~(1ULL << bid);
+            n++;
+        }
+        return n;
+    }
+
+}
+#endif
@@ -0,0 +1,85 @@
+/* Copyright 2009 by Yasuhiro Matsumoto
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _URING_H_
+#define _URING_H_
+
+#ifdef WITH_IO_URING
+#include <stddef.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+namespace tthttpd {
+
+    // a minimal io_uring, talking to the kernel with raw syscalls so that
+    // liburing is not needed. one ring must only be used by one thread.
+    typedef struct {
+        int fd;
+        unsigned entries;
+        unsigned *sq_head;
+        unsigned *sq_tail;
+        unsigned *sq_mask;
+        unsigned *sq_array;
+        unsigned *cq_head;
+        unsigned *cq_tail;
+        unsigned *cq_mask;
+        struct io_uring_sqe *sqes;
+        struct io_uring_cqe *cqes;
+        unsigned sq_pending;
+        void *sq_ring;
+        void *cq_ring;
+        size_t sq_ring_size;
+        size_t cq_ring_size;
+    } URING;
+
+    bool uring_init(URING* ring, unsigned entries);
+    void uring_exit(URING* ring);
+    bool uring_probe(URING* ring, int op);
+    struct io_uring_sqe* uring_get_sqe(URING* ring);
+    int uring_submit(URING* ring, unsigned wait_nr);
+    struct io_uring_cqe* uring_peek_cqe(URING* ring);
+    void uring_cqe_seen(URING* ring);
+    bool uring_register_buffers(URING* ring, const struct iovec* iov, unsigned nr);
+
+    // provided buffers of one size, which the kernel picks from for
+    // IOSQE_BUFFER_SELECT reads of group bgid. a buffer it has handed out
+    // is the reader's until it is recycled, and recycled buffers go back
+    // with the next submit that queues them.
+    typedef struct {
+        char *base;
+        unsigned entries;
+        unsigned size;
+        unsigned short bgid;
+        unsigned long long recycled;
+    } URING_BUFS;
+
+    bool uring_bufs_init(URING* ring, URING_BUFS* bufs, unsigned short bgid,
+            unsigned entries, unsigned size);
+    char* uring_bufs_get(URING_BUFS* bufs, unsigned bid);
+    void uring_bufs_recycle(URING_BUFS* bufs, unsigned bid);
+    unsigned uring_bufs_queue(URING* ring, URING_BUFS* bufs, unsigned long long user_data);
+
+}
+
+#endif
+
+#endif /* _URING_H_ */
@@ -59,6 +59,9 @@ namespace tthttpd {
 #ifndef SD_BOTH
 # define SD_BOTH SHUT_RDWR
 #endif
+#ifndef SD_SEND
+# define SD_SEND SHUT_WR
+#endif
 #endif
 
 #ifdef _UNICODE